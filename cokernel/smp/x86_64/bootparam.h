@@ -44,6 +44,7 @@ struct ihk_smp_boot_param_cpu {
 struct ihk_smp_boot_param_memory_chunk {
 	unsigned long start, end;
 	int numa_id;
+	int zeroed; /* Zero-filled by the host, no need to clear it */
 };
 
 #define IHK_SMP_MEMORY_TYPE_DRAM          0x01
@@ -21,7 +21,15 @@
 #define ihk_ikc_unmap_virtual(dev, v, n)   ihk_mc_unmap_virtual(v, n)
 
 #define ihk_ikc_get_processor_id ihk_mc_get_processor_id
+#define ihk_ikc_get_cpu_hint     ihk_mc_get_processor_id
 #define ihk_ikc_mb               ihk_mc_mb
+#define ihk_ikc_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ihk_ikc_load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+
+/* Trace areas are attached once per boot and never freed */
+#define ihk_ikc_get_tsc          rdtsc
+#define ihk_ikc_trace_get(p)     ihk_ikc_load_acquire(&(p))
+#define ihk_ikc_trace_put()      do { } while (0)
 
 #define ihk_os_to_dev(os)        NULL
 
@@ -39,6 +47,7 @@ typedef void * ihk_wait_t;
 #include <ihk/atomic.h>
 #include <ihk/lock.h>
 #include <ihk/mm.h>
+#include <registers.h>
 #include <errno.h>
 
 #define IHK_EXPORT_SYMBOL(x)
@@ -53,6 +62,8 @@ typedef void * ihk_wait_t;
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
+#include <linux/rcupdate.h>
+#include <linux/timex.h>
 #ifdef __x86_64
 #include <linux/acpi.h>
 #endif /* __x86_64 */
@@ -83,7 +94,23 @@ typedef void * ihk_wait_t;
 #else /* __x86_64 */
 #define ihk_ikc_get_processor_id() smp_processor_id()
 #endif /* __x86_64 */
+/* Current CPU for picking a queue, the caller may migrate right after */
+#define ihk_ikc_get_cpu_hint()    raw_smp_processor_id()
 #define ihk_ikc_mb                mb
+#ifdef smp_store_release
+#define ihk_ikc_store_release     smp_store_release
+#define ihk_ikc_load_acquire      smp_load_acquire
+#else
+#define ihk_ikc_store_release(p, v) \
+	do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while (0)
+#define ihk_ikc_load_acquire(p) \
+	({ typeof(*(p)) __v = ACCESS_ONCE(*(p)); smp_mb(); __v; })
+#endif
+
+/* The host frees trace areas, an RCU grace period after detaching them */
+#define ihk_ikc_get_tsc           get_cycles
+#define ihk_ikc_trace_get(p)      ({ rcu_read_lock(); rcu_dereference(p); })
+#define ihk_ikc_trace_put()       rcu_read_unlock()
 
 #define kprintf                  printk
 
@@ -94,11 +121,27 @@ ihk_device_t ihk_os_to_dev(ihk_os_t);
 #define ihk_ikc_get_unique_channel_id ihk_os_get_unique_channel_id
 #define ihk_ikc_get_channel_list_lock ihk_os_get_ikc_channel_lock
 #define ihk_ikc_get_channel_list      ihk_os_get_ikc_channel_list
+#define ihk_ikc_insert_channel        ihk_os_insert_ikc_channel
+#define ihk_ikc_remove_channel        ihk_os_remove_ikc_channel
+#define ihk_ikc_lookup_channel        ihk_os_lookup_ikc_channel
 
 #define ihk_ikc_get_regular_channel   ihk_os_get_regular_channel
 #define ihk_ikc_set_regular_channel   ihk_os_set_regular_channel
+#define ihk_ikc_get_remote_nr_cpus    ihk_os_get_num_cpus
 #endif
 
+/*
+ * Statistics are plain counters, bumped by the side that does the work
+ * (senders for send counters, the reader for receive ones) without
+ * atomics, as they are on every send and receive. Concurrent senders of
+ * a channel may lose an update now and then.
+ */
+typedef unsigned long ihk_ikc_stat_t;
+#define ihk_ikc_stat_read(s)     (*(volatile ihk_ikc_stat_t *)&(s))
+#define ihk_ikc_stat_set(s, v)   (ihk_ikc_stat_read(s) = (v))
+#define ihk_ikc_stat_add(s, n) \
+	ihk_ikc_stat_set(s, ihk_ikc_stat_read(s) + (n))
+
 #include <ikc/queue.h>
 
 struct ihk_ikc_queue_head;
@@ -124,10 +167,17 @@ struct ihk_ikc_channel_desc *ihk_ikc_get_master_channel(ihk_os_t os);
 struct list_head *ihk_ikc_get_channel_list(ihk_os_t os);
 ihk_spinlock_t *ihk_ikc_get_channel_list_lock(ihk_os_t ihk_os);
 
+/* Channel ID to descriptor table, lookups take no lock */
+int ihk_ikc_insert_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c);
+void ihk_ikc_remove_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c);
+struct ihk_ikc_channel_desc *ihk_ikc_lookup_channel(ihk_os_t os, int id);
+
 struct ihk_ikc_channel_desc *ihk_ikc_get_regular_channel(ihk_os_t os, int cpu);
 void ihk_ikc_set_regular_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c, int cpu);
 
 int ihk_ikc_get_unique_channel_id(ihk_os_t ihk_os);
+/* Number of CPUs of the other side, which intr_cpu is an index of */
+int ihk_ikc_get_remote_nr_cpus(ihk_os_t os);
 void ihk_ikc_notify_remote_read(struct ihk_ikc_channel_desc *c);
 void ihk_ikc_notify_remote_write(struct ihk_ikc_channel_desc *c);
 
@@ -27,17 +27,30 @@ struct ihk_ikc_listen_param {
 	int pkt_size;
 	int queue_size;
 	int magic;
+	enum ihk_ikc_channel_flag flag; /* IKC_FLAG_VARLEN, IKC_FLAG_SPSC */
 };
 
+struct ihk_ikc_connect_param;
+
+/* Called when the reply to ihk_ikc_connect_async() arrives */
+typedef void (*ihk_ikc_connect_done_t)(struct ihk_ikc_connect_param *p,
+                                        int status);
+
 struct ihk_ikc_connect_param {
 	int port;
 	int pkt_size;
 	int queue_size;
 	int magic;
 	int intr_cpu;
+	enum ihk_ikc_channel_flag flag; /* IKC_FLAG_VARLEN, IKC_FLAG_SPSC */
 	ihk_ikc_ph_t               handler;
 
 	struct ihk_ikc_channel_desc *channel;
+
+	/* ihk_ikc_connect_async() */
+	ihk_ikc_connect_done_t done;
+	void *priv;
+	void *req; /* in flight, for ihk_ikc_connect_finish() */
 };
 
 struct ihk_ikc_channel_info {
@@ -45,12 +58,23 @@ struct ihk_ikc_channel_info {
 	struct ihk_ikc_channel_desc *channel;
 /* filled by listen handler */
 	ihk_ikc_ph_t packet_handler;
+	ihk_ikc_batch_ph_t batch_packet_handler; /* optional */
+};
+
+/* Waiters for master replies are hashed by (msg, ref) */
+#define IHK_IKC_MASTER_WAIT_HASH_SIZE 64
+
+struct ihk_ikc_master_wait_bucket {
+	ihk_spinlock_t   lock;
+	struct list_head list;
 };
 
 struct ihk_ikc_master_wait_struct {
 	struct list_head list;
 	ihk_wait_t       wait;
 	int status;
+	/* Called on the reply under the bucket lock, must not sleep */
+	void (*func)(struct ihk_ikc_master_wait_struct *ws);
 	uint32_t msg;
 	uint32_t ref;
 	struct ihk_ikc_master_packet res;
@@ -58,7 +82,47 @@ struct ihk_ikc_master_wait_struct {
 
 int ihk_ikc_listen_port(ihk_os_t os, struct ihk_ikc_listen_param *param);
 int ihk_ikc_connect(ihk_os_t os, struct ihk_ikc_connect_param *p);
+int ihk_ikc_connect_async(ihk_os_t os, struct ihk_ikc_connect_param *p);
+int ihk_ikc_connect_finish(ihk_os_t os, struct ihk_ikc_connect_param *p);
+int ihk_ikc_connect_bulk(ihk_os_t os, struct ihk_ikc_connect_param *p, int n);
 int ihk_ikc_disconnect(struct ihk_ikc_channel_desc *c);
 void ihk_ikc_destroy_channel(struct ihk_ikc_channel_desc *c);
 
+/*
+ * Multi-queue channel: one logical connection to a port backed by
+ * several ordinary channels. Each sender CPU uses the sub-channel of its
+ * group, so CPUs of different groups never share a ring, and the
+ * receiver drains all of them.
+ */
+struct ihk_ikc_mq_channel {
+	int size;
+	int nr_queues;
+	unsigned int next; /* Sub-channel drained first next time */
+	struct ihk_ikc_channel_desc *channels[];
+};
+
+struct ihk_ikc_mq_channel *ihk_ikc_mq_alloc(int size);
+int ihk_ikc_mq_add(struct ihk_ikc_mq_channel *mq,
+                   struct ihk_ikc_channel_desc *c);
+int ihk_ikc_mq_connect(ihk_os_t os, struct ihk_ikc_connect_param *p,
+                       int nr_queues, struct ihk_ikc_mq_channel **mqp);
+int ihk_ikc_mq_disconnect(struct ihk_ikc_mq_channel *mq);
+void ihk_ikc_mq_destroy(struct ihk_ikc_mq_channel *mq);
+int ihk_ikc_mq_send(struct ihk_ikc_mq_channel *mq, void *p, int opt);
+int ihk_ikc_mq_recv(struct ihk_ikc_mq_channel *mq,
+                    ihk_ikc_ph_t h, void *harg, int opt);
+
+/* Sub-channel the calling CPU sends on, NULL if there is none yet */
+static inline struct ihk_ikc_channel_desc *
+ihk_ikc_mq_local(struct ihk_ikc_mq_channel *mq)
+{
+	int n = ihk_ikc_load_acquire(&mq->nr_queues);
+
+	if (!n) {
+		return NULL;
+	}
+
+	return mq->channels[ihk_ikc_get_cpu_hint() % n];
+}
+
 #endif
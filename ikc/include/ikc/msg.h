@@ -14,6 +14,21 @@
 #define IHK_IKC_MASTER_MSG_CONNECT_REPLY 0x20000002
 #define IHK_IKC_MASTER_MSG_DISCONNECT    0x20000008
 #define IHK_IKC_MASTER_MSG_PACKET_ON_CHANNEL 0x20000010
+#define IHK_IKC_MASTER_MSG_TRACE         0x20000020 /* Host to kernel */
+
+/*
+ * CONNECT param[0] is (packet size << 32 | flags | port). Acceptors that
+ * predate the flags reject the message as an invalid port, which lets the
+ * connector fall back to a plain connection. The reply carries the flags
+ * that were agreed on in param[4].
+ */
+#define IHK_IKC_CONNECT_PORT_MASK        0xffff
+#define IHK_IKC_CONNECT_QUEUE_V2         (1 << 16)
+#define IHK_IKC_CONNECT_VARLEN           (1 << 17) /* Sender can write them */
+#define IHK_IKC_CONNECT_SPSC             (1 << 18) /* One sender, one receiver */
+#define IHK_IKC_CONNECT_FLAGS            (IHK_IKC_CONNECT_QUEUE_V2 | \
+                                          IHK_IKC_CONNECT_VARLEN | \
+                                          IHK_IKC_CONNECT_SPSC)
 
 struct ihk_ikc_master_packet {
 	struct ihk_ikc_packet_header header;
@@ -16,6 +16,8 @@ struct ihk_ikc_queue_desc;
 
 typedef int (*ihk_ikc_ph_t)(struct ihk_ikc_channel_desc *,
                             void *, void *);
+typedef int (*ihk_ikc_batch_ph_t)(struct ihk_ikc_channel_desc *,
+                                  void **, int, void *);
 
 struct ihk_ikc_queue_head {
 /* 0 */
@@ -34,10 +36,73 @@ struct ihk_ikc_queue_head {
 	uint32_t        channel_id;
 	uint32_t        read_cpu;
 	uint32_t        write_cpu;
-	uint32_t        dummy2;
+	uint32_t        msgsize; /* Variable-length queues: default length */
 /* 64 */
 };
 
+/* ihk_ikc_queue_head.flag, set by the side that owns (reads) the queue */
+#define IKC_QUEUE_FLAG_V2        0x1
+#define IKC_QUEUE_FLAG_VARLEN    0x2
+#define IKC_QUEUE_FLAG_EVENT_IDX 0x4 /* v2 only, see notify_off */
+#define IKC_QUEUE_FLAG_SPSC      0x8 /* One writer and one reader */
+#define IKC_QUEUE_FLAG_NT_COPY   0x10 /* Writers use non-temporal stores */
+
+/*
+ * Layout version 2. The v1 head only carries the configuration, which
+ * both sides merely read on the fast path, while the producer and the
+ * consumer indices sit on cache lines of their own. pktcount is a power
+ * of two so that slots are found with a mask. read_off, max_read_off and
+ * write_off of the embedded v1 head are unused.
+ */
+struct ihk_ikc_queue_head_v2 {
+	struct ihk_ikc_queue_head head;
+/* 64: producers */
+	uint64_t        write_off;
+	uint64_t        max_read_off;
+	/*
+	 * Set by a writer that waits for room, the reader interrupts it
+	 * once it has moved read_off (event index queues only).
+	 */
+	uint64_t        room_wait;
+	uint64_t        pad_producer[5];
+/* 128: consumers */
+	uint64_t        read_off;
+	/*
+	 * With IKC_QUEUE_FLAG_EVENT_IDX the reader wants an interrupt only
+	 * for a packet published at this offset, writers that publish
+	 * packets beyond it know that the reader is still busy.
+	 */
+	uint64_t        notify_off;
+	uint64_t        pad_consumer[6];
+/* 192 */
+};
+
+/* Index fields of a queue of either layout, usable as lvalues */
+#define IHK_IKC_Q(q, field) \
+	(*(((q)->flag & IKC_QUEUE_FLAG_V2) ? \
+	   &((struct ihk_ikc_queue_head_v2 *)(q))->field : &(q)->field))
+
+static inline unsigned long ihk_ikc_queue_head_size(struct ihk_ikc_queue_head *q)
+{
+	return (q->flag & IKC_QUEUE_FLAG_V2) ?
+		sizeof(struct ihk_ikc_queue_head_v2) :
+		sizeof(struct ihk_ikc_queue_head);
+}
+
+/*
+ * Variable-length queues store length-prefixed records that occupy one or
+ * more contiguous slots of IHK_IKC_VARLEN_SLOT_SIZE bytes. A record never
+ * wraps around the end of the ring, the slots left at the end are covered
+ * by a skip marker (len == IHK_IKC_RECORD_SKIP) instead.
+ */
+#define IHK_IKC_VARLEN_SLOT_SIZE 64
+#define IHK_IKC_RECORD_SKIP      0
+
+struct ihk_ikc_record_head {
+	uint32_t        len;    /* Payload bytes */
+	uint32_t        nslots; /* Slots taken, including this head */
+};
+
 struct ihk_ikc_queue_desc {
 	struct ihk_ikc_queue_head *queue;  /* Virtual address */
 	struct ihk_ikc_queue_head  cache;  /* Cache for local reference */
@@ -45,6 +110,10 @@ struct ihk_ikc_queue_desc {
 	unsigned long              qphys;  /* Local physical memory */
 	ihk_spinlock_t             lock;
 	uint32_t                   intr_cpu;
+	uint64_t                   event_off; /* Sender: checked up to */
+	/* Zero-copy reception (IKC_FLAG_NO_COPY) */
+	uint64_t                   lease_off; /* Next slot to hand out */
+	unsigned long              *lease_map; /* Released, not yet retired */
 };
 
 enum ihk_ikc_channel_flag {
@@ -53,6 +122,9 @@ enum ihk_ikc_channel_flag {
 	IKC_FLAG_DESTROY_ACKED  = 4,
 	IKC_FLAG_STATUS_MASK    = 7,
 	IKC_FLAG_NO_COPY        = 0x10,
+	IKC_FLAG_QUEUE_V2       = 0x20,
+	IKC_FLAG_VARLEN         = 0x40,
+	IKC_FLAG_SPSC           = 0x80,
 };
 
 struct ihk_ikc_packet_header {
@@ -64,6 +136,23 @@ struct ihk_ikc_free_packet {
 	struct list_head list;
 };
 
+/* Counters of a channel, reset with ihk_ikc_channel_stats_reset() */
+struct ihk_ikc_channel_stats {
+	ihk_ikc_stat_t sent;
+	ihk_ikc_stat_t sent_bytes;
+	ihk_ikc_stat_t received;
+	ihk_ikc_stat_t received_bytes;
+	ihk_ikc_stat_t queue_full;    /* Send found no room */
+	ihk_ikc_stat_t write_retries; /* Send retried after waiting */
+	ihk_ikc_stat_t busy;          /* Send gave up, -EBUSY/-EAGAIN */
+	ihk_ikc_stat_t notify_ipis;   /* Interrupts sent to the peer */
+	ihk_ikc_stat_t max_occupancy; /* Slots pending in the recv queue */
+	ihk_ikc_stat_t pool_mallocs;  /* Packets not from the pool */
+};
+
+#define ihk_ikc_channel_stat_add(c, field, n) \
+	ihk_ikc_stat_add((c)->stats.field, n)
+
 struct ihk_ikc_channel_desc {
 	struct list_head           list_all;
 	ihk_os_t                   remote_os;
@@ -76,19 +165,44 @@ struct ihk_ikc_channel_desc {
 	ihk_spinlock_t             lock;
 	enum ihk_ikc_channel_flag  flag;
 	ihk_ikc_ph_t               handler;
-	struct list_head           packet_pool;
-	ihk_spinlock_t             packet_pool_lock;
+	ihk_ikc_batch_ph_t         batch_handler;
+	/* Preallocated packets of copying reception, a lock-free stack */
+	char                       *packet_pool;
+	uint32_t                   *packet_pool_next;
+	uint64_t                   packet_pool_head; /* Tag << 32 | index + 1 */
+	int                        packet_pool_size;
+	struct ihk_ikc_channel_stats stats;
 };
 
 struct ihk_ikc_free_packet *ihk_ikc_alloc_packet(struct ihk_ikc_channel_desc *c);
 void ihk_ikc_release_packet(struct ihk_ikc_free_packet *p);
+void ihk_ikc_release_lease(struct ihk_ikc_channel_desc *c, void *packet);
+int ihk_ikc_channel_set_nocopy(struct ihk_ikc_channel_desc *c);
+void ihk_ikc_channel_stats_reset(struct ihk_ikc_channel_desc *c);
 
 int ihk_ikc_init_queue(struct ihk_ikc_queue_head *q,
                        int id, int type, int size, int packetsize);
+int ihk_ikc_init_queue_flag(struct ihk_ikc_queue_head *q,
+                            int id, int type, int size, int packetsize,
+                            uint32_t flag);
 int ihk_ikc_queue_is_empty(struct ihk_ikc_queue_head *q);
 int ihk_ikc_queue_is_full(struct ihk_ikc_queue_head *q);
+uint64_t ihk_ikc_queue_want_room(struct ihk_ikc_queue_head *q);
 int ihk_ikc_read_queue(struct ihk_ikc_queue_head *q, void *packet, int flag);
 int ihk_ikc_write_queue(struct ihk_ikc_queue_head *q, void *packet, int flag);
+int ihk_ikc_write_queue_var(struct ihk_ikc_queue_head *q, void *packet,
+                            int len, int flag);
+int ihk_ikc_read_queue_handler(struct ihk_ikc_queue_head *q,
+                               struct ihk_ikc_channel_desc *c,
+                               ihk_ikc_ph_t h, void *harg, int flag);
+int ihk_ikc_read_queue_batch(struct ihk_ikc_queue_head *q,
+                             void **packets, int n, int flag);
+int ihk_ikc_write_queue_batch(struct ihk_ikc_queue_head *q,
+                              void **packets, int n, int flag);
+
+int ihk_ikc_write_queue_reserve(struct ihk_ikc_queue_head *q,
+                                void **slot, uint64_t *off);
+void ihk_ikc_write_queue_commit(struct ihk_ikc_queue_head *q, uint64_t off);
 
 struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
                                                     int port,
@@ -105,11 +219,37 @@ void ihk_ikc_disable_channel(struct ihk_ikc_channel_desc *channel);
 void ihk_ikc_channel_set_cpu(struct ihk_ikc_channel_desc *c, int cpu);
 
 #define IKC_NO_NOTIFY    0x100
+#define IKC_POLL         0x200 /* Receiver keeps polling, do not re-arm */
+#define IKC_NONBLOCK     0x400 /* Fail with -EAGAIN if the queue is full */
+#define IKC_MAY_SLEEP    0x800 /* Sender may sleep waiting for room */
 
 int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt);
+int ihk_ikc_send_var(struct ihk_ikc_channel_desc *channel, void *p, int len,
+                     int opt);
+int ihk_ikc_send_batch(struct ihk_ikc_channel_desc *channel,
+                       void **packets, int n, int opt);
+
+/* In-ring slot handed out by ihk_ikc_send_reserve() */
+struct ihk_ikc_send_slot {
+	void            *packet;
+	uint64_t        off;
+	unsigned long   flags;
+	int             opt;
+};
+
+int ihk_ikc_send_reserve(struct ihk_ikc_channel_desc *channel,
+                         struct ihk_ikc_send_slot *slot, int opt);
+int ihk_ikc_send_commit(struct ihk_ikc_channel_desc *channel,
+                        struct ihk_ikc_send_slot *slot);
 int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt);
 int ihk_ikc_recv_handler(struct ihk_ikc_channel_desc *channel, 
                          ihk_ikc_ph_t h, void *harg, int opt);
+
+/* Maximum number of packets claimed at once by ihk_ikc_recv_batch() */
+#define IHK_IKC_RECV_BATCH_MAX 32
+
+int ihk_ikc_recv_batch(struct ihk_ikc_channel_desc *channel,
+                       ihk_ikc_ph_t h, void *harg, int opt);
 int ihk_ikc_set_remote_queue(struct ihk_ikc_queue_desc *q, ihk_os_t os,
                              unsigned long rphys, unsigned long qsize);
 void ihk_ikc_system_init(ihk_os_t);
@@ -128,4 +268,25 @@ static inline int ihk_ikc_channel_enabled(struct ihk_ikc_channel_desc *c)
 	return (c->flag & IKC_FLAG_STATUS_MASK) == IKC_FLAG_ENABLED;
 }
 
+/* Length of a packet handed out by the receive functions of the channel */
+static inline int ihk_ikc_packet_length(struct ihk_ikc_channel_desc *c,
+                                        void *packet)
+{
+	if (c->recv.queue->flag & IKC_QUEUE_FLAG_VARLEN) {
+		return ((struct ihk_ikc_record_head *)packet - 1)->len;
+	}
+
+	return c->recv.queue->pktsize;
+}
+
+/* Length of a packet sent without one, see ihk_ikc_write_queue_var() */
+static inline int ihk_ikc_send_length(struct ihk_ikc_channel_desc *c)
+{
+	if (c->send.queue->flag & IKC_QUEUE_FLAG_VARLEN) {
+		return c->send.queue->msgsize;
+	}
+
+	return c->send.queue->pktsize;
+}
+
 #endif
@@ -0,0 +1,100 @@
+/**
+ * \file ikc/include/ikc/trace.h
+ * \brief IHK-IKC: Packet trace rings
+ *
+ * The host allocates a directory and one ring of entries per CPU of
+ * either side, and hands the directory to the kernel in a master packet.
+ * Each side appends to the rings of its own CPUs, a slot is claimed with
+ * a cmpxchg on the head of the ring so that nested interrupts and
+ * migrated callers cannot clash. Old entries are overwritten.
+ *
+ * Entries of a packet are matched by the queue (channel ID of its reader,
+ * stored in the queue head) and the offset in that queue. ENQUEUE and
+ * NOTIFY are recorded by the writer, DEQUEUE, IRQ and HANDLED by the
+ * reader, i.e. on the other side. A HANDLED entry covers the packets
+ * before its offset that have been dequeued.
+ */
+#ifndef HEADER_IHK_IKC_TRACE_H
+#define HEADER_IHK_IKC_TRACE_H
+
+#include <ikc/queue.h>
+
+#define IHK_IKC_TRACE_MAGIC          0x494b4354 /* "IKCT" */
+#define IHK_IKC_TRACE_ENTRIES_MIN    64
+#define IHK_IKC_TRACE_ENTRIES_MAX    (1 << 16)
+#define IHK_IKC_TRACE_NO_CHANNEL     0xffffffff
+
+enum ihk_ikc_trace_event {
+	IHK_IKC_TRACE_ENQUEUE = 1, /* Published to the reader */
+	IHK_IKC_TRACE_NOTIFY,      /* Reader interrupted, offset published */
+	IHK_IKC_TRACE_IRQ,         /* IKC interrupt taken, no channel */
+	IHK_IKC_TRACE_DEQUEUE,     /* Taken off the queue */
+	IHK_IKC_TRACE_HANDLED,     /* Handler returned */
+};
+
+enum ihk_ikc_trace_side {
+	IHK_IKC_TRACE_SIDE_HOST,
+	IHK_IKC_TRACE_SIDE_LWK,
+};
+
+/* Same layout as struct ihk_ikc_trace_entry of ihklib */
+struct ihk_ikc_trace_entry {
+	uint64_t tsc;
+	uint64_t off;
+	uint32_t channel;
+	uint32_t msg;   /* First word after the packet header */
+	uint16_t cpu;
+	uint8_t  event;
+	uint8_t  side;
+	uint32_t pad;
+};
+
+struct ihk_ikc_trace_ring {
+	uint64_t head;  /* Entries ever claimed */
+	uint64_t phys;  /* Of the entries */
+	uint64_t pad[6];
+};
+
+/* Shared by both sides, rings of the host CPUs come first */
+struct ihk_ikc_trace_dir {
+	uint32_t magic;
+	uint32_t enabled;
+	uint32_t nr_host_cpus;
+	uint32_t nr_lwk_cpus;
+	uint32_t nr_entries; /* Per ring, a power of two */
+	uint32_t pad0;
+	uint64_t ns_per_tsc; /* Of the kernel, ns per 1000 TSC */
+	uint64_t pad[5];
+	struct ihk_ikc_trace_ring rings[];
+};
+
+/* What one side writes to */
+struct ihk_ikc_trace {
+	struct ihk_ikc_trace_dir *dir;
+	struct ihk_ikc_trace_ring *rings;      /* Of the CPUs of this side */
+	struct ihk_ikc_trace_entry **entries;
+	int nr_cpus;
+	int side;
+};
+
+/* Set while a trace area is attached, see __ihk_ikc_trace() */
+extern struct ihk_ikc_trace *ihk_ikc_tracer;
+
+void __ihk_ikc_trace(int event, struct ihk_ikc_queue_head *q, uint64_t off,
+                     void *packet);
+
+static inline void ihk_ikc_trace(int event, struct ihk_ikc_queue_head *q,
+                                 uint64_t off, void *packet)
+{
+	if (ihk_ikc_tracer) {
+		__ihk_ikc_trace(event, q, off, packet);
+	}
+}
+
+int ihk_ikc_master_send_trace(ihk_os_t os, unsigned long phys,
+                              unsigned long size);
+#ifdef IHK_OS_MANYCORE
+int ihk_ikc_trace_attach(ihk_os_t os, unsigned long phys, unsigned long size);
+#endif
+
+#endif
@@ -0,0 +1,24 @@
+/**
+ * \file ikc/include/ikc/tracepoint.h
+ * \brief IHK-IKC: Tracepoints of the host, compiled out in the kernel
+ */
+#ifndef HEADER_IHK_IKC_TRACEPOINT_H
+#define HEADER_IHK_IKC_TRACEPOINT_H
+
+#ifdef IHK_OS_MANYCORE
+static inline void ihk_ikc_tp_none(int dummy, ...)
+{
+}
+
+#define ihk_ikc_tp(name, ...)        ihk_ikc_tp_none(0, __VA_ARGS__)
+#define ihk_ikc_tp_start(name)       0
+#define ihk_ikc_tp_ns(start)         ((void)(start), 0)
+#else
+#include <ihk_trace.h>
+
+#define ihk_ikc_tp(name, ...)        trace_##name(__VA_ARGS__)
+#define ihk_ikc_tp_start(name)       ihk_trace_start(name)
+#define ihk_ikc_tp_ns(start)         ihk_trace_ns(start)
+#endif
+
+#endif
@@ -7,12 +7,21 @@
  */
 #include <ikc/ihk.h>
 #include <ikc/master.h>
+#include <ikc/trace.h>
+#include <ihk/ihk_host_user.h>
+#include <ihk_trace.h>
 #include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
 #include <asm/bitops.h>
 #include <asm/smp.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
 
-#define IHK_IKC_SEND_RETRY	1000
+#define IHK_IKC_SEND_SPIN_MS	1000
+#define IHK_IKC_SEND_BACKOFF_MAX	1024
 #ifdef POSTK_DEBUG_TEMP_FIX_49 /* IHK_IKC_RECV_HANDLER_IN_WORKQ enabled */
 #define IHK_IKC_RECV_HANDLER_IN_WORKQ
 #else /* POSTK_DEBUG_TEMP_FIX_49 */
@@ -31,18 +40,28 @@ void ihk_ikc_linux_init_work_data(ihk_os_t ihk_os,
 void ihk_ikc_linux_schedule_work(ihk_os_t ihk_os);
 ihk_os_t ihk_ikc_linux_get_os_from_work(struct work_struct *work);
 
-static void __ihk_ikc_reception_handler(ihk_os_t os)
+struct ihk_ikc_poll;
+struct ihk_ikc_poll **ihk_host_os_get_ikc_poll(ihk_os_t ihk_os);
+wait_queue_head_t *ihk_host_os_get_ikc_send_wait(ihk_os_t ihk_os);
+
+/*
+ * Drain the channels that interrupt this CPU, returns the number of
+ * packets handled. opt is passed on to ihk_ikc_recv_batch().
+ */
+static int __ihk_ikc_reception_handler(ihk_os_t os, int opt)
 {
 	struct ihk_ikc_channel_desc *m_channel;
 	struct ihk_ikc_channel_desc *r_channel;
 	int found = 0;
+	int r;
 	//printk("%s: id=%d\n", __FUNCTION__, smp_processor_id());
 	if (smp_processor_id() == 0) {
 		m_channel = ihk_ikc_get_master_channel(os);
 		if (m_channel) {
-			while (ihk_ikc_channel_enabled(m_channel) &&
-			       !ihk_ikc_queue_is_empty(m_channel->recv.queue)) {
-				ihk_ikc_recv_handler(m_channel, m_channel->handler, os, 0);
+			r = ihk_ikc_recv_batch(m_channel, m_channel->handler,
+			                       os, opt);
+			if (r > 0) {
+				found += r;
 			}
 		}
 	}
@@ -52,33 +71,485 @@ static void __ihk_ikc_reception_handler(ihk_os_t os)
 		/* It is fine not to have this channel for CPU 0 as we may be
 		 * in initialization phase where only master channel exists yet.
 		 * Otherwise, print a warning */
-		if (smp_processor_id() > 0) {
+		if (smp_processor_id() > 0 && !(opt & IKC_POLL)) {
 			printk("%s: WARNING: r_channel for CPU %d does not exist\n",
 					__FUNCTION__, smp_processor_id());
 		}
-		return;
+		return found;
 	}
-	while (ihk_ikc_channel_enabled(r_channel) &&
-	       !ihk_ikc_queue_is_empty(r_channel->recv.queue)) {
-		found = 1;
-		ihk_ikc_recv_handler(r_channel, r_channel->handler, os, 0);
+	r = ihk_ikc_recv_batch(r_channel, r_channel->handler, os, opt);
+	if (r > 0) {
+		found += r;
 	}
 	if(!found) {
 		//printk("%s: WARNING: no handler is called,r_channel enabled=%d,is_empty=%d\n", __FUNCTION__, ihk_ikc_channel_enabled(r_channel), ihk_ikc_queue_is_empty(r_channel->recv.queue));
 	}
+
+	return found;
+}
+
+/*
+ * Busy polling. A kthread bound to each CPU that receives IKC interrupts
+ * keeps draining its channels until no packet arrived for usec
+ * microseconds, then re-arms the queues and sleeps until the next
+ * interrupt. While it spins the queues stay unarmed, so the LWK does not
+ * send IPIs for event index queues at all.
+ */
+struct ihk_ikc_poll_thread {
+	struct task_struct *task;
+	wait_queue_head_t wait;
+	int kicked;
+	ihk_os_t os;
+	struct ihk_ikc_poll *poll;
+};
+
+struct ihk_ikc_poll {
+	unsigned long usec;
+	struct ihk_ikc_poll_thread threads[];
+};
+
+static DEFINE_MUTEX(ihk_ikc_poll_mutex);
+
+static int ihk_ikc_poll_thread_func(void *arg)
+{
+	struct ihk_ikc_poll_thread *th = arg;
+	u64 budget = th->poll->usec * NSEC_PER_USEC;
+	u64 now, end;
+
+	while (!kthread_should_stop()) {
+		now = ktime_to_ns(ktime_get());
+		end = now + budget;
+
+		while (now < end && !kthread_should_stop()) {
+			/* Handlers expect to run as if in the IRQ handler */
+			local_irq_disable();
+			if (__ihk_ikc_reception_handler(th->os, IKC_POLL) > 0) {
+				end = ktime_to_ns(ktime_get()) + budget;
+			}
+			local_irq_enable();
+
+			if (need_resched()) {
+				schedule();
+			} else {
+				cpu_relax();
+			}
+			now = ktime_to_ns(ktime_get());
+		}
+
+		/* Out of budget, arm the queues and wait for an interrupt */
+		local_irq_disable();
+		__ihk_ikc_reception_handler(th->os, 0);
+		local_irq_enable();
+
+		wait_event_interruptible(th->wait,
+		                         th->kicked || kthread_should_stop());
+		th->kicked = 0;
+	}
+
+	return 0;
+}
+
+/* Called from the interrupt handler, resume polling on this CPU */
+static void ihk_ikc_poll_kick(ihk_os_t os)
+{
+	struct ihk_ikc_poll *poll;
+	struct ihk_ikc_poll_thread *th;
+
+	rcu_read_lock();
+	poll = rcu_dereference(*ihk_host_os_get_ikc_poll(os));
+	if (poll) {
+		th = &poll->threads[smp_processor_id()];
+		if (th->task) {
+			th->kicked = 1;
+			wake_up(&th->wait);
+		}
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Start busy polling with a budget of usec microseconds, or stop it if
+ * usec is 0. Threads are started on CPU 0 (master channel) and on the
+ * CPUs that have a regular channel, i.e. the destinations of the IKC
+ * map, so it should be called once the kernel has set them up.
+ */
+int ihk_ikc_set_poll(ihk_os_t os, unsigned long usec)
+{
+	struct ihk_ikc_poll **pp = ihk_host_os_get_ikc_poll(os);
+	struct ihk_ikc_poll *poll, *old;
+	struct ihk_ikc_poll_thread *th;
+	int cpu;
+	int ret = 0;
+
+	mutex_lock(&ihk_ikc_poll_mutex);
+
+	old = *pp;
+	rcu_assign_pointer(*pp, NULL);
+	if (old) {
+		synchronize_rcu();
+		for_each_possible_cpu(cpu) {
+			if (old->threads[cpu].task) {
+				kthread_stop(old->threads[cpu].task);
+			}
+		}
+		kfree(old);
+	}
+
+	if (!usec) {
+		goto out;
+	}
+
+	poll = kzalloc(sizeof(*poll) + nr_cpu_ids * sizeof(poll->threads[0]),
+	               GFP_KERNEL);
+	if (!poll) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	poll->usec = usec;
+
+	for_each_online_cpu(cpu) {
+		if (cpu != 0 && !ihk_ikc_get_regular_channel(os, cpu)) {
+			continue;
+		}
+
+		th = &poll->threads[cpu];
+		init_waitqueue_head(&th->wait);
+		th->os = os;
+		th->poll = poll;
+		th->task = kthread_create(ihk_ikc_poll_thread_func, th,
+		                          "ihk_ikc_poll/%d", cpu);
+		if (IS_ERR(th->task)) {
+			ret = PTR_ERR(th->task);
+			th->task = NULL;
+			break;
+		}
+		kthread_bind(th->task, cpu);
+		wake_up_process(th->task);
+	}
+
+	if (ret) {
+		for_each_possible_cpu(cpu) {
+			if (poll->threads[cpu].task) {
+				kthread_stop(poll->threads[cpu].task);
+			}
+		}
+		kfree(poll);
+		goto out;
+	}
+
+	rcu_assign_pointer(*pp, poll);
+	printk("IHK-IKC: busy polling for %lu usec\n", usec);
+
+out:
+	mutex_unlock(&ihk_ikc_poll_mutex);
+	return ret;
+}
+
+/*
+ * Packet tracing. Only one OS is traced at a time as the hooks in the
+ * queue code know nothing but the queue. The area is detached when the
+ * OS shuts down, so that the trace can still be read, and freed when it
+ * is destroyed or traced again after a reboot.
+ */
+struct ihk_ikc_trace_host {
+	struct ihk_ikc_trace t;
+	ihk_os_t os;
+	int nr_entries;
+	int nr_rings;
+	struct ihk_ikc_trace_entry **rings; /* Host CPUs first */
+};
+
+static DEFINE_MUTEX(ihk_ikc_trace_mutex);
+static struct ihk_ikc_trace_host *ihk_ikc_trace_host;
+struct ihk_ikc_trace *ihk_ikc_tracer;
+
+static size_t ihk_ikc_trace_dir_size(int nr_rings)
+{
+	return sizeof(struct ihk_ikc_trace_dir) +
+		nr_rings * sizeof(struct ihk_ikc_trace_ring);
+}
+
+static void ihk_ikc_trace_free(struct ihk_ikc_trace_host *th)
+{
+	int order = get_order(th->nr_entries *
+	                      sizeof(struct ihk_ikc_trace_entry));
+	int i;
+
+	for (i = 0; th->rings && i < th->nr_rings; ++i) {
+		if (th->rings[i]) {
+			free_pages((unsigned long)th->rings[i], order);
+		}
+	}
+
+	if (th->t.dir) {
+		free_pages((unsigned long)th->t.dir,
+		           get_order(ihk_ikc_trace_dir_size(th->nr_rings)));
+	}
+	kfree(th->rings);
+	kfree(th);
+}
+
+static struct ihk_ikc_trace_host *ihk_ikc_trace_alloc(ihk_os_t os,
+                                                      int nr_entries,
+                                                      int nr_lwk_cpus)
+{
+	struct ihk_ikc_trace_host *th;
+	struct ihk_ikc_trace_dir *dir;
+	int order = get_order(nr_entries * sizeof(struct ihk_ikc_trace_entry));
+	size_t dir_size;
+	int i;
+
+	th = kzalloc(sizeof(*th), GFP_KERNEL);
+	if (!th) {
+		return NULL;
+	}
+
+	th->os = os;
+	th->nr_entries = nr_entries;
+	th->nr_rings = nr_cpu_ids + nr_lwk_cpus;
+	th->rings = kcalloc(th->nr_rings, sizeof(th->rings[0]), GFP_KERNEL);
+	if (!th->rings) {
+		goto err;
+	}
+
+	dir_size = ihk_ikc_trace_dir_size(th->nr_rings);
+	dir = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+	                               get_order(dir_size));
+	th->t.dir = dir;
+	if (!dir) {
+		goto err;
+	}
+
+	for (i = 0; i < th->nr_rings; ++i) {
+		th->rings[i] = (void *)__get_free_pages(GFP_KERNEL, order);
+		if (!th->rings[i]) {
+			goto err;
+		}
+		dir->rings[i].phys = virt_to_phys(th->rings[i]);
+	}
+
+	dir->magic = IHK_IKC_TRACE_MAGIC;
+	dir->nr_host_cpus = nr_cpu_ids;
+	dir->nr_lwk_cpus = nr_lwk_cpus;
+	dir->nr_entries = nr_entries;
+
+	th->t.rings = dir->rings;
+	th->t.entries = th->rings;
+	th->t.nr_cpus = nr_cpu_ids;
+	th->t.side = IHK_IKC_TRACE_SIDE_HOST;
+
+	return th;
+
+err:
+	ihk_ikc_trace_free(th);
+	return NULL;
+}
+
+/* Stop writing to the area of os, called with ihk_ikc_trace_mutex held */
+static void ihk_ikc_trace_detach(ihk_os_t os)
+{
+	struct ihk_ikc_trace_host *th = ihk_ikc_trace_host;
+
+	if (!th || th->os != os || ihk_ikc_tracer != &th->t) {
+		return;
+	}
+
+	th->t.dir->enabled = 0;
+	rcu_assign_pointer(ihk_ikc_tracer, NULL);
+	synchronize_rcu();
+}
+
+/*
+ * Trace the IKC packets of os in rings of entries entries per CPU, or
+ * pause tracing if entries is 0. The size of the rings cannot be changed
+ * while the OS is running.
+ */
+int ihk_ikc_set_trace(ihk_os_t os, unsigned long entries, int nr_lwk_cpus)
+{
+	struct ihk_ikc_trace_host *th;
+	int ret = 0;
+
+	mutex_lock(&ihk_ikc_trace_mutex);
+
+	th = ihk_ikc_trace_host;
+	if (th && th->os != os) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (!entries) {
+		if (th) {
+			th->t.dir->enabled = 0;
+		}
+		goto out;
+	}
+
+	if (entries > IHK_IKC_TRACE_ENTRIES_MAX) {
+		ret = -EINVAL;
+		goto out;
+	}
+	entries = roundup_pow_of_two(max_t(unsigned long, entries,
+	                                   IHK_IKC_TRACE_ENTRIES_MIN));
+
+	if (th && ihk_ikc_tracer == &th->t) {
+		if (entries != th->nr_entries) {
+			ret = -EBUSY;
+		} else {
+			th->t.dir->enabled = 1;
+		}
+		goto out;
+	}
+
+	/* Left over from an earlier boot */
+	if (th) {
+		ihk_ikc_trace_host = NULL;
+		ihk_ikc_trace_free(th);
+	}
+
+	if (nr_lwk_cpus <= 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	th = ihk_ikc_trace_alloc(os, entries, nr_lwk_cpus);
+	if (!th) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	th->t.dir->enabled = 1;
+	ret = ihk_ikc_master_send_trace(os, virt_to_phys(th->t.dir),
+	                                ihk_ikc_trace_dir_size(th->nr_rings));
+	if (ret) {
+		ihk_ikc_trace_free(th);
+		goto out;
+	}
+
+	ihk_ikc_trace_host = th;
+	rcu_assign_pointer(ihk_ikc_tracer, &th->t);
+	printk("IHK-IKC: tracing with %lu entries per CPU\n", entries);
+
+out:
+	mutex_unlock(&ihk_ikc_trace_mutex);
+	return ret;
+}
+
+/*
+ * Copy the entries of all rings to user space, unsorted. With a NULL
+ * buffer only the number of entries is returned.
+ */
+int ihk_ikc_get_trace(ihk_os_t os, unsigned long arg)
+{
+	struct ihk_ikc_trace_req req;
+	struct ihk_ikc_trace_entry __user *ubuf;
+	struct ihk_ikc_trace_host *th;
+	uint64_t head, start, n, idx, chunk;
+	int count = 0;
+	int ret = 0;
+	int i;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+		return -EFAULT;
+	}
+	ubuf = (struct ihk_ikc_trace_entry __user *)req.entries;
+	if (ubuf && req.num < 0) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&ihk_ikc_trace_mutex);
+
+	th = ihk_ikc_trace_host;
+	if (!th || th->os != os) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	for (i = 0; i < th->nr_rings; ++i) {
+		head = ihk_ikc_load_acquire(&th->t.dir->rings[i].head);
+		n = min_t(uint64_t, head, th->nr_entries);
+		if (!ubuf) {
+			count += n;
+			continue;
+		}
+
+		n = min_t(uint64_t, n, req.num - count);
+		start = head - n;
+		while (n) {
+			idx = start & (th->nr_entries - 1);
+			chunk = min_t(uint64_t, n, th->nr_entries - idx);
+			if (copy_to_user(ubuf + count, th->rings[i] + idx,
+			                 chunk * sizeof(*ubuf))) {
+				ret = -EFAULT;
+				goto out;
+			}
+			count += chunk;
+			start += chunk;
+			n -= chunk;
+		}
+	}
+
+	req.num = count;
+	req.ns_per_tsc = th->t.dir->ns_per_tsc;
+	if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
+		ret = -EFAULT;
+	}
+
+out:
+	mutex_unlock(&ihk_ikc_trace_mutex);
+	return ret;
+}
+
+/* The OS is gone, free its trace area */
+void ihk_ikc_trace_release(ihk_os_t os)
+{
+	struct ihk_ikc_trace_host *th;
+
+	mutex_lock(&ihk_ikc_trace_mutex);
+	th = ihk_ikc_trace_host;
+	if (th && th->os == os) {
+		ihk_ikc_trace_detach(os);
+		ihk_ikc_trace_host = NULL;
+		ihk_ikc_trace_free(th);
+	}
+	mutex_unlock(&ihk_ikc_trace_mutex);
+}
+
+/* The reader made room in one of our send queues, or may have */
+static void ihk_ikc_wake_senders(ihk_os_t os)
+{
+	wait_queue_head_t *wq = ihk_host_os_get_ikc_send_wait(os);
+
+	/* Pairs with the check of read_off in ihk_ikc_wait_room() */
+	smp_mb();
+	if (waitqueue_active(wq)) {
+		wake_up(wq);
+	}
+}
+
+/* Drain the channels of this CPU on an interrupt */
+static void ihk_ikc_handle_interrupt(ihk_os_t os)
+{
+	u64 start = ihk_trace_start(ihk_ikc_interrupt);
+	int found;
+
+	found = __ihk_ikc_reception_handler(os, 0);
+	trace_ihk_ikc_interrupt(smp_processor_id(), found, ihk_trace_ns(start));
+	ihk_ikc_poll_kick(os);
+	ihk_ikc_wake_senders(os);
 }
 
 /** \brief Worker thread for IKC interrupts */
 static void ikc_work_func(struct work_struct *work)
 {
 	ihk_os_t os = ihk_ikc_linux_get_os_from_work(work);
-	__ihk_ikc_reception_handler(os);
+	ihk_ikc_handle_interrupt(os);
 	kfree(work);
 }
 
 /** \brief IKC interrupt handler (interrupt context) */
 static void ihk_ikc_interrupt_handler(ihk_os_t os, void *os_priv, void *priv)
 {
+	ihk_ikc_trace(IHK_IKC_TRACE_IRQ, NULL, 0, NULL);
 #ifdef IHK_IKC_RECV_HANDLER_IN_WORKQ
 	ihk_ikc_linux_schedule_work(priv);
 #else
@@ -88,7 +559,7 @@ static void ihk_ikc_interrupt_handler(ihk_os_t os, void *os_priv, void *priv)
 	 * cannot sleep on semaphores, etc.
 	 * This buys us ~10000 cycles latency on the KNL.
 	 */
-	__ihk_ikc_reception_handler(os);
+	ihk_ikc_handle_interrupt(os);
 #endif
 }
 
@@ -120,6 +591,11 @@ void ihk_ikc_system_exit(ihk_os_t os)
 	h = ihk_host_os_get_ikc_handler(os);
 	
 	ihk_os_unregister_interrupt_handler(os, 0, h);
+	ihk_ikc_set_poll(os, 0);
+
+	mutex_lock(&ihk_ikc_trace_mutex);
+	ihk_ikc_trace_detach(os);
+	mutex_unlock(&ihk_ikc_trace_mutex);
 }
 
 struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(int qpages)
@@ -167,11 +643,99 @@ void ihk_ikc_wake_master(struct ihk_ikc_master_wait_struct *ws)
 	wake_up_interruptible(&ws->wait);
 }
 
+/* State of a sender that found its queue full */
+struct ihk_ikc_room_wait {
+	u64 timeout;
+	uint64_t read_off;
+	int armed;
+	int backoff;
+};
+
+/*
+ * Called with interrupts restored after a write found the send queue full.
+ * The first call only asks the reader for an interrupt and has the caller
+ * try again, so that room made in the meantime is not missed. Later calls
+ * wait until the reader moves on: on the send waitqueue of the OS if the
+ * caller passed IKC_MAY_SLEEP, re-arming every jiffy as peers with queues
+ * other than event index ones do not wake us up, or spinning with
+ * exponential backoff for up to IHK_IKC_SEND_SPIN_MS otherwise. The spin
+ * is timed with ktime_get() rather than jiffies, callers in IRQ context
+ * may run on the CPU that would advance jiffies.
+ */
+static int ihk_ikc_wait_room(struct ihk_ikc_channel_desc *c,
+                             struct ihk_ikc_room_wait *w, int opt)
+{
+	struct ihk_ikc_queue_head *q = c->send.queue;
+	wait_queue_head_t *wq;
+	long ret;
+	int i;
+
+	if (opt & IKC_NONBLOCK) {
+		return -EAGAIN;
+	}
+
+	if (!w->armed) {
+		w->read_off = ihk_ikc_queue_want_room(q);
+		w->armed = 1;
+		return 0;
+	}
+	w->armed = 0;
+
+	if (opt & IKC_MAY_SLEEP) {
+		wq = ihk_host_os_get_ikc_send_wait(c->remote_os);
+		ret = wait_event_interruptible_timeout(*wq,
+			IHK_IKC_Q(q, read_off) != w->read_off ||
+			!ihk_ikc_channel_enabled(c), 1);
+
+		return ret < 0 ? -EINTR : 0;
+	}
+
+	if (!w->timeout) {
+		w->timeout = ktime_to_ns(ktime_get()) +
+			IHK_IKC_SEND_SPIN_MS * NSEC_PER_MSEC;
+		w->backoff = 1;
+	}
+
+	while (IHK_IKC_Q(q, read_off) == w->read_off &&
+	       ihk_ikc_channel_enabled(c)) {
+		if (ktime_to_ns(ktime_get()) > w->timeout) {
+			printk_ratelimited(KERN_WARNING
+				"%s: channel %d: queue is still full\n",
+				__FUNCTION__, c->channel_id);
+			return -EBUSY;
+		}
+
+		for (i = 0; i < w->backoff; ++i) {
+			cpu_relax();
+		}
+		if (w->backoff < IHK_IKC_SEND_BACKOFF_MAX) {
+			w->backoff <<= 1;
+		}
+	}
+
+	return 0;
+}
+
 int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 {
+	return ihk_ikc_send_var(channel, p, 0, opt);
+}
+
+IHK_EXPORT_SYMBOL(ihk_ikc_send);
+
+/*
+ * Send len bytes of p, 0 means the packet size of the channel. Messages
+ * longer than that need a peer that receives into a variable-length queue.
+ * If the queue is full the sender waits for room, see ihk_ikc_wait_room(),
+ * or fails with -EAGAIN if opt has IKC_NONBLOCK.
+ */
+int ihk_ikc_send_var(struct ihk_ikc_channel_desc *channel, void *p, int len,
+                     int opt)
+{
+	struct ihk_ikc_room_wait w = { 0 };
+	u64 start = ihk_trace_start(ihk_ikc_send);
 	int r;
 	unsigned long flags;
-	int attempts = 0;
 
 	if (!channel || !p) {
 		return -EINVAL;
@@ -181,19 +745,35 @@ int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 retry:
 	/* Add main packet to target channel */
 	if (ihk_ikc_channel_enabled(channel)) {
-		r = ihk_ikc_write_queue(channel->send.queue, p, opt);
+		r = ihk_ikc_write_queue_var(channel->send.queue, p, len, opt);
+		if (r == -EBUSY) {
+			ihk_ikc_channel_stat_add(channel, queue_full, 1);
+			/* The reader may not know about what is queued */
+			if (opt & IKC_NO_NOTIFY) {
+				ihk_ikc_notify_remote_write(channel);
+			}
 
-		if (r != 0) {
-			if (++attempts > IHK_IKC_SEND_RETRY) {
-				kprintf("%s: couldn't append packet\n", __FUNCTION__);
-				r = -EBUSY;
-				goto out;
+			local_irq_restore(flags);
+			r = ihk_ikc_wait_room(channel, &w, opt);
+			local_irq_save(flags);
+			if (!r) {
+				ihk_ikc_channel_stat_add(channel,
+				                         write_retries, 1);
+				goto retry;
 			}
+		}
 
-			kprintf("%s: couldn't append packet -> retrying\n", __FUNCTION__);
-			goto retry;
+		if (r) {
+			if (r == -EBUSY || r == -EAGAIN) {
+				ihk_ikc_channel_stat_add(channel, busy, 1);
+			}
+			goto out;
 		}
 
+		ihk_ikc_channel_stat_add(channel, sent, 1);
+		ihk_ikc_channel_stat_add(channel, sent_bytes, len ? len :
+		                         ihk_ikc_send_length(channel));
+
 		if (!(opt & IKC_NO_NOTIFY)) {
 			ihk_ikc_notify_remote_write(channel);
 		}
@@ -203,8 +783,92 @@ retry:
 
 out:
 	local_irq_restore(flags);
+	trace_ihk_ikc_send(channel->channel_id, channel->remote_channel_id,
+	                   len ? len : channel->send.queue->pktsize, r,
+	                   ihk_trace_ns(start));
 	return r;
 }
 
-IHK_EXPORT_SYMBOL(ihk_ikc_send);
+IHK_EXPORT_SYMBOL(ihk_ikc_send_var);
+
+/*
+ * Send a burst of packets with one reservation per ring pass and
+ * a single notification at the end. Returns the number of packets
+ * sent, or a negative error if none could be sent.
+ */
+int ihk_ikc_send_batch(struct ihk_ikc_channel_desc *channel,
+                       void **packets, int n, int opt)
+{
+	struct ihk_ikc_room_wait w = { 0 };
+	u64 start = ihk_trace_start(ihk_ikc_send_batch);
+	int r = 0;
+	int sent = 0;
+	int kicked = 0;
+	unsigned long flags;
+
+	if (!channel || !packets || n < 0) {
+		return -EINVAL;
+	}
+
+	local_irq_save(flags);
+	while (sent < n) {
+		if (!ihk_ikc_channel_enabled(channel)) {
+			r = -EINVAL;
+			break;
+		}
+
+		r = ihk_ikc_write_queue_batch(channel->send.queue,
+		                              packets + sent, n - sent, opt);
+		if (r == -EBUSY) {
+			ihk_ikc_channel_stat_add(channel, queue_full, 1);
+			/*
+			 * Let the receiver drain what is already queued,
+			 * with IKC_NO_NOTIFY it may not know about any of it
+			 */
+			if ((sent || (opt & IKC_NO_NOTIFY)) && !kicked) {
+				ihk_ikc_notify_remote_write(channel);
+				kicked = 1;
+			}
+
+			local_irq_restore(flags);
+			r = ihk_ikc_wait_room(channel, &w, opt);
+			local_irq_save(flags);
+			if (r) {
+				if (r == -EBUSY || r == -EAGAIN) {
+					ihk_ikc_channel_stat_add(channel,
+					                         busy, 1);
+				}
+				break;
+			}
+			ihk_ikc_channel_stat_add(channel, write_retries, 1);
+			continue;
+		}
+
+		if (r < 0) {
+			break;
+		}
+
+		sent += r;
+		kicked = 0;
+		w.timeout = 0;
+	}
+
+	if (sent) {
+		ihk_ikc_channel_stat_add(channel, sent, sent);
+		ihk_ikc_channel_stat_add(channel, sent_bytes,
+		                         sent * ihk_ikc_send_length(channel));
+	}
+
+	if (sent && !(opt & IKC_NO_NOTIFY)) {
+		ihk_ikc_notify_remote_write(channel);
+	}
+	local_irq_restore(flags);
+
+	trace_ihk_ikc_send_batch(channel->channel_id,
+	                         channel->remote_channel_id, n,
+	                         sent ? sent : r, ihk_trace_ns(start));
+	return sent ? sent : r;
+}
+
+IHK_EXPORT_SYMBOL(ihk_ikc_send_batch);
 
@@ -7,8 +7,11 @@
 #include <ikc/ihk.h>
 #include <ikc/queue.h>
 #include <ikc/master.h>
+#include <ikc/trace.h>
 
 extern int num_processors;
+unsigned long ihk_mc_get_ns_per_tsc(void);
+int ihk_mc_get_nr_linux_cores(void);
 
 struct ihk_ikc_channel_desc *ihk_mc_get_master_channel(void);
 
@@ -17,6 +20,29 @@ static struct list_head *ihk_ikc_channels;
 
 static struct ihk_ikc_channel_desc **regular_channels;
 
+/*
+ * Channels by ID, a fixed table indexed by the low bits of the ID.
+ * A channel whose slot is taken by another live channel is left out and
+ * ihk_ikc_find_channel() finds it on the channel list instead. Lookups
+ * do not lock and never dereference a channel: the ID is stored next to
+ * the pointer, see ihk_ikc_lookup_channel().
+ */
+#define IHK_IKC_CHANNEL_TABLE_SIZE 1024
+
+struct ihk_ikc_channel_slot {
+	int id;
+	struct ihk_ikc_channel_desc *channel;
+};
+
+static struct ihk_ikc_channel_slot channel_table[IHK_IKC_CHANNEL_TABLE_SIZE];
+static ihk_spinlock_t channel_table_lock;
+
+static struct ihk_ikc_master_wait_bucket
+	wait_buckets[IHK_IKC_MASTER_WAIT_HASH_SIZE];
+
+struct ihk_ikc_trace *ihk_ikc_tracer;
+static struct ihk_ikc_trace trace;
+
 struct list_head *ihk_ikc_get_channel_list(ihk_os_t os)
 {
 	return &ihk_ikc_channels[ihk_mc_get_processor_id()];
@@ -42,21 +68,99 @@ void ihk_ikc_set_regular_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c, in
 	}
 }
 
+int ihk_ikc_get_remote_nr_cpus(ihk_os_t os)
+{
+	return ihk_mc_get_nr_linux_cores();
+}
+
+static struct ihk_ikc_channel_slot *ihk_ikc_channel_slot(int id)
+{
+	return &channel_table[id & (IHK_IKC_CHANNEL_TABLE_SIZE - 1)];
+}
+
+int ihk_ikc_insert_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_ikc_channel_slot *s;
+	unsigned long flags;
+	int ret = 0;
+
+	if (c->channel_id < 0) {
+		return -EINVAL;
+	}
+
+	s = ihk_ikc_channel_slot(c->channel_id);
+	flags = ihk_ikc_spinlock_lock(&channel_table_lock);
+	if (s->channel) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ihk_ikc_store_release(&s->id, c->channel_id);
+	ihk_ikc_store_release(&s->channel, c);
+out:
+	ihk_ikc_spinlock_unlock(&channel_table_lock, flags);
+
+	return ret;
+}
+
+void ihk_ikc_remove_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_ikc_channel_slot *s;
+	unsigned long flags;
+
+	if (c->channel_id < 0) {
+		return;
+	}
+
+	s = ihk_ikc_channel_slot(c->channel_id);
+	flags = ihk_ikc_spinlock_lock(&channel_table_lock);
+	if (s->channel == c) {
+		ihk_ikc_store_release(&s->channel, NULL);
+	}
+	ihk_ikc_spinlock_unlock(&channel_table_lock, flags);
+}
+
+/*
+ * The slot may be reused between reading the pointer and the ID, so the
+ * pointer is read again: if it did not change, the ID belongs to it.
+ * A miss only sends ihk_ikc_find_channel() to the channel list.
+ */
+struct ihk_ikc_channel_desc *ihk_ikc_lookup_channel(ihk_os_t os, int id)
+{
+	struct ihk_ikc_channel_slot *s;
+	struct ihk_ikc_channel_desc *c;
+
+	if (id < 0) {
+		return NULL;
+	}
+
+	s = ihk_ikc_channel_slot(id);
+	c = ihk_ikc_load_acquire(&s->channel);
+	if (!c || ihk_ikc_load_acquire(&s->id) != id ||
+	    ihk_ikc_load_acquire(&s->channel) != c) {
+		return NULL;
+	}
+
+	return c;
+}
+
 static void ihk_ikc_interrupt_handler(void *priv)
 {
 	/* This should be done in the software irq... */
 	struct ihk_ikc_channel_desc *m_channel;
 	struct ihk_ikc_channel_desc *r_channel;
 
+	ihk_ikc_trace(IHK_IKC_TRACE_IRQ, NULL, 0, NULL);
+
 	if (ihk_mc_get_processor_id() == 0) {
 		m_channel = ihk_ikc_get_master_channel(NULL);
 		if (!m_channel)
 			goto no_m_channel;
 
-		while (ihk_ikc_channel_enabled(m_channel) &&
-		       !ihk_ikc_queue_is_empty(m_channel->recv.queue) &&
-		       m_channel->recv.queue->read_cpu == ihk_mc_get_processor_id()) {
-			ihk_ikc_recv_handler(m_channel, m_channel->handler, NULL, 0);
+		if (m_channel->recv.queue->read_cpu ==
+		    ihk_mc_get_processor_id()) {
+			ihk_ikc_recv_batch(m_channel, m_channel->handler,
+			                   NULL, 0);
 		}
 	}
 no_m_channel:
@@ -65,17 +169,68 @@ no_m_channel:
 	if (!r_channel)
 		return;
 
-	while (ihk_ikc_channel_enabled(r_channel) &&
-	       !ihk_ikc_queue_is_empty(r_channel->recv.queue) &&
-	       r_channel->recv.queue->read_cpu == ihk_mc_get_processor_id()) {
-		ihk_ikc_recv_handler(r_channel, r_channel->handler, NULL, 0);
+	if (r_channel->recv.queue->read_cpu == ihk_mc_get_processor_id()) {
+		ihk_ikc_recv_batch(r_channel, r_channel->handler, NULL, 0);
 	}
 }
 
+#define IHK_IKC_SEND_BACKOFF_MAX	1024
+
+/*
+ * Called with interrupts restored after a write found the send queue full.
+ * The first call takes note of read_off and has the caller try again, so
+ * that room made in the meantime is not missed, later calls spin with
+ * exponential backoff until the reader moves on. The host is not asked
+ * for an interrupt, polling read_off is as cheap here.
+ */
+static int ihk_ikc_wait_room(struct ihk_ikc_channel_desc *c,
+                             uint64_t *read_off, int *backoff, int opt)
+{
+	struct ihk_ikc_queue_head *q = c->send.queue;
+	int i;
+
+	if (opt & IKC_NONBLOCK) {
+		return -EAGAIN;
+	}
+
+	if (!*backoff) {
+		*read_off = IHK_IKC_Q(q, read_off);
+		*backoff = 1;
+		return 0;
+	}
+
+	while (IHK_IKC_Q(q, read_off) == *read_off &&
+	       ihk_ikc_channel_enabled(c)) {
+		for (i = 0; i < *backoff; ++i) {
+			cpu_pause();
+		}
+		if (*backoff < IHK_IKC_SEND_BACKOFF_MAX) {
+			*backoff <<= 1;
+		}
+	}
+	*backoff = 0;
+
+	return 0;
+}
+
 int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
+{
+	return ihk_ikc_send_var(channel, p, 0, opt);
+}
+
+/*
+ * Send len bytes of p, 0 means the packet size of the channel. Messages
+ * longer than that need a peer that receives into a variable-length queue.
+ * If the queue is full the sender waits for room with interrupts enabled,
+ * or fails with -EAGAIN if opt has IKC_NONBLOCK.
+ */
+int ihk_ikc_send_var(struct ihk_ikc_channel_desc *channel, void *p, int len,
+                     int opt)
 {
 	int r;
 	unsigned long flags;
+	uint64_t read_off = 0;
+	int backoff = 0;
 
 	if(!channel || !p)
 		return -EINVAL;
@@ -85,13 +240,36 @@ int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 retry:
 	/* Add main packet to target channel */
 	if (ihk_ikc_channel_enabled(channel)) {
-		r = ihk_ikc_write_queue(channel->send.queue, p, opt);
+		r = ihk_ikc_write_queue_var(channel->send.queue, p, len, opt);
+		if (r == -EBUSY) {
+			ihk_ikc_channel_stat_add(channel, queue_full, 1);
+			/* The reader may not know about what is queued */
+			if (opt & IKC_NO_NOTIFY) {
+				ihk_ikc_notify_remote_write(channel);
+			}
+
+			cpu_restore_interrupt(flags);
+			r = ihk_ikc_wait_room(channel, &read_off, &backoff,
+			                      opt);
+			flags = cpu_disable_interrupt_save();
+			if (!r) {
+				ihk_ikc_channel_stat_add(channel,
+				                         write_retries, 1);
+				goto retry;
+			}
+		}
 
-		if (r != 0) {
-			kprintf("%s: couldn't append packet -> retrying\n", __FUNCTION__);
-			goto retry;
+		if (r) {
+			if (r == -EBUSY || r == -EAGAIN) {
+				ihk_ikc_channel_stat_add(channel, busy, 1);
+			}
+			goto out;
 		}
 
+		ihk_ikc_channel_stat_add(channel, sent, 1);
+		ihk_ikc_channel_stat_add(channel, sent_bytes, len ? len :
+		                         ihk_ikc_send_length(channel));
+
 		if (!(opt & IKC_NO_NOTIFY)) {
 			ihk_ikc_notify_remote_write(channel);
 		}
@@ -99,11 +277,89 @@ retry:
 		r = -EINVAL;
 	}
 
+out:
 	cpu_restore_interrupt(flags);
 
 	return r;
 }
 
+/*
+ * Send a burst of packets with one reservation per ring pass and
+ * a single notification at the end. Returns the number of packets
+ * sent, or a negative error if none could be sent.
+ */
+int ihk_ikc_send_batch(struct ihk_ikc_channel_desc *channel,
+                       void **packets, int n, int opt)
+{
+	int r = 0;
+	int sent = 0;
+	int kicked = 0;
+	unsigned long flags;
+	uint64_t read_off = 0;
+	int backoff = 0;
+
+	if (!channel || !packets || n < 0)
+		return -EINVAL;
+
+	flags = cpu_disable_interrupt_save();
+
+	while (sent < n) {
+		if (!ihk_ikc_channel_enabled(channel)) {
+			r = -EINVAL;
+			break;
+		}
+
+		r = ihk_ikc_write_queue_batch(channel->send.queue,
+		                              packets + sent, n - sent, opt);
+		if (r == -EBUSY) {
+			ihk_ikc_channel_stat_add(channel, queue_full, 1);
+			/*
+			 * Let the receiver drain what is already queued,
+			 * with IKC_NO_NOTIFY it may not know about any of it
+			 */
+			if ((sent || (opt & IKC_NO_NOTIFY)) && !kicked) {
+				ihk_ikc_notify_remote_write(channel);
+				kicked = 1;
+			}
+
+			cpu_restore_interrupt(flags);
+			r = ihk_ikc_wait_room(channel, &read_off, &backoff,
+			                      opt);
+			flags = cpu_disable_interrupt_save();
+			if (r) {
+				if (r == -EBUSY || r == -EAGAIN) {
+					ihk_ikc_channel_stat_add(channel,
+					                         busy, 1);
+				}
+				break;
+			}
+			ihk_ikc_channel_stat_add(channel, write_retries, 1);
+			continue;
+		}
+
+		if (r < 0) {
+			break;
+		}
+
+		sent += r;
+		kicked = 0;
+	}
+
+	if (sent) {
+		ihk_ikc_channel_stat_add(channel, sent, sent);
+		ihk_ikc_channel_stat_add(channel, sent_bytes,
+		                         sent * ihk_ikc_send_length(channel));
+	}
+
+	if (sent && !(opt & IKC_NO_NOTIFY)) {
+		ihk_ikc_notify_remote_write(channel);
+	}
+
+	cpu_restore_interrupt(flags);
+
+	return sent ? sent : r;
+}
+
 struct ihk_ikc_channel_desc *ihk_ikc_get_master_channel(ihk_os_t os)
 {
 	return ihk_mc_get_master_channel();
@@ -132,6 +388,12 @@ void ihk_ikc_system_init(ihk_os_t os)
 	}
 
 	memset(regular_channels, 0, sizeof(*regular_channels) * num_processors);
+	ihk_ikc_spinlock_init(&channel_table_lock);
+
+	for (i = 0; i < IHK_IKC_MASTER_WAIT_HASH_SIZE; ++i) {
+		INIT_LIST_HEAD(&wait_buckets[i].list);
+		ihk_ikc_spinlock_init(&wait_buckets[i].lock);
+	}
 
 	for (i = 0; i < num_processors; ++i) {
 		INIT_LIST_HEAD(&ihk_ikc_channels[i]);
@@ -143,6 +405,7 @@ void ihk_ikc_system_exit(ihk_os_t os)
 {
 	ihk_mc_unregister_interrupt_handler(ihk_mc_get_vector(IHK_GV_IKC),
 	                                    &ihk_ikc_handler);
+	ihk_ikc_store_release(&ihk_ikc_tracer, NULL);
 }
 
 struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(int qpages)
@@ -152,7 +415,7 @@ struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(int qpages)
 
 void ihk_ikc_free_queue(struct ihk_ikc_queue_head *q)
 {
-	ihk_mc_free_pages(q, (sizeof(struct ihk_ikc_queue_head) + 
+	ihk_mc_free_pages(q, (ihk_ikc_queue_head_size(q) +
 	                      q->queue_size + PAGE_SIZE - 1) >> PAGE_SHIFT);
 }
 
@@ -173,17 +436,10 @@ int call_arch_master_packet_handler(void *os, struct ihk_ikc_channel_desc *c,
 	return arch_master_channel_packet_handler(c, __packet, os);
 }
 
-static LIST_HEAD(wait_list);
-static ihk_spinlock_t wait_lock;
-
-struct list_head *ihk_ikc_get_master_wait_list(ihk_os_t ihk_os)
-{
-	return &wait_list;
-}
-
-ihk_spinlock_t *ihk_ikc_get_master_wait_lock(ihk_os_t ihk_os)
+struct ihk_ikc_master_wait_bucket *ihk_ikc_get_master_wait_buckets(
+	ihk_os_t ihk_os)
 {
-	return &wait_lock;
+	return wait_buckets;
 }
 
 void ihk_ikc_wait_init(ihk_wait_t *wait)
@@ -205,6 +461,111 @@ void ihk_ikc_wake_master(struct ihk_ikc_master_wait_struct *ws)
 	ws->status = 1;
 }
 
+static void *ihk_ikc_trace_map(ihk_os_t os, unsigned long phys,
+                               unsigned long size, unsigned long *mapped)
+{
+	int npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	void *va;
+
+	*mapped = ihk_ikc_map_memory(os, phys, npages * PAGE_SIZE);
+	va = ihk_ikc_map_virtual(ihk_os_to_dev(os), *mapped, npages,
+	                         IHK_IKC_QUEUE_PT_ATTR);
+	if (!va) {
+		ihk_ikc_unmap_memory(os, *mapped, npages * PAGE_SIZE);
+	}
+
+	return va;
+}
+
+static void ihk_ikc_trace_unmap(ihk_os_t os, void *va, unsigned long mapped,
+                                unsigned long size)
+{
+	int npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	ihk_ikc_unmap_virtual(ihk_os_to_dev(os), va, npages);
+	ihk_ikc_unmap_memory(os, mapped, npages * PAGE_SIZE);
+}
+
+/*
+ * Map the trace directory sent by the host and the rings of our CPUs,
+ * and start tracing. The host keeps the area until we are shut down.
+ */
+int ihk_ikc_trace_attach(ihk_os_t os, unsigned long phys, unsigned long size)
+{
+	struct ihk_ikc_trace_dir *dir;
+	struct ihk_ikc_trace_entry **entries;
+	unsigned long dir_mapped, *mapped;
+	unsigned long ring_size;
+	int nr_cpus, i;
+	int ret;
+
+	if (ihk_ikc_tracer) {
+		return -EBUSY;
+	}
+
+	dir = ihk_ikc_trace_map(os, phys, size, &dir_mapped);
+	if (!dir) {
+		return -EINVAL;
+	}
+
+	if (dir->magic != IHK_IKC_TRACE_MAGIC) {
+		ret = -EINVAL;
+		goto out_dir;
+	}
+
+	nr_cpus = dir->nr_lwk_cpus;
+	if (nr_cpus > num_processors) {
+		nr_cpus = num_processors;
+	}
+	ring_size = dir->nr_entries * sizeof(struct ihk_ikc_trace_entry);
+
+	entries = ihk_ikc_malloc(sizeof(*entries) * nr_cpus);
+	mapped = ihk_ikc_malloc(sizeof(*mapped) * nr_cpus);
+	if (!entries || !mapped) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < nr_cpus; ++i) {
+		entries[i] = ihk_ikc_trace_map(os,
+			dir->rings[dir->nr_host_cpus + i].phys,
+			ring_size, &mapped[i]);
+		if (!entries[i]) {
+			ret = -ENOMEM;
+			goto out_unmap;
+		}
+	}
+
+	/* Rings stay mapped until shutdown, their addresses are not needed */
+	ihk_ikc_free(mapped);
+
+	trace.dir = dir;
+	trace.rings = &dir->rings[dir->nr_host_cpus];
+	trace.entries = entries;
+	trace.nr_cpus = nr_cpus;
+	trace.side = IHK_IKC_TRACE_SIDE_LWK;
+	dir->ns_per_tsc = ihk_mc_get_ns_per_tsc();
+	ihk_ikc_store_release(&ihk_ikc_tracer, &trace);
+
+	return 0;
+
+out_unmap:
+	while (--i >= 0) {
+		ihk_ikc_trace_unmap(os, entries[i], mapped[i], ring_size);
+	}
+out_free:
+	if (mapped) {
+		ihk_ikc_free(mapped);
+	}
+	if (entries) {
+		ihk_ikc_free(entries);
+	}
+out_dir:
+	ihk_ikc_trace_unmap(os, dir, dir_mapped, size);
+
+	return ret;
+}
+
 static ihk_atomic_t channel_id;
 
 int ihk_ikc_get_unique_channel_id(ihk_os_t ihk_os)
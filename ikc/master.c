@@ -6,6 +6,8 @@
  */
 #include <ikc/ihk.h>
 #include <ikc/master.h>
+#include <ikc/trace.h>
+#include <ikc/tracepoint.h>
 
 //#define DEBUG_PRINT_IKC
 
@@ -95,16 +97,29 @@ static int ihk_ikc_master_send(ihk_os_t os,
 	return ihk_ikc_send(c, &packet, 0);
 }
 
+/* Hand a trace directory set up by the host to the kernel */
+int ihk_ikc_master_send_trace(ihk_os_t os, unsigned long phys,
+                              unsigned long size)
+{
+	if (!ihk_ikc_get_master_channel(os)) {
+		return -EINVAL;
+	}
+
+	return ihk_ikc_master_send(os, IHK_IKC_MASTER_MSG_TRACE, 0,
+	                           phys, size, 0, 0, 0);
+}
+
 int ihk_ikc_accept(struct ihk_ikc_channel_desc *cm, 
                    struct ihk_ikc_listen_param *p,
                    unsigned long packet_size,
                    unsigned long *rq, unsigned long *sq,
                    struct ihk_ikc_channel_desc **newc,
                    unsigned long remote_channel_va,
-                   int magic, int intr_cpu)
+                   int magic, int intr_cpu, unsigned long flags)
 {
 	struct ihk_ikc_channel_info ci;
 	struct ihk_ikc_channel_desc *c;
+	enum ihk_ikc_channel_flag f = 0;
 	int r;
 
 	if (!p || !p->handler) {
@@ -116,8 +131,19 @@ int ihk_ikc_accept(struct ihk_ikc_channel_desc *cm,
 	if (packet_size != p->pkt_size) {
 		return -ECONNABORTED;
 	}
+	if (flags & IHK_IKC_CONNECT_QUEUE_V2) {
+		f |= IKC_FLAG_QUEUE_V2;
+	}
+	/* Only if the connector knows how to write records */
+	if ((flags & IHK_IKC_CONNECT_VARLEN) && (p->flag & IKC_FLAG_VARLEN)) {
+		f |= IKC_FLAG_VARLEN;
+	}
+	/* Both ends have to stick to one sender and one receiver */
+	if ((flags & IHK_IKC_CONNECT_SPSC) && (p->flag & IKC_FLAG_SPSC)) {
+		f |= IKC_FLAG_SPSC;
+	}
 	c = ihk_ikc_create_channel(cm->remote_os, p->port, p->pkt_size,
-	                           p->queue_size, rq, sq, 0);
+	                           p->queue_size, rq, sq, f);
 	if (!c) {
 		return -ENOMEM;
 	}
@@ -136,6 +162,7 @@ int ihk_ikc_accept(struct ihk_ikc_channel_desc *cm,
 	}
 	
 	c->handler = ci.packet_handler;
+	c->batch_handler = ci.batch_packet_handler;
 	c->remote_channel_va = remote_channel_va;
 
 	*newc = c;
@@ -176,7 +203,7 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 		}
 		if (ihk_ikc_channel_enabled(c) &&
 				!ihk_ikc_queue_is_empty(c->recv.queue)) {
-			ihk_ikc_recv_handler(c, c->handler, os, 0);
+			ihk_ikc_recv_batch(c, c->handler, os, 0);
 		}
 
 		break;
@@ -184,15 +211,18 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 	case IHK_IKC_MASTER_MSG_CONNECT:
 	{
 		/* connect (port | packet size, recv queue, send queue) */
-		unsigned long rq, sq;
+		unsigned long rq, sq, cflags;
 		int port, r;
 
  		dkprintf("Connect msg: %x, %llx, %llx, %llx\n",
 		        packet->ref, packet->param[0], packet->param[1],
 		        packet->param[2]);
 
-		port = (int)(packet->param[0] & 0xffffffffUL);
-		if (port < 0 || port >= IHK_IKC_MAX_PORT) {
+		port = (int)(packet->param[0] & IHK_IKC_CONNECT_PORT_MASK);
+		cflags = packet->param[0] & 0xffffffffUL &
+			~(unsigned long)IHK_IKC_CONNECT_PORT_MASK;
+		if (port >= IHK_IKC_MAX_PORT ||
+		    (cflags & ~(unsigned long)IHK_IKC_CONNECT_FLAGS)) {
 			r = EINVAL;
 		} else {
 			rq = packet->param[1];
@@ -206,7 +236,8 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 			                   packet->param[0] >> 32,
 			                   &rq, &sq, &newc,
 			                   remote_channel_va, (int)packet->param[4],
-			                   (int)(packet->param[4] >> 32));
+			                   (int)(packet->param[4] >> 32),
+			                   cflags);
 			ihk_ikc_spinlock_unlock(lock, flags);
 		}
 
@@ -222,7 +253,9 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 			ihk_ikc_master_send(os,
 			                    IHK_IKC_MASTER_MSG_CONNECT_REPLY,
 			                    packet->ref, 0, rq,
-			                    remote_channel_va, (uint64_t)newc, 0);
+			                    remote_channel_va, (uint64_t)newc,
+			                    (newc->flag & IKC_FLAG_SPSC) ?
+			                    IHK_IKC_CONNECT_SPSC : 0);
 		}
 
 		break;
@@ -254,6 +287,20 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 		ret = ihk_ikc_master_reply_handler(os, packet);
 		break;
 
+	case IHK_IKC_MASTER_MSG_TRACE:
+		/* Trace directory (physical address, size) */
+#ifdef IHK_OS_MANYCORE
+		ret = ihk_ikc_trace_attach(os, packet->param[0],
+		                           packet->param[1]);
+		if (ret) {
+			kprintf("%s: attaching IKC trace: %d\n",
+			        __FUNCTION__, ret);
+		}
+#else
+		ret = -EINVAL;
+#endif
+		break;
+
 	default:
 		ret = call_arch_master_packet_handler(os, c, __packet);
 		break;
@@ -264,8 +311,14 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 	return ret;
 }
 
-struct list_head *ihk_ikc_get_master_wait_list(ihk_os_t os);
-ihk_spinlock_t *ihk_ikc_get_master_wait_lock(ihk_os_t os);
+struct ihk_ikc_master_wait_bucket *ihk_ikc_get_master_wait_buckets(ihk_os_t os);
+
+static struct ihk_ikc_master_wait_bucket *
+ihk_ikc_master_wait_bucket(ihk_os_t os, uint32_t msg, uint32_t ref)
+{
+	return &ihk_ikc_get_master_wait_buckets(os)[(msg ^ ref) &
+		(IHK_IKC_MASTER_WAIT_HASH_SIZE - 1)];
+}
 
 int ihk_ikc_wait_master(struct ihk_ikc_master_wait_struct *wq);
 
@@ -273,128 +326,433 @@ void ihk_ikc_wait_reply_prepare(ihk_os_t os,
                                 struct ihk_ikc_master_wait_struct *ws,
                                 uint32_t msg, uint32_t ref)
 {
-	struct list_head *list;
-	ihk_spinlock_t *lock;
+	struct ihk_ikc_master_wait_bucket *b;
 	unsigned long flags;
 
 	INIT_LIST_HEAD(&ws->list);
 	ws->msg = msg;
 	ws->ref = ref;
 	ws->status = 0;
+	ws->func = NULL;
 	memset(&ws->res, 0, sizeof(ws->res));
 
 	ihk_ikc_wait_init(&ws->wait);
 
-	list = ihk_ikc_get_master_wait_list(os);
-	lock = ihk_ikc_get_master_wait_lock(os);
+	b = ihk_ikc_master_wait_bucket(os, msg, ref);
 
-	flags = ihk_ikc_spinlock_lock(lock);
-	list_add_tail(&ws->list, list);
-	ihk_ikc_spinlock_unlock(lock, flags);
+	flags = ihk_ikc_spinlock_lock(&b->lock);
+	list_add_tail(&ws->list, &b->list);
+	ihk_ikc_spinlock_unlock(&b->lock, flags);
 }
 
 void ihk_ikc_wait_finish(ihk_os_t os, struct ihk_ikc_master_wait_struct *ws)
 {
-	ihk_spinlock_t *lock;
+	struct ihk_ikc_master_wait_bucket *b;
 	unsigned long flags;
 
-	lock = ihk_ikc_get_master_wait_lock(os);
+	b = ihk_ikc_master_wait_bucket(os, ws->msg, ws->ref);
 
-	flags = ihk_ikc_spinlock_lock(lock);
+	flags = ihk_ikc_spinlock_lock(&b->lock);
 	list_del(&ws->list);
-	ihk_ikc_spinlock_unlock(lock, flags);
+	ihk_ikc_spinlock_unlock(&b->lock, flags);
 }
 
 int ihk_ikc_master_reply_handler(ihk_os_t os,
                                  struct ihk_ikc_master_packet *packet)
 {
 	struct ihk_ikc_master_wait_struct *wq, *next;
-	struct list_head *list;
-	ihk_spinlock_t *lock;
+	struct ihk_ikc_master_wait_bucket *b;
 	unsigned long flags;
 
-	list = ihk_ikc_get_master_wait_list(os);
-	lock = ihk_ikc_get_master_wait_lock(os);
+	b = ihk_ikc_master_wait_bucket(os, packet->msg, packet->ref);
 
-	flags = ihk_ikc_spinlock_lock(lock);
-	list_for_each_entry_safe(wq, next, list, list) {
+	flags = ihk_ikc_spinlock_lock(&b->lock);
+	/* ref is a channel ID, so at most one waiter matches */
+	list_for_each_entry_safe(wq, next, &b->list, list) {
 		if (wq->msg == packet->msg && wq->ref == packet->ref) {
 			memcpy(&wq->res, packet, sizeof(*packet));
 
 			wq->status = 1;
 
+			if (wq->func) {
+				wq->func(wq);
+			}
 			ihk_ikc_wake_master(wq);
+			break;
 		}
 	}
-	ihk_ikc_spinlock_unlock(lock, flags);
+	ihk_ikc_spinlock_unlock(&b->lock, flags);
+
+	return 0;
+}
+
+/* Returned by ihk_ikc_connect_wait() to have the request sent again */
+#define IHK_IKC_CONNECT_RETRY 1
+
+/* A connect request on its way to the peer */
+struct ihk_ikc_connect_req {
+	struct ihk_ikc_master_wait_struct wq;
+	struct ihk_ikc_connect_param *p;
+	struct ihk_ikc_channel_desc *c;
+	unsigned long cflags;
+	int async;
+	uint64_t start;
+};
+
+static void ihk_ikc_connect_async_reply(struct ihk_ikc_master_wait_struct *ws);
+
+static void ihk_ikc_connect_req_init(struct ihk_ikc_connect_req *req,
+                                     struct ihk_ikc_connect_param *p)
+{
+	req->p = p;
+	req->c = NULL;
+	req->async = 0;
+	req->cflags = IHK_IKC_CONNECT_QUEUE_V2 | IHK_IKC_CONNECT_VARLEN |
+		((p->flag & IKC_FLAG_SPSC) ? IHK_IKC_CONNECT_SPSC : 0);
+	req->start = ihk_ikc_tp_start(ihk_ikc_connect);
+}
+
+static void ihk_ikc_connect_trace(struct ihk_ikc_connect_req *req, int ret)
+{
+	struct ihk_ikc_connect_param *p = req->p;
+
+	ihk_ikc_tp(ihk_ikc_connect, p->port, p->pkt_size, p->queue_size,
+	           ret ? -1 : p->channel->channel_id,
+	           ret ? -1 : p->channel->remote_channel_id, ret,
+	           ihk_ikc_tp_ns(req->start));
+}
+
+/*
+ * Create the channel of the request, register for the reply and fill in
+ * the CONNECT packet. The packet must be sent or the request cancelled
+ * with ihk_ikc_connect_cancel().
+ */
+static int ihk_ikc_connect_prepare(ihk_os_t os,
+                                   struct ihk_ikc_connect_req *req,
+                                   struct ihk_ikc_master_packet *packet)
+{
+	struct ihk_ikc_connect_param *p = req->p;
+	unsigned long rq = 0, sq = 0;
+
+	if (p->port < 0 || p->port >= IHK_IKC_MAX_PORT) {
+		return -EINVAL;
+	}
+
+	req->c = ihk_ikc_create_channel(os, p->port, p->pkt_size,
+	                                p->queue_size, &rq, &sq,
+	                                (req->cflags ?
+	                                 (IKC_FLAG_QUEUE_V2 |
+	                                  (p->flag & IKC_FLAG_VARLEN)) : 0));
+	if (!req->c) {
+		return -ENOMEM;
+	}
+
+	ihk_ikc_wait_reply_prepare(os, &req->wq,
+	                           IHK_IKC_MASTER_MSG_CONNECT_REPLY,
+	                           req->c->channel_id);
+	if (req->async) {
+		req->wq.func = ihk_ikc_connect_async_reply;
+	}
+
+	packet->msg = IHK_IKC_MASTER_MSG_CONNECT;
+	packet->ref = req->c->channel_id;
+	packet->param[0] = ((unsigned long)p->pkt_size << 32) | req->cflags |
+		p->port;
+	packet->param[1] = sq;
+	packet->param[2] = rq;
+	packet->param[3] = (uint64_t)req->c;
+	packet->param[4] = ((unsigned long)p->intr_cpu << 32) | p->magic;
 
 	return 0;
 }
 
+static void ihk_ikc_connect_cancel(ihk_os_t os,
+                                   struct ihk_ikc_connect_req *req)
+{
+	ihk_ikc_wait_finish(os, &req->wq);
+	ihk_ikc_free_channel(req->c);
+	req->c = NULL;
+}
+
+/* Prepare and send the CONNECT packet of the request */
+static int ihk_ikc_connect_send(ihk_os_t os, struct ihk_ikc_connect_req *req)
+{
+	struct ihk_ikc_master_packet packet;
+	int ret;
+
+	ret = ihk_ikc_connect_prepare(os, req, &packet);
+	if (ret) {
+		return ret;
+	}
+
+	if (ihk_ikc_send(ihk_ikc_get_master_channel(os), &packet, 0) != 0) {
+		ihk_ikc_connect_cancel(os, req);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for the reply and set up the send side of the channel. Returns
+ * IHK_IKC_CONNECT_RETRY if the peer does not know the connect flags, the
+ * request then has to be sent again without them, or a negative error.
+ */
+static int ihk_ikc_connect_wait(ihk_os_t os, struct ihk_ikc_connect_req *req)
+{
+	struct ihk_ikc_connect_param *p = req->p;
+	struct ihk_ikc_channel_desc *c = req->c;
+	struct ihk_ikc_master_packet *res = &req->wq.res;
+	int r;
+
+	if (ihk_ikc_wait_master(&req->wq) != 0) {
+		ihk_ikc_connect_cancel(os, req);
+		return -EINTR;
+	}
+	ihk_ikc_wait_finish(os, &req->wq);
+	req->c = NULL;
+
+	if (req->cflags && (int)res->param[0] == -EINVAL) {
+		/* The remote does not know the flags, retry without */
+		ihk_ikc_free_channel(c);
+		req->cflags = 0;
+		return IHK_IKC_CONNECT_RETRY;
+	} else if (res->param[0]) {
+		/* Refusals of the listener are positive, others negative */
+		ihk_ikc_free_channel(c);
+		r = (int)res->param[0];
+		return r < 0 ? r : -r;
+	}
+
+	dkprintf("response = %llx, %llx, %llx\n",
+	         res->param[0], res->param[1], res->param[2]);
+	ihk_ikc_set_remote_queue(&c->send, os, res->param[1], p->queue_size);
+	c->remote_channel_id = c->send.cache.channel_id;
+	c->remote_channel_va = res->param[3];
+	dkprintf("%s: IHK_IKC_MASTER_MSG_CONNECT_REPLY"
+	         " channel: %p, remote_channel_va: %p\n",
+	         __FUNCTION__, c, c->remote_channel_va);
+	/*
+	 * The peer may be writing already, which is fine as
+	 * there is only one writer between two packets.
+	 */
+	if (res->param[4] & IHK_IKC_CONNECT_SPSC) {
+		c->flag |= IKC_FLAG_SPSC;
+		c->recv.queue->flag |= IKC_QUEUE_FLAG_SPSC;
+	}
+	c->handler = p->handler;
+	c->send.queue->write_cpu = c->recv.queue->read_cpu;
+	c->send.intr_cpu = p->intr_cpu;
+	dkprintf("(Connected) Remote channeld id = %x\n",
+	         c->remote_channel_id);
+	ihk_ikc_enable_channel(c);
+
+	p->channel = c;
+	return 0;
+}
+
 /* sync version. may sleep */
 int ihk_ikc_connect(ihk_os_t os, struct ihk_ikc_connect_param *p)
 {
-	struct ihk_ikc_channel_desc *c;
-	unsigned long rq = 0, sq = 0;
-	int ref, ret;
-	struct ihk_ikc_master_wait_struct wq;
+	struct ihk_ikc_connect_req req;
+	int ret;
 
 	if (!p) {
 		return -EINVAL;
 	}
 
 	dkprintf("%s: connecting channel\n", __func__);
-	c = ihk_ikc_create_channel(os, p->port, p->pkt_size, p->queue_size,
-	                           &rq, &sq, 0);
-	if (!c) {
+	ihk_ikc_connect_req_init(&req, p);
+	do {
+		ret = ihk_ikc_connect_send(os, &req);
+		if (ret) {
+			break;
+		}
+		ret = ihk_ikc_connect_wait(os, &req);
+	} while (ret == IHK_IKC_CONNECT_RETRY);
+
+	ihk_ikc_connect_trace(&req, ret);
+	return ret;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_connect);
+
+/* Called by the reply handler under the bucket lock */
+static void ihk_ikc_connect_async_reply(struct ihk_ikc_master_wait_struct *ws)
+{
+	struct ihk_ikc_connect_req *req =
+		container_of(ws, struct ihk_ikc_connect_req, wq);
+	int status = (int)ws->res.param[0];
+
+	/* Retried without flags by ihk_ikc_connect_finish(), see there */
+	if (req->cflags && status == -EINVAL) {
+		return;
+	}
+
+	if (req->p->done) {
+		req->p->done(req->p, status > 0 ? -status : status);
+	}
+}
+
+/*
+ * Send the CONNECT packet and return without waiting for the reply.
+ * p->done, if set, is called from the master channel handler once the
+ * reply is in, with 0 or the error the peer answered. It must not sleep.
+ * A peer that does not know the connect flags has to be asked again, in
+ * that case p->done is called by ihk_ikc_connect_finish() instead.
+ * The channel is usable only after ihk_ikc_connect_finish(), which has
+ * to be called for every request started successfully.
+ */
+int ihk_ikc_connect_async(ihk_os_t os, struct ihk_ikc_connect_param *p)
+{
+	struct ihk_ikc_connect_req *req;
+	int ret;
+
+	if (!p) {
+		return -EINVAL;
+	}
+
+	req = ihk_ikc_malloc(sizeof(*req));
+	if (!req) {
 		return -ENOMEM;
 	}
-	ref = c->channel_id;
 
-	ihk_ikc_wait_reply_prepare(os, &wq, IHK_IKC_MASTER_MSG_CONNECT_REPLY,
-	                           ref);
+	ihk_ikc_connect_req_init(req, p);
+	req->async = 1;
+	p->channel = NULL;
+	p->req = req;
 
-	if (ihk_ikc_master_send(os, IHK_IKC_MASTER_MSG_CONNECT, ref,
-	                        ((unsigned long)p->pkt_size << 32) | p->port,
-	                        sq, rq, (uint64_t)c,
-	                        ((unsigned long)p->intr_cpu << 32) | p->magic) == 0) {
-		ret = ihk_ikc_wait_master(&wq);
-		ihk_ikc_wait_finish(os, &wq);
+	ret = ihk_ikc_connect_send(os, req);
+	if (ret) {
+		p->req = NULL;
+		ihk_ikc_free(req);
+	}
+
+	return ret;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_connect_async);
+
+/*
+ * Complete a request of ihk_ikc_connect_async() or _bulk(): wait for the
+ * reply if it is not in yet and map the remote queue. May sleep.
+ */
+int ihk_ikc_connect_finish(ihk_os_t os, struct ihk_ikc_connect_param *p)
+{
+	struct ihk_ikc_connect_req *req;
+	int retried = 0;
+	int ret;
+
+	if (!p || !p->req) {
+		return -EINVAL;
+	}
 
-		if (ret != 0) {
-			ihk_ikc_free_channel(c);
-			return -EINTR;
-		} else if (wq.res.param[0]){
-			ihk_ikc_free_channel(c);
-			return -wq.res.param[0];
+	req = p->req;
+	ret = ihk_ikc_connect_wait(os, req);
+	while (ret == IHK_IKC_CONNECT_RETRY) {
+		/* Skipped by ihk_ikc_connect_async_reply(), answer below */
+		if (req->async) {
+			retried = 1;
+			req->async = 0;
+		}
+		ret = ihk_ikc_connect_send(os, req);
+		if (ret) {
+			break;
+		}
+		ret = ihk_ikc_connect_wait(os, req);
+	}
+
+	if (retried && p->done) {
+		p->done(p, ret);
+	}
+
+	ihk_ikc_connect_trace(req, ret);
+	p->req = NULL;
+	ihk_ikc_free(req);
+
+	return ret;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_connect_finish);
+
+/*
+ * Open n channels with one burst of CONNECT packets on the master
+ * channel, the replies are then collected in order. Returns 0 if all
+ * of them connected, otherwise the first error. p[i].channel is set for
+ * every channel that did connect, so that the caller can tear them down.
+ */
+int ihk_ikc_connect_bulk(ihk_os_t os, struct ihk_ikc_connect_param *p, int n)
+{
+	struct ihk_ikc_master_packet *packets;
+	void **pp;
+	int i, sent, prepared = 0;
+	int ret = 0, r;
+
+	if (!p || n <= 0) {
+		return -EINVAL;
+	}
+
+	packets = ihk_ikc_malloc(sizeof(*packets) * n);
+	pp = ihk_ikc_malloc(sizeof(*pp) * n);
+	if (!packets || !pp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		p[i].channel = NULL;
+		p[i].req = NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		p[i].req = ihk_ikc_malloc(sizeof(struct ihk_ikc_connect_req));
+		if (!p[i].req) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ihk_ikc_connect_req_init(p[i].req, &p[i]);
+		ret = ihk_ikc_connect_prepare(os, p[i].req, &packets[i]);
+		if (ret) {
+			ihk_ikc_free(p[i].req);
+			p[i].req = NULL;
+			break;
+		}
+		pp[i] = &packets[i];
+		prepared++;
+	}
+
+	sent = 0;
+	if (prepared) {
+		sent = ihk_ikc_send_batch(ihk_ikc_get_master_channel(os),
+		                          pp, prepared, 0);
+		if (sent < 0) {
+			sent = 0;
+		}
+	}
+
+	for (i = 0; i < prepared; i++) {
+		if (i < sent) {
+			r = ihk_ikc_connect_finish(os, &p[i]);
 		} else {
-			dkprintf("response = %llx, %llx, %llx\n",
-			        wq.res.param[0], wq.res.param[1],
-			        wq.res.param[2]);
-			ihk_ikc_set_remote_queue(&c->send, os, wq.res.param[1],
-			                         p->queue_size);
-			c->remote_channel_id = c->send.cache.channel_id;
-			c->remote_channel_va = wq.res.param[3];
-			dkprintf("%s: IHK_IKC_MASTER_MSG_CONNECT_REPLY"
-					" channel: %p, remote_channel_va: %p\n",
-					__FUNCTION__, c, c->remote_channel_va);
-			c->handler = p->handler;
-			c->send.queue->write_cpu = c->recv.queue->read_cpu;
-			c->send.intr_cpu = p->intr_cpu;
-			dkprintf("(Connected) Remote channeld id = %x\n",
-			        c->remote_channel_id);
-			ihk_ikc_enable_channel(c);
+			ihk_ikc_connect_cancel(os, p[i].req);
+			ihk_ikc_free(p[i].req);
+			p[i].req = NULL;
+			r = -EBUSY;
+		}
+		if (r && !ret) {
+			ret = r;
 		}
-	} else {
-		ihk_ikc_wait_finish(os, &wq);
-		ihk_ikc_free_channel(c);
-		return -EBUSY;
 	}
 
-	p->channel = c;
-	return 0;
+out:
+	if (pp) {
+		ihk_ikc_free(pp);
+	}
+	if (packets) {
+		ihk_ikc_free(packets);
+	}
+
+	return ret;
 }
-IHK_EXPORT_SYMBOL(ihk_ikc_connect);
+IHK_EXPORT_SYMBOL(ihk_ikc_connect_bulk);
 
 
 int __ihk_send_disconnect(struct ihk_ikc_channel_desc *c)
@@ -432,6 +790,7 @@ int __ihk_wait_for_disconnect_ack(struct ihk_ikc_channel_desc *c)
 /* sync version. may sleep */
 int ihk_ikc_disconnect(struct ihk_ikc_channel_desc *c)
 {
+	uint64_t start = ihk_ikc_tp_start(ihk_ikc_disconnect);
 	unsigned long flags, cflag;
 	int r = 0;
 
@@ -454,7 +813,9 @@ int ihk_ikc_disconnect(struct ihk_ikc_channel_desc *c)
 	} else {
 		r = __ihk_send_disconnect(c);
 	}
-	
+
+	ihk_ikc_tp(ihk_ikc_disconnect, c->channel_id, c->remote_channel_id, r,
+	           ihk_ikc_tp_ns(start));
 	return r;
 }
 IHK_EXPORT_SYMBOL(ihk_ikc_disconnect);
@@ -468,3 +829,188 @@ void ihk_ikc_destroy_channel(struct ihk_ikc_channel_desc *c)
     ihk_ikc_free_channel(c);
 }
 IHK_EXPORT_SYMBOL(ihk_ikc_destroy_channel);
+
+struct ihk_ikc_mq_channel *ihk_ikc_mq_alloc(int size)
+{
+	struct ihk_ikc_mq_channel *mq;
+
+	if (size <= 0) {
+		return NULL;
+	}
+
+	mq = ihk_ikc_malloc(sizeof(*mq) + sizeof(mq->channels[0]) * size);
+	if (!mq) {
+		return NULL;
+	}
+
+	memset(mq, 0, sizeof(*mq) + sizeof(mq->channels[0]) * size);
+	mq->size = size;
+
+	return mq;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_alloc);
+
+/*
+ * Append a sub-channel, e.g. from the listen handler on the accepting
+ * side, where the channels of ihk_ikc_mq_connect() arrive in order.
+ * Senders may be using the channel already. Returns the index of c.
+ */
+int ihk_ikc_mq_add(struct ihk_ikc_mq_channel *mq,
+                   struct ihk_ikc_channel_desc *c)
+{
+	int n;
+
+	if (!mq || !c) {
+		return -EINVAL;
+	}
+
+	n = mq->nr_queues;
+	if (n >= mq->size) {
+		return -ENOSPC;
+	}
+
+	mq->channels[n] = c;
+	ihk_ikc_store_release(&mq->nr_queues, n + 1);
+
+	return n;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_add);
+
+/*
+ * Connect nr_queues channels to the port of p in one burst and group
+ * them. Sends are routed by the current CPU modulo nr_queues. Sub-channel
+ * i interrupts CPU p->intr_cpu + i of the peer, modulo its CPUs, as an
+ * accepting side that receives by interrupt drains one regular channel
+ * per CPU.
+ */
+int ihk_ikc_mq_connect(ihk_os_t os, struct ihk_ikc_connect_param *p,
+                       int nr_queues, struct ihk_ikc_mq_channel **mqp)
+{
+	struct ihk_ikc_connect_param *ps;
+	struct ihk_ikc_mq_channel *mq;
+	int i, nr_cpus, ret;
+
+	if (!p || !mqp || nr_queues <= 0) {
+		return -EINVAL;
+	}
+
+	mq = ihk_ikc_mq_alloc(nr_queues);
+	ps = ihk_ikc_malloc(sizeof(*ps) * nr_queues);
+	if (!mq || !ps) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	nr_cpus = ihk_ikc_get_remote_nr_cpus(os);
+	for (i = 0; i < nr_queues; i++) {
+		ps[i] = *p;
+		if (nr_cpus > 0) {
+			ps[i].intr_cpu = (p->intr_cpu + i) % nr_cpus;
+		}
+	}
+
+	ret = ihk_ikc_connect_bulk(os, ps, nr_queues);
+	for (i = 0; i < nr_queues; i++) {
+		if (!ps[i].channel) {
+			continue;
+		}
+		if (ret) {
+			ihk_ikc_disconnect(ps[i].channel);
+			ihk_ikc_destroy_channel(ps[i].channel);
+		} else {
+			ihk_ikc_mq_add(mq, ps[i].channel);
+		}
+	}
+
+	if (!ret) {
+		*mqp = mq;
+		mq = NULL;
+	}
+
+out:
+	if (ps) {
+		ihk_ikc_free(ps);
+	}
+	if (mq) {
+		ihk_ikc_free(mq);
+	}
+
+	return ret;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_connect);
+
+int ihk_ikc_mq_disconnect(struct ihk_ikc_mq_channel *mq)
+{
+	int i, r, ret = 0;
+
+	if (!mq) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < mq->nr_queues; i++) {
+		r = ihk_ikc_disconnect(mq->channels[i]);
+		if (r && !ret) {
+			ret = r;
+		}
+	}
+
+	return ret;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_disconnect);
+
+void ihk_ikc_mq_destroy(struct ihk_ikc_mq_channel *mq)
+{
+	int i;
+
+	if (!mq) {
+		return;
+	}
+
+	for (i = 0; i < mq->nr_queues; i++) {
+		ihk_ikc_destroy_channel(mq->channels[i]);
+	}
+	ihk_ikc_free(mq);
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_destroy);
+
+int ihk_ikc_mq_send(struct ihk_ikc_mq_channel *mq, void *p, int opt)
+{
+	struct ihk_ikc_channel_desc *c;
+
+	if (!mq || !(c = ihk_ikc_mq_local(mq))) {
+		return -EINVAL;
+	}
+
+	return ihk_ikc_send(c, p, opt);
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_send);
+
+/*
+ * Drain all sub-channels, starting from a different one each call so
+ * that a busy ring does not starve the others. h NULL means the handler
+ * of each channel. Returns the number of packets handled.
+ */
+int ihk_ikc_mq_recv(struct ihk_ikc_mq_channel *mq,
+                    ihk_ikc_ph_t h, void *harg, int opt)
+{
+	struct ihk_ikc_channel_desc *c;
+	unsigned int first;
+	int i, n, r, found = 0;
+
+	if (!mq) {
+		return -EINVAL;
+	}
+
+	n = ihk_ikc_load_acquire(&mq->nr_queues);
+	first = mq->next++;
+	for (i = 0; i < n; i++) {
+		c = mq->channels[(first + i) % n];
+		r = ihk_ikc_recv_batch(c, h ? h : c->handler, harg, opt);
+		if (r > 0) {
+			found += r;
+		}
+	}
+
+	return found;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_mq_recv);
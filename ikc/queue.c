@@ -8,6 +8,8 @@
 #include <ikc/ihk.h>
 #include <ikc/queue.h>
 #include <ikc/msg.h>
+#include <ikc/trace.h>
+#include <ikc/tracepoint.h>
 
 //#define DEBUG_QUEUE
 
@@ -25,12 +27,17 @@
 #endif
 
 #define IHK_IKC_WRITE_QUEUE_RETRY	128
+#define IHK_IKC_BITS_PER_LONG		(sizeof(unsigned long) * 8)
+#define IHK_IKC_PACKET_POOL_MAX		512
+#define IHK_IKC_PACKET_POOL_MIN		16
+#define IHK_IKC_NT_COPY_MIN		256
 
 void ihk_ikc_notify_remote_read(struct ihk_ikc_channel_desc *c);
 void ihk_ikc_notify_remote_write(struct ihk_ikc_channel_desc *c);
 
 /*
- * Do copy by long
+ * Do copy by long, a cache line at a time where possible so that the
+ * compiler can use paired loads and stores
  */
 
 static void *memcpyl(void *dest, const void *src, size_t n)
@@ -40,6 +47,17 @@ static void *memcpyl(void *dest, const void *src, size_t n)
 
 	n /= sizeof(unsigned long);
 
+	for (; n >= 8; n -= 8, d += 8, s += 8) {
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[2];
+		d[3] = s[3];
+		d[4] = s[4];
+		d[5] = s[5];
+		d[6] = s[6];
+		d[7] = s[7];
+	}
+
 	while (n > 0) {
 		*(d++) = *(s++);
 		n--;
@@ -48,39 +66,297 @@ static void *memcpyl(void *dest, const void *src, size_t n)
 	return dest;
 }
 
+/*
+ * Writers of queues with IKC_QUEUE_FLAG_NT_COPY bypass their cache, the
+ * packets are large and read on the other side only. General purpose
+ * registers only, as vector registers are not ours to use in interrupt
+ * context on Linux.
+ */
+#if defined(__x86_64__) || defined(__aarch64__)
+static void *memcpyl_nt(void *dest, const void *src, size_t n)
+{
+	unsigned long *d = dest;
+	const unsigned long *s = src;
+	unsigned long m = n / sizeof(unsigned long);
+
+	for (; m >= 8; m -= 8, d += 8, s += 8) {
+#ifdef __x86_64__
+		asm volatile("movnti %1, %0" : "=m" (d[0]) : "r" (s[0]));
+		asm volatile("movnti %1, %0" : "=m" (d[1]) : "r" (s[1]));
+		asm volatile("movnti %1, %0" : "=m" (d[2]) : "r" (s[2]));
+		asm volatile("movnti %1, %0" : "=m" (d[3]) : "r" (s[3]));
+		asm volatile("movnti %1, %0" : "=m" (d[4]) : "r" (s[4]));
+		asm volatile("movnti %1, %0" : "=m" (d[5]) : "r" (s[5]));
+		asm volatile("movnti %1, %0" : "=m" (d[6]) : "r" (s[6]));
+		asm volatile("movnti %1, %0" : "=m" (d[7]) : "r" (s[7]));
+#else
+		asm volatile("stnp %1, %2, [%0]\n\t"
+		             "stnp %3, %4, [%0, #16]\n\t"
+		             "stnp %5, %6, [%0, #32]\n\t"
+		             "stnp %7, %8, [%0, #48]"
+		             : : "r" (d), "r" (s[0]), "r" (s[1]),
+		             "r" (s[2]), "r" (s[3]), "r" (s[4]), "r" (s[5]),
+		             "r" (s[6]), "r" (s[7]) : "memory");
+#endif
+	}
+	memcpyl(d, s, m * sizeof(unsigned long));
+
+	/* Order them before the packet is published */
+#ifdef __x86_64__
+	asm volatile("sfence" : : : "memory");
+#else
+	asm volatile("dmb ishst" : : : "memory");
+#endif
+
+	return dest;
+}
+#else
+#define memcpyl_nt memcpyl
+#endif
+
+/* Fill a slot with len bytes of packet, the rest of the slot is cleared */
+static inline void ihk_ikc_queue_copy_in(struct ihk_ikc_queue_head *q,
+                                         void *slot, const void *packet,
+                                         int len)
+{
+	int head = len & ~(int)(sizeof(unsigned long) - 1);
+
+	if (q->flag & IKC_QUEUE_FLAG_NT_COPY) {
+		memcpyl_nt(slot, packet, head);
+	} else {
+		memcpyl(slot, packet, head);
+	}
+
+	if (len < q->pktsize) {
+		memcpy((char *)slot + head, (const char *)packet + head,
+		       len - head);
+		memset((char *)slot + len, 0, q->pktsize - len);
+	}
+}
+
+static inline char *ihk_ikc_queue_slots(struct ihk_ikc_queue_head *q)
+{
+	return (char *)q + ihk_ikc_queue_head_size(q);
+}
+
+static inline uint64_t ihk_ikc_queue_index(struct ihk_ikc_queue_head *q,
+                                           uint64_t off)
+{
+	if (q->flag & IKC_QUEUE_FLAG_V2) {
+		return off & (q->pktcount - 1);
+	}
+
+	return off % q->pktcount;
+}
+
+static inline void *ihk_ikc_queue_slot(struct ihk_ikc_queue_head *q,
+                                       uint64_t off)
+{
+	return ihk_ikc_queue_slots(q) + ihk_ikc_queue_index(q, off) * q->pktsize;
+}
+
+static inline struct ihk_ikc_record_head *ihk_ikc_queue_record(
+	struct ihk_ikc_queue_head *q, uint64_t off)
+{
+	return ihk_ikc_queue_slot(q, off);
+}
+
+/*
+ * Append an entry to the trace ring of this CPU, see ikc/trace.h. The
+ * message type is read from the packet, which has to be ours for the
+ * time being.
+ */
+void __ihk_ikc_trace(int event, struct ihk_ikc_queue_head *q, uint64_t off,
+                     void *packet)
+{
+	struct ihk_ikc_trace *t;
+	struct ihk_ikc_trace_ring *ring;
+	struct ihk_ikc_trace_entry *e;
+	uint64_t h;
+	int cpu;
+
+	t = ihk_ikc_trace_get(ihk_ikc_tracer);
+	cpu = ihk_ikc_get_cpu_hint();
+	if (!t || !t->dir->enabled || cpu >= t->nr_cpus) {
+		goto out;
+	}
+
+	ring = &t->rings[cpu];
+	do {
+		h = ring->head;
+	} while (cmpxchg(&ring->head, h, h + 1) != h);
+
+	e = &t->entries[cpu][h & (t->dir->nr_entries - 1)];
+	e->tsc = ihk_ikc_get_tsc();
+	e->off = off;
+	e->channel = q ? q->channel_id : IHK_IKC_TRACE_NO_CHANNEL;
+	e->msg = packet ?
+		*(uint32_t *)((struct ihk_ikc_packet_header *)packet + 1) : 0;
+	e->cpu = cpu;
+	e->event = event;
+	e->side = t->side;
+out:
+	ihk_ikc_trace_put();
+}
+
+/* Trace the n slots at off, one entry per record on variable-length queues */
+static inline void ihk_ikc_trace_queue(int event, struct ihk_ikc_queue_head *q,
+                                       uint64_t off, uint64_t n)
+{
+	struct ihk_ikc_record_head *rec;
+	uint64_t e = off + n;
+
+	if (!ihk_ikc_tracer) {
+		return;
+	}
+
+	while (off != e) {
+		if (!(q->flag & IKC_QUEUE_FLAG_VARLEN)) {
+			__ihk_ikc_trace(event, q, off, ihk_ikc_queue_slot(q, off));
+			++off;
+			continue;
+		}
+
+		rec = ihk_ikc_queue_record(q, off);
+		if (rec->len != IHK_IKC_RECORD_SKIP) {
+			__ihk_ikc_trace(event, q, off, rec + 1);
+		}
+		off += rec->nslots;
+	}
+}
+
+/*
+ * Move an index from old by n. Queues with a single writer and a single
+ * reader (IKC_QUEUE_FLAG_SPSC) own their indices and get by with a
+ * release store, others race for them with a cmpxchg. Returns whether
+ * the index was moved.
+ */
+static inline int ihk_ikc_queue_advance(struct ihk_ikc_queue_head *q,
+                                        uint64_t *off, uint64_t old,
+                                        uint64_t n)
+{
+	if (q->flag & IKC_QUEUE_FLAG_SPSC) {
+		ihk_ikc_store_release(off, old + n);
+		return 1;
+	}
+
+	return cmpxchg(off, old, old + n) == old;
+}
+
+/*
+ * Make the n slots written at off visible to readers. With several
+ * writers this has to wait for those that reserved earlier slots, see
+ * ihk_ikc_write_queue().
+ */
+static inline void ihk_ikc_queue_publish(struct ihk_ikc_queue_head *q,
+                                         uint64_t off, uint64_t n)
+{
+	ihk_ikc_trace_queue(IHK_IKC_TRACE_ENQUEUE, q, off, n);
+
+	if (q->flag & IKC_QUEUE_FLAG_SPSC) {
+		ihk_ikc_store_release(&IHK_IKC_Q(q, max_read_off), off + n);
+		return;
+	}
+
+	while (cmpxchg(&IHK_IKC_Q(q, max_read_off), off, off + n) != off) {}
+}
+
 /*
  * NOTE: Local CPU is responsible to call the init
  */
-int ihk_ikc_init_queue(struct ihk_ikc_queue_head *q,
-                       int id, int type, int size, int packetsize)
+/* Interrupt the peer of the channel */
+static inline void ihk_ikc_kick_remote(struct ihk_ikc_channel_desc *c)
 {
+	ihk_ikc_channel_stat_add(c, notify_ipis, 1);
+	ihk_ikc_send_interrupt(c);
+}
+
+/* Raise the high-water mark of the receive queue, racy but monotonic enough */
+static inline void ihk_ikc_note_occupancy(struct ihk_ikc_channel_desc *c,
+                                          uint64_t pending)
+{
+	if (pending > ihk_ikc_stat_read(c->stats.max_occupancy)) {
+		ihk_ikc_stat_set(c->stats.max_occupancy, pending);
+	}
+}
+
+/* Count packets handed to the receiver of the channel */
+static inline void ihk_ikc_note_received(struct ihk_ikc_channel_desc *c,
+                                         int n, uint64_t bytes)
+{
+	ihk_ikc_channel_stat_add(c, received, n);
+	ihk_ikc_channel_stat_add(c, received_bytes, bytes);
+}
+
+int ihk_ikc_init_queue_flag(struct ihk_ikc_queue_head *q,
+                            int id, int type, int size, int packetsize,
+                            uint32_t flag)
+{
+	uint32_t count;
+
 	if (!q) {
 		return -EINVAL;
 	}
 
-	memset(q, 0, sizeof(*q));
+	if (flag & IKC_QUEUE_FLAG_V2) {
+		memset(q, 0, sizeof(struct ihk_ikc_queue_head_v2));
+	} else {
+		memset(q, 0, sizeof(*q));
+	}
+
+	/* Records are cut in fixed slots, packetsize is only the default */
+	if (flag & IKC_QUEUE_FLAG_VARLEN) {
+		q->msgsize = packetsize;
+		packetsize = IHK_IKC_VARLEN_SLOT_SIZE;
+	}
 
 	q->id = id;
 	q->type = type;
+	q->flag = flag;
 	q->pktsize = packetsize;
-	q->pktcount = (size - sizeof(struct ihk_ikc_queue_head)) / packetsize;
+	count = (size - ihk_ikc_queue_head_size(q)) / packetsize;
+
+	if (flag & IKC_QUEUE_FLAG_V2) {
+		/* Round down to a power of two so that slots can be masked */
+		while (count & (count - 1)) {
+			count &= count - 1;
+		}
+	}
+	q->pktcount = count;
 
-	q->read_off = q->max_read_off = q->write_off = 0;
+	IHK_IKC_Q(q, read_off) = 0;
+	IHK_IKC_Q(q, max_read_off) = 0;
+	IHK_IKC_Q(q, write_off) = 0;
 	q->read_cpu = 0;
 	q->write_cpu = 0;
-	q->queue_size = q->pktsize * q->pktcount;
+
+	/*
+	 * v2 rings may leave slack after the last slot, account for the
+	 * whole area so that the size of the mapping can be recovered.
+	 */
+	if (flag & IKC_QUEUE_FLAG_V2) {
+		q->queue_size = size - ihk_ikc_queue_head_size(q);
+	} else {
+		q->queue_size = q->pktsize * q->pktcount;
+	}
 	dkprintf("%s: queue %p pktcount: %lu\n",
 		__FUNCTION__, (void *)virt_to_phys(q), q->pktcount);
 
 	return 0;
 }
 
+int ihk_ikc_init_queue(struct ihk_ikc_queue_head *q,
+                       int id, int type, int size, int packetsize)
+{
+	return ihk_ikc_init_queue_flag(q, id, type, size, packetsize, 0);
+}
+
 int ihk_ikc_queue_is_empty(struct ihk_ikc_queue_head *q)
 {
 	if (!q) {
 		return -EINVAL;
 	}
-	return q->read_off == q->max_read_off;
+	return IHK_IKC_Q(q, read_off) == IHK_IKC_Q(q, max_read_off);
 }
 
 int ihk_ikc_queue_is_full(struct ihk_ikc_queue_head *q)
@@ -91,28 +367,60 @@ int ihk_ikc_queue_is_full(struct ihk_ikc_queue_head *q)
 		return -EINVAL;
 	}
 
-	r = q->read_off;
-	w = q->write_off;
+	r = IHK_IKC_Q(q, read_off);
+	w = IHK_IKC_Q(q, write_off);
 
 	barrier();
 
-	if ((w - r) == (q->pktcount - 1))
+	if ((w - r) >= (q->pktcount - 1))
 		return 1;
 
 	return 0;
 }
 
+/*
+ * Ask the reader of a full queue for an interrupt once it has moved
+ * read_off and return the read_off to wait for to change. Only event
+ * index queues carry the request, so waiters on other queues cannot
+ * rely on being woken up.
+ */
+uint64_t ihk_ikc_queue_want_room(struct ihk_ikc_queue_head *q)
+{
+	if (q->flag & IKC_QUEUE_FLAG_EVENT_IDX) {
+		((struct ihk_ikc_queue_head_v2 *)q)->room_wait = 1;
+		ihk_ikc_mb();
+	}
+
+	return IHK_IKC_Q(q, read_off);
+}
+
+/* Reader side of the above, called after read_off moved */
+static int ihk_ikc_queue_room_wanted(struct ihk_ikc_queue_head *q)
+{
+	uint64_t *room_wait;
+
+	if (!(q->flag & IKC_QUEUE_FLAG_EVENT_IDX)) {
+		return 0;
+	}
+
+	room_wait = &((struct ihk_ikc_queue_head_v2 *)q)->room_wait;
+	ihk_ikc_mb();
+
+	return *room_wait && cmpxchg(room_wait, 1, 0) == 1;
+}
+
 int ihk_ikc_read_queue(struct ihk_ikc_queue_head *q, void *packet, int flag)
 {
 	uint64_t r, m;
 
-	if(!q || !packet) {
+	/* Variable-length records are only read in place */
+	if(!q || !packet || (q->flag & IKC_QUEUE_FLAG_VARLEN)) {
 		return -EINVAL;
 	}
 
 retry:
-	r = q->read_off;
-	m = q->max_read_off;
+	r = IHK_IKC_Q(q, read_off);
+	m = ihk_ikc_load_acquire(&IHK_IKC_Q(q, max_read_off));
 	barrier();
 
 	/* Is the queue empty? */
@@ -120,95 +428,645 @@ retry:
 		return -1;
 	}
 
+	/* Copy first, the slot is the writers' again once read_off moved */
+	memcpyl(packet, ihk_ikc_queue_slot(q, r), q->pktsize);
+
 	/* Try to advance the queue, but see if someone else has done it already */
-	if (cmpxchg(&q->read_off, r, r + 1) != r) {
+	if (!ihk_ikc_queue_advance(q, &IHK_IKC_Q(q, read_off), r, 1)) {
 		goto retry;
 	}
 	dkprintf("%s: queue %p r: %llu, m: %llu\n",
 			__FUNCTION__, (void *)virt_to_phys(q), r, m);
-
-	memcpyl(packet,	(char *)q + sizeof(*q) +
-		((r % q->pktcount) * q->pktsize), q->pktsize);
+	ihk_ikc_trace(IHK_IKC_TRACE_DEQUEUE, q, r, packet);
 
 	return 0;
 }
 
-int ihk_ikc_read_queue_handler(struct ihk_ikc_queue_head *q, 
-                               struct ihk_ikc_channel_desc *c,
-                               int (*h)(struct ihk_ikc_channel_desc *,
-                                        void *, void *), void *harg, int flag)
+/*
+ * Claim up to n packets with a single cmpxchg on read_off. The slots are
+ * copied out before the claim so that writers, which only look at
+ * read_off, cannot reuse them while we are still reading. Returns the
+ * number of packets read, 0 if the queue is empty.
+ */
+int ihk_ikc_read_queue_batch(struct ihk_ikc_queue_head *q,
+                             void **packets, int n, int flag)
 {
 	uint64_t r, m;
+	int i;
+
+	if (!q || !packets || n <= 0 || (q->flag & IKC_QUEUE_FLAG_VARLEN)) {
+		return -EINVAL;
+	}
 
 retry:
-	r = q->read_off;
-	m = q->max_read_off;
+	r = IHK_IKC_Q(q, read_off);
+	m = ihk_ikc_load_acquire(&IHK_IKC_Q(q, max_read_off));
 	barrier();
 
 	/* Is the queue empty? */
 	if (r == m) {
+		return 0;
+	}
+
+	if (n > m - r) {
+		n = m - r;
+	}
+
+	for (i = 0; i < n; ++i) {
+		memcpyl(packets[i], ihk_ikc_queue_slot(q, r + i), q->pktsize);
+	}
+
+	/* Someone else took (some of) them, start over */
+	if (!ihk_ikc_queue_advance(q, &IHK_IKC_Q(q, read_off), r, n)) {
+		goto retry;
+	}
+	dkprintf("%s: queue %p r: %llu, m: %llu, n: %d\n",
+			__FUNCTION__, (void *)virt_to_phys(q), r, m, n);
+
+	/* The slots may be reused already, look at the copies */
+	for (i = 0; i < n; ++i) {
+		ihk_ikc_trace(IHK_IKC_TRACE_DEQUEUE, q, r + i, packets[i]);
+	}
+
+	return n;
+}
+
+/*
+ * Walk the records of a variable-length queue from l towards m and collect
+ * the payloads of up to n of them, skip markers are stepped over. Returns
+ * the number of records found and their end in *e, or -1 if the walk ran
+ * into slots that have been recycled under us.
+ */
+static int ihk_ikc_queue_records(struct ihk_ikc_queue_head *q,
+                                 uint64_t l, uint64_t m,
+                                 void **packets, int n, uint64_t *e)
+{
+	struct ihk_ikc_record_head *rec;
+	int got = 0;
+
+	while (l != m && got < n) {
+		rec = ihk_ikc_queue_record(q, l);
+		if (rec->nslots == 0 || rec->nslots > m - l) {
+			return -1;
+		}
+
+		if (rec->len != IHK_IKC_RECORD_SKIP) {
+			packets[got++] = rec + 1;
+		}
+		l += rec->nslots;
+	}
+
+	*e = l;
+	return got;
+}
+
+/*
+ * Zero-copy read: claim up to n slots (records on variable-length queues)
+ * with a single cmpxchg on the lease offset of the channel and return
+ * pointers into the ring. read_off, which is what writers look at, only
+ * advances over slots that have been given back with
+ * ihk_ikc_release_lease(), so leased slots are never overwritten.
+ * Returns the number of packets leased, 0 if there is nothing to read.
+ */
+static int ihk_ikc_read_queue_lease(struct ihk_ikc_channel_desc *c,
+                                    void **packets, int n)
+{
+	struct ihk_ikc_queue_head *q = c->recv.queue;
+	uint64_t l, m, e, bytes = 0;
+	int i;
+
+retry:
+	l = c->recv.lease_off;
+	m = ihk_ikc_load_acquire(&IHK_IKC_Q(q, max_read_off));
+	barrier();
+
+	if (l == m) {
+		return 0;
+	}
+
+	if (q->flag & IKC_QUEUE_FLAG_VARLEN) {
+		n = ihk_ikc_queue_records(q, l, m, packets, n, &e);
+		if (n < 0) {
+			goto retry;
+		}
+	} else {
+		if (n > m - l) {
+			n = m - l;
+		}
+		e = l + n;
+	}
+
+	if (!ihk_ikc_queue_advance(q, &c->recv.lease_off, l, e - l)) {
+		goto retry;
+	}
+	dkprintf("%s: queue %p l: %llu, m: %llu, n: %d\n",
+			__FUNCTION__, (void *)virt_to_phys(q), l, m, n);
+	ihk_ikc_trace_queue(IHK_IKC_TRACE_DEQUEUE, q, l, e - l);
+
+	for (i = 0; i < n; ++i) {
+		if (!(q->flag & IKC_QUEUE_FLAG_VARLEN)) {
+			packets[i] = ihk_ikc_queue_slot(q, l + i);
+			bytes += q->pktsize;
+		} else {
+			bytes += ihk_ikc_packet_length(c, packets[i]);
+		}
+		((struct ihk_ikc_packet_header *)packets[i])->channel = c;
+	}
+
+	ihk_ikc_note_occupancy(c, m - IHK_IKC_Q(q, read_off));
+	ihk_ikc_note_received(c, n, bytes);
+
+	return n;
+}
+
+static int ihk_ikc_is_leased(struct ihk_ikc_channel_desc *c, void *packet)
+{
+	struct ihk_ikc_queue_head *q = c->recv.queue;
+	char *base = ihk_ikc_queue_slots(q);
+
+	return c->recv.lease_map && (char *)packet >= base &&
+		(char *)packet < base + (unsigned long)q->pktcount * q->pktsize;
+}
+
+/*
+ * Give a slot obtained through the zero-copy receive path back to the
+ * writer. Leases can be released in any order: released slots are marked
+ * in the lease map and read_off is moved over the released prefix. On
+ * variable-length queues the first slot of a record stands for the whole
+ * record, and skip markers are retired as soon as they are reached.
+ */
+void ihk_ikc_release_lease(struct ihk_ikc_channel_desc *c, void *packet)
+{
+	struct ihk_ikc_queue_head *q = c->recv.queue;
+	unsigned long *map = c->recv.lease_map;
+	struct ihk_ikc_record_head *rec;
+	unsigned long idx, flags;
+	uint64_t r, l, old;
+
+	idx = ((char *)packet - ihk_ikc_queue_slots(q)) / q->pktsize;
+
+	flags = ihk_ikc_spinlock_lock(&c->recv.lock);
+	map[idx / IHK_IKC_BITS_PER_LONG] |= 1UL << (idx % IHK_IKC_BITS_PER_LONG);
+
+	r = old = IHK_IKC_Q(q, read_off);
+	l = c->recv.lease_off;
+	while (r != l) {
+		rec = ihk_ikc_queue_record(q, r);
+		if ((q->flag & IKC_QUEUE_FLAG_VARLEN) &&
+		    rec->len == IHK_IKC_RECORD_SKIP) {
+			r += rec->nslots;
+			continue;
+		}
+
+		idx = ihk_ikc_queue_index(q, r);
+		if (!(map[idx / IHK_IKC_BITS_PER_LONG] &
+		      (1UL << (idx % IHK_IKC_BITS_PER_LONG)))) {
+			break;
+		}
+		map[idx / IHK_IKC_BITS_PER_LONG] &=
+			~(1UL << (idx % IHK_IKC_BITS_PER_LONG));
+		r += (q->flag & IKC_QUEUE_FLAG_VARLEN) ? rec->nslots : 1;
+	}
+
+	ihk_ikc_store_release(&IHK_IKC_Q(q, read_off), r);
+	ihk_ikc_spinlock_unlock(&c->recv.lock, flags);
+
+	/* Room is only made here, tell a writer waiting for it */
+	if (r != old && ihk_ikc_queue_room_wanted(q)) {
+		ihk_ikc_kick_remote(c);
+	}
+}
+
+/*
+ * Pass the next packet of the channel to the handler in place. The handler
+ * owns the slot until it calls ihk_ikc_release_lease() (or
+ * ihk_ikc_release_packet(), which recognizes leased slots).
+ */
+int ihk_ikc_read_queue_handler(struct ihk_ikc_queue_head *q,
+                               struct ihk_ikc_channel_desc *c,
+                               int (*h)(struct ihk_ikc_channel_desc *,
+                                        void *, void *), void *harg, int flag)
+{
+	void *packet;
+
+	if (!q || !c || !c->recv.lease_map) {
+		return -EINVAL;
+	}
+
+	if (ihk_ikc_read_queue_lease(c, &packet, 1) == 0) {
 		return -1;
 	}
 
-	/* Try to advance the queue, but see if someone else has done it already */
-	if (cmpxchg(&q->read_off, r, r + 1) != r) {
+	h(c, packet, harg);
+	ihk_ikc_trace(IHK_IKC_TRACE_HANDLED, q, c->recv.lease_off, NULL);
+
+	return 0;
+}
+
+int ihk_ikc_write_queue(struct ihk_ikc_queue_head *q, void *packet, int flag)
+{
+	uint64_t r, w;
+	int attempt = 0;
+
+	if (!q || !packet) {
+		return -EINVAL;
+	}
+
+	if (q->flag & IKC_QUEUE_FLAG_VARLEN) {
+		return ihk_ikc_write_queue_var(q, packet, 0, flag);
+	}
+
+retry:
+	r = ihk_ikc_load_acquire(&IHK_IKC_Q(q, read_off));
+	w = IHK_IKC_Q(q, write_off);
+	barrier();
+
+	/* Is the queue full? */
+	if ((w - r) >= (q->pktcount - 1)) {
+		/* Did we run out of attempts? */
+		if (++attempt > IHK_IKC_WRITE_QUEUE_RETRY) {
+			dkprintf("%s: queue %p r: %llu, w: %llu is full\n",
+					__FUNCTION__, (void *)virt_to_phys(q), r, w);
+			return -EBUSY;
+		}
+
+		dkprintf("%s: queue %p r: %llu, w: %llu full, retrying\n",
+			__FUNCTION__, (void *)virt_to_phys(q), r, w);
+		goto retry;
+	}
+
+	/* Try to advance the queue, but see if someone else has done it already */
+	if (!ihk_ikc_queue_advance(q, &IHK_IKC_Q(q, write_off), w, 1)) {
+		goto retry;
+	}
+	dkprintf("%s: queue %p r: %llu, w: %llu\n",
+			__FUNCTION__, (void *)virt_to_phys(q), r, w);
+
+	ihk_ikc_queue_copy_in(q, ihk_ikc_queue_slot(q, w), packet,
+	                      q->pktsize);
+
+	/*
+	 * Advance the max read index so that the element is visible to readers,
+	 * this has to succeed eventually, but we cannot afford to be interrupted
+	 * by another request which would then end up waiting for this hence
+	 * IRQs are disabled during queue operations.
+	 */
+	ihk_ikc_queue_publish(q, w, 1);
+
+	return 0;
+}
+
+/*
+ * Reserve room for a record of len bytes on a variable-length queue. If
+ * the record does not fit before the end of the ring the remaining slots
+ * are reserved as well and covered by a skip marker. On success *off is
+ * the start of the reservation, which has to be published with
+ * ihk_ikc_write_queue_commit(), and *rec the head of the record.
+ */
+static int ihk_ikc_write_queue_claim(struct ihk_ikc_queue_head *q, int len,
+                                     struct ihk_ikc_record_head **rec,
+                                     uint64_t *off)
+{
+	struct ihk_ikc_record_head *skip;
+	uint64_t r, w, nslots, tail, total;
+	int attempt = 0;
+
+	nslots = (sizeof(**rec) + len + q->pktsize - 1) / q->pktsize;
+
+	/* Must fit with the worst case skip marker in front of it */
+	if (len < sizeof(struct ihk_ikc_packet_header) ||
+	    nslots > q->pktcount / 2) {
+		return -EINVAL;
+	}
+
+retry:
+	r = ihk_ikc_load_acquire(&IHK_IKC_Q(q, read_off));
+	w = IHK_IKC_Q(q, write_off);
+	barrier();
+
+	tail = q->pktcount - ihk_ikc_queue_index(q, w);
+	total = (tail < nslots) ? tail + nslots : nslots;
+
+	/* Is the queue full? */
+	if ((w - r) + total > (q->pktcount - 1)) {
+		if (++attempt > IHK_IKC_WRITE_QUEUE_RETRY) {
+			dkprintf("%s: queue %p r: %llu, w: %llu is full\n",
+				__FUNCTION__, (void *)virt_to_phys(q), r, w);
+			return -EBUSY;
+		}
+		goto retry;
+	}
+
+	if (!ihk_ikc_queue_advance(q, &IHK_IKC_Q(q, write_off), w, total)) {
+		goto retry;
+	}
+	dkprintf("%s: queue %p r: %llu, w: %llu, nslots: %llu\n",
+			__FUNCTION__, (void *)virt_to_phys(q), r, w, total);
+
+	if (total != nslots) {
+		skip = ihk_ikc_queue_record(q, w);
+		skip->len = IHK_IKC_RECORD_SKIP;
+		skip->nslots = tail;
+	}
+
+	*rec = ihk_ikc_queue_record(q, w + total - nslots);
+	(*rec)->len = len;
+	(*rec)->nslots = nslots;
+	*off = w;
+
+	return 0;
+}
+
+/*
+ * Write len bytes of packet. On variable-length queues this is one record
+ * (len 0 stands for the default length of the queue), on fixed-size queues
+ * len may not exceed the packet size and the rest of the slot is zeroed.
+ * The payload starts with the usual struct ihk_ikc_packet_header.
+ */
+int ihk_ikc_write_queue_var(struct ihk_ikc_queue_head *q, void *packet,
+                            int len, int flag)
+{
+	struct ihk_ikc_record_head *rec;
+	uint64_t off;
+	void *slot;
+	int r;
+
+	if (!q || !packet || len < 0) {
+		return -EINVAL;
+	}
+
+	if (!(q->flag & IKC_QUEUE_FLAG_VARLEN)) {
+		if (!len) {
+			return ihk_ikc_write_queue(q, packet, flag);
+		}
+		if (len > q->pktsize) {
+			return -EINVAL;
+		}
+
+		r = ihk_ikc_write_queue_reserve(q, &slot, &off);
+		if (r) {
+			return r;
+		}
+		ihk_ikc_queue_copy_in(q, slot, packet, len);
+		ihk_ikc_write_queue_commit(q, off);
+
+		return 0;
+	}
+
+	if (!len) {
+		len = q->msgsize;
+	}
+
+	r = ihk_ikc_write_queue_claim(q, len, &rec, &off);
+	if (r) {
+		return r;
+	}
+
+	memcpy(rec + 1, packet, len);
+	ihk_ikc_write_queue_commit(q, off);
+
+	return 0;
+}
+
+/*
+ * Zero-copy write: reserve the next slot so that the caller can build the
+ * packet in place, then publish it with ihk_ikc_write_queue_commit().
+ * Writers that reserved later wait in their commit until this one is
+ * committed, so the two calls must not be separated by anything that
+ * can block.
+ */
+int ihk_ikc_write_queue_reserve(struct ihk_ikc_queue_head *q,
+                                void **slot, uint64_t *off)
+{
+	uint64_t r, w;
+	int attempt = 0;
+
+	if (!q || !slot || !off) {
+		return -EINVAL;
+	}
+
+	/* A record of the default length */
+	if (q->flag & IKC_QUEUE_FLAG_VARLEN) {
+		struct ihk_ikc_record_head *rec;
+		int ret;
+
+		ret = ihk_ikc_write_queue_claim(q, q->msgsize, &rec, off);
+		if (ret) {
+			return ret;
+		}
+
+		*slot = rec + 1;
+		return 0;
+	}
+
+retry:
+	r = ihk_ikc_load_acquire(&IHK_IKC_Q(q, read_off));
+	w = IHK_IKC_Q(q, write_off);
+	barrier();
+
+	/* Is the queue full? */
+	if ((w - r) >= (q->pktcount - 1)) {
+		if (++attempt > IHK_IKC_WRITE_QUEUE_RETRY) {
+			dkprintf("%s: queue %p r: %llu, w: %llu is full\n",
+				__FUNCTION__, (void *)virt_to_phys(q), r, w);
+			return -EBUSY;
+		}
+		goto retry;
+	}
+
+	if (!ihk_ikc_queue_advance(q, &IHK_IKC_Q(q, write_off), w, 1)) {
 		goto retry;
 	}
-	dkprintf("%s: queue %p r: %llu, m: %llu\n",
-			__FUNCTION__, (void *)virt_to_phys(q), r, m);
 
-	h(c, (char *)q + sizeof(*q) + ((r % q->pktcount) * q->pktsize), harg);
+	*slot = ihk_ikc_queue_slot(q, w);
+	*off = w;
 
 	return 0;
 }
 
-int ihk_ikc_write_queue(struct ihk_ikc_queue_head *q, void *packet, int flag)
+void ihk_ikc_write_queue_commit(struct ihk_ikc_queue_head *q, uint64_t off)
 {
-	uint64_t r, w;
+	struct ihk_ikc_record_head *rec;
+	uint64_t n = 1;
+
+	/* The reservation is described by its record (and skip marker) */
+	if (q->flag & IKC_QUEUE_FLAG_VARLEN) {
+		rec = ihk_ikc_queue_record(q, off);
+		n = rec->nslots;
+		if (rec->len == IHK_IKC_RECORD_SKIP) {
+			n += ihk_ikc_queue_record(q, off + n)->nslots;
+		}
+	}
+
+	ihk_ikc_queue_publish(q, off, n);
+}
+
+/*
+ * Write up to n packets with a single reservation on write_off and a
+ * single advance of max_read_off. Returns the number of packets written,
+ * which is less than n if the queue does not have room for all of them.
+ */
+int ihk_ikc_write_queue_batch(struct ihk_ikc_queue_head *q,
+                              void **packets, int n, int flag)
+{
+	uint64_t r, w, room;
 	int attempt = 0;
+	int i;
 
-	if (!q || !packet) {
+	if (!q || !packets || n <= 0) {
 		return -EINVAL;
 	}
 
+	/* One record at a time, they differ in size anyway */
+	if (q->flag & IKC_QUEUE_FLAG_VARLEN) {
+		for (i = 0; i < n; ++i) {
+			if (ihk_ikc_write_queue_var(q, packets[i], 0, flag)) {
+				break;
+			}
+		}
+
+		return i ? i : -EBUSY;
+	}
+
 retry:
-	r = q->read_off;
-	w = q->write_off;
+	r = ihk_ikc_load_acquire(&IHK_IKC_Q(q, read_off));
+	w = IHK_IKC_Q(q, write_off);
 	barrier();
 
 	/* Is the queue full? */
-	if ((w - r) == (q->pktcount - 1)) {
-		/* Did we run out of attempts? */
+	if ((w - r) >= (q->pktcount - 1)) {
 		if (++attempt > IHK_IKC_WRITE_QUEUE_RETRY) {
-			kprintf("%s: queue %p r: %llu, w: %llu is full\n",
-					__FUNCTION__, (void *)virt_to_phys(q), r, w);
+			dkprintf("%s: queue %p r: %llu, w: %llu is full\n",
+				__FUNCTION__, (void *)virt_to_phys(q), r, w);
 			return -EBUSY;
 		}
-
-		dkprintf("%s: queue %p r: %llu, w: %llu full, retrying\n",
-			__FUNCTION__, (void *)virt_to_phys(q), r, w);
 		goto retry;
 	}
 
-	/* Try to advance the queue, but see if someone else has done it already */
-	if (cmpxchg(&q->write_off, w, w + 1) != w) {
+	room = (q->pktcount - 1) - (w - r);
+	if (n > room) {
+		n = room;
+	}
+
+	/* Reserve all n slots at once */
+	if (!ihk_ikc_queue_advance(q, &IHK_IKC_Q(q, write_off), w, n)) {
 		goto retry;
 	}
-	dkprintf("%s: queue %p r: %llu, w: %llu\n",
-			__FUNCTION__, (void *)virt_to_phys(q), r, w);
+	dkprintf("%s: queue %p r: %llu, w: %llu, n: %d\n",
+			__FUNCTION__, (void *)virt_to_phys(q), r, w, n);
 
-	memcpyl((char *)q + sizeof(*q) + ((w % q->pktcount) * q->pktsize),
-			packet, q->pktsize);
+	for (i = 0; i < n; ++i) {
+		ihk_ikc_queue_copy_in(q, ihk_ikc_queue_slot(q, w + i),
+		                      packets[i], q->pktsize);
+	}
 
-	/*
-	 * Advance the max read index so that the element is visible to readers,
-	 * this has to succeed eventually, but we cannot afford to be interrupted
-	 * by another request which would then end up waiting for this hence
-	 * IRQs are disabled during queue operations.
-	 */
-	while (cmpxchg(&q->max_read_off, w, w + 1) != w) {}
+	/* Publish the whole batch */
+	ihk_ikc_queue_publish(q, w, n);
 
-	return 0;
+	return n;
+}
+
+/*
+ * Packet pool functions. Packets for copying reception come from an
+ * array preallocated to the depth of the receive queue (up to
+ * IHK_IKC_PACKET_POOL_MAX) and are kept on a lock-free stack of indices.
+ * The head carries a tag which is bumped by every pop so that a stale
+ * head cannot be swapped in (ABA). Only when the pool is exhausted are
+ * packets allocated one by one, and freed again on release.
+ *
+ * Channels are set up from packet handlers too, so the pool is allocated
+ * atomically. A large pool is the first thing to fail there, so a pool
+ * half the size is tried down to IHK_IKC_PACKET_POOL_MIN packets before
+ * the channel goes without one.
+ */
+static void ihk_ikc_init_packet_pool(struct ihk_ikc_channel_desc *c)
+{
+	int n = c->recv.queue->pktcount;
+	int i;
+
+	if (n > IHK_IKC_PACKET_POOL_MAX) {
+		n = IHK_IKC_PACKET_POOL_MAX;
+	}
+
+	for (; n > 0; n = n > IHK_IKC_PACKET_POOL_MIN ? n / 2 : 0) {
+		c->packet_pool = ihk_ikc_malloc(n * c->recv.queue->pktsize);
+		if (!c->packet_pool) {
+			continue;
+		}
+		c->packet_pool_next = ihk_ikc_malloc(n * sizeof(uint32_t));
+		if (c->packet_pool_next) {
+			break;
+		}
+		ihk_ikc_free(c->packet_pool);
+		c->packet_pool = NULL;
+	}
+
+	if (!n) {
+		/* Not fatal, every packet is allocated then */
+		kprintf("%s: WARNING: no packet pool for channel %d\n",
+			__FUNCTION__, c->channel_id);
+		c->packet_pool_size = 0;
+		c->packet_pool_head = 0;
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		c->packet_pool_next[i] = i + 1 < n ? i + 2 : 0;
+	}
+	c->packet_pool_size = n;
+	c->packet_pool_head = 1;
+}
+
+static void ihk_ikc_free_packet_pool(struct ihk_ikc_channel_desc *c)
+{
+	if (c->packet_pool) {
+		ihk_ikc_free(c->packet_pool);
+		ihk_ikc_free(c->packet_pool_next);
+		c->packet_pool = NULL;
+		c->packet_pool_next = NULL;
+	}
+}
+
+static void *ihk_ikc_packet_pool_pop(struct ihk_ikc_channel_desc *c)
+{
+	uint64_t head, next;
+	uint32_t idx;
+
+	do {
+		head = c->packet_pool_head;
+		barrier();
+		idx = (uint32_t)head;
+		if (!idx) {
+			return NULL;
+		}
+		next = ((head >> 32) + 1) << 32 | c->packet_pool_next[idx - 1];
+	} while (cmpxchg(&c->packet_pool_head, head, next) != head);
+
+	return c->packet_pool + (unsigned long)(idx - 1) *
+		c->recv.queue->pktsize;
+}
+
+static void ihk_ikc_packet_pool_push(struct ihk_ikc_channel_desc *c,
+                                     void *p)
+{
+	uint64_t head;
+	uint32_t idx;
+
+	idx = ((char *)p - c->packet_pool) / c->recv.queue->pktsize + 1;
+
+	do {
+		head = c->packet_pool_head;
+		barrier();
+		c->packet_pool_next[idx - 1] = (uint32_t)head;
+	} while (cmpxchg(&c->packet_pool_head, head,
+	                 (head & ~0xffffffffULL) | idx) != head);
+}
+
+static int ihk_ikc_is_pooled(struct ihk_ikc_channel_desc *c, void *p)
+{
+	return c->packet_pool && (char *)p >= c->packet_pool &&
+		(char *)p < c->packet_pool +
+		(unsigned long)c->packet_pool_size * c->recv.queue->pktsize;
 }
 
 /*
@@ -224,9 +1082,9 @@ void ihk_ikc_init_desc(struct ihk_ikc_channel_desc *c,
 	struct list_head *all_list = ihk_ikc_get_channel_list(ros);
 	ihk_spinlock_t *all_lock = ihk_ikc_get_channel_list_lock(ros);
 	unsigned long flags;
+	int ret;
 
 	INIT_LIST_HEAD(&c->list_all);
-	INIT_LIST_HEAD(&c->packet_pool);
 
 	c->remote_os = ros;
 	c->port = port;
@@ -248,53 +1106,99 @@ void ihk_ikc_init_desc(struct ihk_ikc_channel_desc *c,
 
 	ihk_ikc_spinlock_init(&c->recv.lock);
 	ihk_ikc_spinlock_init(&c->send.lock);
-	ihk_ikc_spinlock_init(&c->packet_pool_lock);
+
+	/* Leases need no packets */
+	if (rq && !(c->flag & (IKC_FLAG_NO_COPY | IKC_FLAG_VARLEN))) {
+		ihk_ikc_init_packet_pool(c);
+	}
 
 	flags = ihk_ikc_spinlock_lock(all_lock);
 	list_add_tail(&c->list_all, all_list);
 	ihk_ikc_spinlock_unlock(all_lock, flags);
+
+	/* -EBUSY: the slot is taken, the channel list still has it */
+	ret = ihk_ikc_insert_channel(ros, c);
+	if (ret && ret != -EBUSY) {
+		kprintf("%s: WARNING: channel %d not in the lookup table\n",
+			__FUNCTION__, c->channel_id);
+	}
 }
 
 /*
- * Packet pool functions.
+ * Switch the receive side of the channel to zero-copy reception. Must be
+ * called before the channel is enabled, ihk_ikc_create_channel() does it
+ * for IKC_FLAG_NO_COPY.
  */
-struct ihk_ikc_free_packet *ihk_ikc_alloc_packet(
-	struct ihk_ikc_channel_desc *c)
+int ihk_ikc_channel_set_nocopy(struct ihk_ikc_channel_desc *c)
 {
-	unsigned long flags;
-	struct ihk_ikc_free_packet *p = NULL;
-	struct ihk_ikc_free_packet *p_iter;
+	unsigned long *map;
+	int size;
 
-	flags = ihk_ikc_spinlock_lock(&c->packet_pool_lock);
-	list_for_each_entry(p_iter, &c->packet_pool, list) {
-		p = p_iter;
-		list_del(&p->list);
-		break;
+	if (!c || !c->recv.queue) {
+		return -EINVAL;
 	}
 
-	/* No packet? Allocate new */
-	if (!p) {
-retry_alloc:
-		p = (struct ihk_ikc_free_packet *)ihk_ikc_malloc(c->recv.queue->pktsize);
-		if (!p) {
-			kprintf("%s: ERROR allocating packet, retrying\n", __FUNCTION__);
-			goto retry_alloc;
-		}
-		dkprintf("%s: packet %p kmalloc'd on channel %p %s\n",
-			__FUNCTION__, p, c, c == c->master ? "(master)" : "");
+	if (c->recv.lease_map) {
+		return 0;
+	}
+
+	size = ((c->recv.queue->pktcount + IHK_IKC_BITS_PER_LONG - 1) /
+		IHK_IKC_BITS_PER_LONG) * sizeof(unsigned long);
+	map = ihk_ikc_malloc(size);
+	if (!map) {
+		return -ENOMEM;
 	}
-	else {
+	memset(map, 0, size);
+
+	c->recv.lease_off = IHK_IKC_Q(c->recv.queue, read_off);
+	c->recv.lease_map = map;
+	c->flag |= IKC_FLAG_NO_COPY;
+	ihk_ikc_free_packet_pool(c);
+
+	return 0;
+}
+
+void ihk_ikc_channel_stats_reset(struct ihk_ikc_channel_desc *c)
+{
+	ihk_ikc_stat_set(c->stats.sent, 0);
+	ihk_ikc_stat_set(c->stats.sent_bytes, 0);
+	ihk_ikc_stat_set(c->stats.received, 0);
+	ihk_ikc_stat_set(c->stats.received_bytes, 0);
+	ihk_ikc_stat_set(c->stats.queue_full, 0);
+	ihk_ikc_stat_set(c->stats.write_retries, 0);
+	ihk_ikc_stat_set(c->stats.busy, 0);
+	ihk_ikc_stat_set(c->stats.notify_ipis, 0);
+	ihk_ikc_stat_set(c->stats.max_occupancy, 0);
+	ihk_ikc_stat_set(c->stats.pool_mallocs, 0);
+}
+
+struct ihk_ikc_free_packet *ihk_ikc_alloc_packet(
+	struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_ikc_free_packet *p;
+
+	p = ihk_ikc_packet_pool_pop(c);
+	if (p) {
 		dkprintf("%s: packet %p obtained from pool on channel %p %s\n",
 			__FUNCTION__, p, c, c == c->master ? "(master)" : "");
+		return p;
+	}
+
+	/* Pool exhausted, callers cope with failure */
+	ihk_ikc_channel_stat_add(c, pool_mallocs, 1);
+	p = (struct ihk_ikc_free_packet *)ihk_ikc_malloc(c->recv.queue->pktsize);
+	if (!p) {
+		kprintf("%s: ERROR allocating packet\n", __FUNCTION__);
+		return NULL;
 	}
+	dkprintf("%s: packet %p kmalloc'd on channel %p %s\n",
+		__FUNCTION__, p, c, c == c->master ? "(master)" : "");
 
-	ihk_ikc_spinlock_unlock(&c->packet_pool_lock, flags);
 	return p;
 }
 
 void ihk_ikc_release_packet(struct ihk_ikc_free_packet *p)
 {
-	unsigned long flags;
 	struct ihk_ikc_channel_desc *c;
 
 	if (!p) {
@@ -310,9 +1214,17 @@ void ihk_ikc_release_packet(struct ihk_ikc_free_packet *p)
 		return;
 	}
 
-	flags = ihk_ikc_spinlock_lock(&c->packet_pool_lock);
-	list_add_tail(&p->list, &c->packet_pool);
-	ihk_ikc_spinlock_unlock(&c->packet_pool_lock, flags);
+	if (ihk_ikc_is_leased(c, p)) {
+		ihk_ikc_release_lease(c, p);
+		return;
+	}
+
+	if (!ihk_ikc_is_pooled(c, p)) {
+		ihk_ikc_free(p);
+		return;
+	}
+
+	ihk_ikc_packet_pool_push(c, p);
 	dkprintf("%s: packet %p released to pool on channel %p %s\n",
 			__FUNCTION__, p, c, c == c->master ? "(master)" : "");
 }
@@ -372,8 +1284,18 @@ struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
 			return NULL;
 		}
 
-		ihk_ikc_init_queue(recvq, 1, port, PAGE_SIZE * qpages,
-		                   packet_size);
+		ihk_ikc_init_queue_flag(recvq, 1, port, PAGE_SIZE * qpages,
+		                        packet_size,
+		                        ((f & IKC_FLAG_QUEUE_V2) ?
+		                         IKC_QUEUE_FLAG_V2 |
+		                         IKC_QUEUE_FLAG_EVENT_IDX : 0) |
+		                        ((f & IKC_FLAG_VARLEN) ?
+		                         IKC_QUEUE_FLAG_VARLEN : 0) |
+		                        ((f & IKC_FLAG_SPSC) ?
+		                         IKC_QUEUE_FLAG_SPSC : 0) |
+		                        (packet_size >= IHK_IKC_NT_COPY_MIN &&
+		                         !(f & IKC_FLAG_VARLEN) ?
+		                         IKC_QUEUE_FLAG_NT_COPY : 0));
 		*rq = virt_to_phys(recvq);
 
 		desc->recv.qrphys = 0;
@@ -403,6 +1325,13 @@ struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
 	ihk_ikc_init_desc(desc, os, port, recvq, sendq, NULL,
 			ihk_ikc_get_master_channel(os));
 
+	/* Records of variable-length queues are always received in place */
+	if ((f & (IKC_FLAG_NO_COPY | IKC_FLAG_VARLEN)) &&
+	    ihk_ikc_channel_set_nocopy(desc)) {
+		ihk_ikc_free_channel(desc);
+		return NULL;
+	}
+
 	return desc;
 }
 
@@ -411,23 +1340,24 @@ void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
 	ihk_os_t os = desc->remote_os;
 	int qpages;
 	ihk_spinlock_t *lock = ihk_ikc_get_channel_list_lock(os);
-	struct ihk_ikc_free_packet *p_iter, *p_next;
 	unsigned long flags;
 
+	ihk_ikc_remove_channel(os, desc);
+
 	flags = ihk_ikc_spinlock_lock(lock);
 	list_del(&desc->list_all);
 	ihk_ikc_spinlock_unlock(lock, flags);
 
-	flags = ihk_ikc_spinlock_lock(&desc->packet_pool_lock);
-	list_for_each_entry_safe(p_iter, p_next, &desc->packet_pool, list) {
-		list_del(&p_iter->list);
-		ihk_ikc_free(p_iter);
+	ihk_ikc_free_packet_pool(desc);
+
+	if (desc->recv.lease_map) {
+		ihk_ikc_free(desc->recv.lease_map);
 	}
-	ihk_ikc_spinlock_unlock(&desc->packet_pool_lock, flags);
 
 	if (desc->recv.queue) {
 		qpages = (desc->recv.queue->queue_size
-		          + sizeof(struct ihk_ikc_queue_head) + PAGE_SIZE - 1)
+		          + ihk_ikc_queue_head_size(desc->recv.queue)
+		          + PAGE_SIZE - 1)
 			>> PAGE_SHIFT;
 		if (desc->recv.qrphys) {
 			ihk_ikc_unmap_virtual(ihk_os_to_dev(os),
@@ -441,7 +1371,8 @@ void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
 
 	if (desc->send.queue) {
 		qpages = (desc->send.queue->queue_size
-		          + sizeof(struct ihk_ikc_queue_head) + PAGE_SIZE - 1)
+		          + ihk_ikc_queue_head_size(desc->send.queue)
+		          + PAGE_SIZE - 1)
 			>> PAGE_SHIFT;
 		if (desc->send.qrphys) {
 			ihk_ikc_unmap_virtual(ihk_os_to_dev(os),
@@ -457,6 +1388,117 @@ void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
 }
 
 
+/*
+ * Zero-copy send. On success slot->packet points to a slot of the remote
+ * ring of the packet size of the channel in which the caller builds
+ * the packet, and interrupts stay disabled until ihk_ikc_send_commit()
+ * publishes it, which the caller must do without sleeping.
+ */
+int ihk_ikc_send_reserve(struct ihk_ikc_channel_desc *channel,
+                         struct ihk_ikc_send_slot *slot, int opt)
+{
+	int r;
+	unsigned long flags;
+
+	if (!channel || !slot) {
+		return -EINVAL;
+	}
+
+#ifdef IHK_OS_MANYCORE
+	flags = cpu_disable_interrupt_save();
+#else
+	local_irq_save(flags);
+#endif
+	if (ihk_ikc_channel_enabled(channel)) {
+		r = ihk_ikc_write_queue_reserve(channel->send.queue,
+		                                &slot->packet, &slot->off);
+	} else {
+		r = -EINVAL;
+	}
+
+	/* Does not wait for room, callers may not be able to */
+	if (r == -EBUSY) {
+		ihk_ikc_channel_stat_add(channel, queue_full, 1);
+		ihk_ikc_channel_stat_add(channel, busy, 1);
+		if (opt & IKC_NONBLOCK) {
+			r = -EAGAIN;
+		}
+	}
+
+	if (r) {
+#ifdef IHK_OS_MANYCORE
+		cpu_restore_interrupt(flags);
+#else
+		local_irq_restore(flags);
+#endif
+		return r;
+	}
+
+	slot->flags = flags;
+	slot->opt = opt;
+
+	return 0;
+}
+
+int ihk_ikc_send_commit(struct ihk_ikc_channel_desc *channel,
+                        struct ihk_ikc_send_slot *slot)
+{
+	if (!channel || !slot || !slot->packet) {
+		return -EINVAL;
+	}
+
+	ihk_ikc_write_queue_commit(channel->send.queue, slot->off);
+	slot->packet = NULL;
+	ihk_ikc_channel_stat_add(channel, sent, 1);
+	ihk_ikc_channel_stat_add(channel, sent_bytes,
+	                         ihk_ikc_send_length(channel));
+
+	if (!(slot->opt & IKC_NO_NOTIFY)) {
+		ihk_ikc_notify_remote_write(channel);
+	}
+
+#ifdef IHK_OS_MANYCORE
+	cpu_restore_interrupt(slot->flags);
+#else
+	local_irq_restore(slot->flags);
+#endif
+
+	return 0;
+}
+
+/*
+ * Event index: the reader found the queue empty and is about to rely on
+ * interrupts again. Ask for one at the next offset it is going to read
+ * and return whether something was published in the meantime, in which
+ * case the caller has to go on reading. notify_off never moves backwards
+ * so that a reader with a stale view cannot cancel the request of another
+ * one, and the cmpxchg orders it before the re-check.
+ */
+static int ihk_ikc_queue_arm(struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_ikc_queue_head *q = c->recv.queue;
+	uint64_t *notify_off;
+	uint64_t next, cur, m;
+
+	if (!(q->flag & IKC_QUEUE_FLAG_EVENT_IDX)) {
+		return 0;
+	}
+
+	notify_off = &((struct ihk_ikc_queue_head_v2 *)q)->notify_off;
+	next = c->recv.lease_map ? c->recv.lease_off : IHK_IKC_Q(q, read_off);
+
+	do {
+		cur = *notify_off;
+		if ((int64_t)(next - cur) < 0) {
+			next = cur;
+		}
+	} while (cmpxchg(notify_off, cur, next) != cur);
+
+	m = IHK_IKC_Q(q, max_read_off);
+	return c->recv.lease_map ? c->recv.lease_off != m :
+		IHK_IKC_Q(q, read_off) != m;
+}
+
 int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 {
 	int r;
@@ -471,7 +1513,24 @@ int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 #else
 	local_irq_save(flags);
 #endif
-	if (ihk_ikc_channel_enabled(channel)) {
+retry:
+	if (ihk_ikc_channel_enabled(channel) && channel->recv.lease_map) {
+		void *slot;
+
+		r = -1;
+		if (ihk_ikc_read_queue_lease(channel, &slot, 1)) {
+			/* p has to hold the longest record the peer sends */
+			memcpy(p, slot, ihk_ikc_packet_length(channel, slot));
+			ihk_ikc_release_lease(channel, slot);
+			r = 0;
+		} else if (ihk_ikc_queue_arm(channel)) {
+			goto retry;
+		}
+
+		if (!(opt & IKC_NO_NOTIFY)) {
+			ihk_ikc_notify_remote_read(channel);
+		}
+	} else if (ihk_ikc_channel_enabled(channel)) {
 		r = ihk_ikc_read_queue(channel->recv.queue, p, opt);
 
 		/* We set channel here instead of setting it on
@@ -481,9 +1540,13 @@ int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 		 */
 		if (!r) {
 			((struct ihk_ikc_packet_header *)p)->channel = channel;
+			ihk_ikc_note_received(channel, 1,
+			                      channel->recv.queue->pktsize);
+		} else if (r == -1 && ihk_ikc_queue_arm(channel)) {
+			goto retry;
 		}
 
-		/* XXX: Optimal interrupt */
+		/* Suppressed on event index queues */
 		if (!(opt & IKC_NO_NOTIFY)) {
 			ihk_ikc_notify_remote_read(channel);
 		}
@@ -499,43 +1562,49 @@ int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 	return r;
 }
 
-#if 0
 static int __ihk_ikc_recv_nocopy(struct ihk_ikc_channel_desc *channel,
                                  ihk_ikc_ph_t h, void *harg, int opt)
 {
-	unsigned long flags;
-	int r;
+	int n = 0;
 
-	flags = ihk_ikc_spinlock_lock(&channel->recv.lock);
-	if (ihk_ikc_channel_enabled(channel) &&
-	    !ihk_ikc_queue_is_empty(channel->recv.queue)) {
-		while (ihk_ikc_read_queue_handler(channel->recv.queue,
-		                                  channel,
-		                                  h, harg, opt) == 0);
-		/* XXX: Optimal interrupt */
-		ihk_ikc_notify_remote_read(channel);
+	do {
+		while (ihk_ikc_channel_enabled(channel) &&
+		       ihk_ikc_read_queue_handler(channel->recv.queue,
+		                                  channel, h, harg, opt) == 0) {
+			++n;
+		}
+	} while (ihk_ikc_channel_enabled(channel) &&
+	         ihk_ikc_queue_arm(channel));
 
-		r = 0;
-	} else {
-		r = -EINVAL;
+	if (n && !(opt & IKC_NO_NOTIFY)) {
+		ihk_ikc_notify_remote_read(channel);
 	}
-	ihk_ikc_spinlock_unlock(&channel->recv.lock, flags);
 
-	return r;
+	return n;
 }
-#endif
 
 int ihk_ikc_recv_handler(struct ihk_ikc_channel_desc *channel, 
 		ihk_ikc_ph_t h, void *harg, int opt)
 {
 	char *p = NULL;
 	int r = -ENOENT;
+	uint64_t start;
+	int n;
 
 	if (!channel) {
 		kprintf("%s: ERROR: channel doesn't exist\n", __FUNCTION__);
 		return -EINVAL;
 	}
 
+	if (channel->recv.lease_map) {
+		start = ihk_ikc_tp_start(ihk_ikc_recv_handler);
+		n = __ihk_ikc_recv_nocopy(channel, h, harg, opt);
+		ihk_ikc_tp(ihk_ikc_recv_handler, channel->channel_id,
+		           channel->remote_channel_id, n,
+		           channel->recv.queue->pktsize, ihk_ikc_tp_ns(start));
+		return n ? 0 : -ENOENT;
+	}
+
 	/* Get free packet from channel pool */
 	p = (char *)ihk_ikc_alloc_packet(channel);
 
@@ -557,22 +1626,194 @@ int ihk_ikc_recv_handler(struct ihk_ikc_channel_desc *channel,
 	 *
 	 * (syscall_packet_handler() is the function called for syscalls)
 	 */
+	start = ihk_ikc_tp_start(ihk_ikc_recv_handler);
 	h(channel, p, harg);
-
-	if (channel->flag & IKC_FLAG_NO_COPY) {
+	ihk_ikc_tp(ihk_ikc_recv_handler, channel->channel_id,
+	           channel->remote_channel_id, 1,
+	           channel->recv.queue->pktsize, ihk_ikc_tp_ns(start));
+	ihk_ikc_trace(IHK_IKC_TRACE_HANDLED, channel->recv.queue,
+	              IHK_IKC_Q(channel->recv.queue, read_off), NULL);
+
+	if ((channel->flag & IKC_FLAG_NO_COPY) ||
+	    (channel->recv.queue->flag & IKC_QUEUE_FLAG_EVENT_IDX)) {
 		ihk_ikc_notify_remote_read(channel);
 	}
 out:
 	return r;
 }
 
+/*
+ * Drain the channel: claim everything between read_off and max_read_off
+ * (up to IHK_IKC_RECV_BATCH_MAX at a time) with one cmpxchg, pass the
+ * packets as a vector to the batch handler of the channel if there is one,
+ * or one by one to h otherwise, and notify the remote at most once.
+ * With IKC_POLL the caller comes back without being interrupted, so the
+ * queue is not armed. Returns the number of packets handled.
+ */
+int ihk_ikc_recv_batch(struct ihk_ikc_channel_desc *channel,
+                       ihk_ikc_ph_t h, void *harg, int opt)
+{
+	void *packets[IHK_IKC_RECV_BATCH_MAX];
+	struct ihk_ikc_queue_head *q;
+	uint64_t avail, start;
+	int n, got, i;
+	int total = 0;
+
+	if (!channel) {
+		kprintf("%s: ERROR: channel doesn't exist\n", __FUNCTION__);
+		return -EINVAL;
+	}
+
+	q = channel->recv.queue;
+
+again:
+	/* Zero-copy: hand out in-ring leases instead of pool packets */
+	while (channel->recv.lease_map && ihk_ikc_channel_enabled(channel)) {
+		got = ihk_ikc_read_queue_lease(channel, packets,
+		                               IHK_IKC_RECV_BATCH_MAX);
+		if (!got) {
+			break;
+		}
+
+		start = ihk_ikc_tp_start(ihk_ikc_recv_handler);
+		if (channel->batch_handler) {
+			channel->batch_handler(channel, packets, got, harg);
+		} else {
+			for (i = 0; i < got; ++i) {
+				h(channel, packets[i], harg);
+			}
+		}
+		ihk_ikc_tp(ihk_ikc_recv_handler, channel->channel_id,
+		           channel->remote_channel_id, got, q->pktsize,
+		           ihk_ikc_tp_ns(start));
+		ihk_ikc_trace(IHK_IKC_TRACE_HANDLED, q,
+		              channel->recv.lease_off, NULL);
+
+		total += got;
+	}
+
+	while (!channel->recv.lease_map && ihk_ikc_channel_enabled(channel)) {
+		avail = IHK_IKC_Q(q, max_read_off) - IHK_IKC_Q(q, read_off);
+		if (!avail) {
+			break;
+		}
+
+		ihk_ikc_note_occupancy(channel, avail);
+		n = avail > IHK_IKC_RECV_BATCH_MAX ?
+			IHK_IKC_RECV_BATCH_MAX : avail;
+		for (i = 0; i < n; ++i) {
+			packets[i] = ihk_ikc_alloc_packet(channel);
+			if (!packets[i]) {
+				break;
+			}
+		}
+		n = i;
+
+		if (!n) {
+			kprintf("%s: error allocating packet\n", __FUNCTION__);
+			break;
+		}
+
+		got = ihk_ikc_read_queue_batch(q, packets, n, opt);
+		if (got < 0) {
+			got = 0;
+		}
+
+		for (i = got; i < n; ++i) {
+			ihk_ikc_release_packet(
+				(struct ihk_ikc_free_packet *)packets[i]);
+		}
+
+		for (i = 0; i < got; ++i) {
+			((struct ihk_ikc_packet_header *)packets[i])->channel =
+				channel;
+		}
+		ihk_ikc_note_received(channel, got, (uint64_t)got * q->pktsize);
+
+		/*
+		 * XXX: Handler must release the packets eventually using
+		 * ihk_ikc_release_packet().
+		 */
+		start = ihk_ikc_tp_start(ihk_ikc_recv_handler);
+		if (channel->batch_handler) {
+			channel->batch_handler(channel, packets, got, harg);
+		} else {
+			for (i = 0; i < got; ++i) {
+				h(channel, packets[i], harg);
+			}
+		}
+		ihk_ikc_tp(ihk_ikc_recv_handler, channel->channel_id,
+		           channel->remote_channel_id, got, q->pktsize,
+		           ihk_ikc_tp_ns(start));
+		ihk_ikc_trace(IHK_IKC_TRACE_HANDLED, q,
+		              IHK_IKC_Q(q, read_off), NULL);
+
+		total += got;
+	}
+
+	if (!(opt & IKC_POLL) && ihk_ikc_channel_enabled(channel) &&
+	    ihk_ikc_queue_arm(channel)) {
+		goto again;
+	}
+
+	if (total && ((channel->flag & IKC_FLAG_NO_COPY) ||
+	              (q->flag & IKC_QUEUE_FLAG_EVENT_IDX)) &&
+	    !(opt & IKC_NO_NOTIFY)) {
+		ihk_ikc_notify_remote_read(channel);
+	}
+
+	return total;
+}
+
+/*
+ * Peers that set up event index queues only need to be told about reads
+ * if a writer waits for room, see ihk_ikc_queue_want_room(). With leases
+ * room is made by ihk_ikc_release_lease(), which takes care of that.
+ */
 void ihk_ikc_notify_remote_read(struct ihk_ikc_channel_desc *c)
 {
-	ihk_ikc_send_interrupt(c);
+	struct ihk_ikc_queue_head *q = c->recv.queue;
+
+	if ((q->flag & IKC_QUEUE_FLAG_EVENT_IDX) &&
+	    (c->recv.lease_map || !ihk_ikc_queue_room_wanted(q))) {
+		return;
+	}
+
+	ihk_ikc_kick_remote(c);
 }
+
+/*
+ * On event index queues interrupt the reader only if a packet was
+ * published at the offset it asked for since the last check, i.e.
+ * notify_off is in [event_off, max_read_off), as virtio's vring_need_event.
+ * Concurrent senders may check overlapping ranges, which can only cause
+ * a spurious interrupt, never a lost one.
+ */
 void ihk_ikc_notify_remote_write(struct ihk_ikc_channel_desc *c)
 {
-	ihk_ikc_send_interrupt(c);
+	struct ihk_ikc_queue_head *q = c->send.queue;
+	uint64_t old, new, event;
+
+	if (q->flag & IKC_QUEUE_FLAG_EVENT_IDX) {
+		old = c->send.event_off;
+		new = IHK_IKC_Q(q, max_read_off);
+		/*
+		 * Order the publish of the packet against the load of
+		 * notify_off, pairs with the cmpxchg in ihk_ikc_queue_arm().
+		 * A release store to max_read_off (SPSC) is not enough.
+		 */
+		ihk_ikc_mb();
+		event = ((struct ihk_ikc_queue_head_v2 *)q)->notify_off;
+		c->send.event_off = new;
+
+		if (new - event - 1 >= new - old) {
+			return;
+		}
+	}
+
+	ihk_ikc_trace(IHK_IKC_TRACE_NOTIFY, q, IHK_IKC_Q(q, max_read_off),
+	              NULL);
+	ihk_ikc_kick_remote(c);
 }
 
 void __ihk_ikc_enable_channel(struct ihk_ikc_channel_desc *channel)
@@ -606,13 +1847,28 @@ void ihk_ikc_disable_channel(struct ihk_ikc_channel_desc *channel)
 	ihk_ikc_spinlock_unlock(&channel->recv.lock, flags);
 }
 
+/*
+ * Constant time and lock-free, see ihk_ikc_lookup_channel(). As before
+ * the caller has to make sure that the channel is not freed under it.
+ */
+/*
+ * Channels that could not be entered into the lookup table, see
+ * ihk_ikc_init_desc(), are still found on the channel list
+ */
 struct ihk_ikc_channel_desc *ihk_ikc_find_channel(ihk_os_t os, int id)
 {
-	ihk_spinlock_t *lock = ihk_ikc_get_channel_list_lock(os);
-	struct list_head *channels = ihk_ikc_get_channel_list(os);
+	ihk_spinlock_t *lock;
+	struct list_head *channels;
 	struct ihk_ikc_channel_desc *c;
 	unsigned long flags;
 
+	c = ihk_ikc_lookup_channel(os, id);
+	if (c) {
+		return c;
+	}
+
+	lock = ihk_ikc_get_channel_list_lock(os);
+	channels = ihk_ikc_get_channel_list(os);
 	flags = ihk_ikc_spinlock_lock(lock);
 	list_for_each_entry(c, channels, list_all) {
 		if (c->channel_id == id) {
@@ -625,12 +1881,18 @@ struct ihk_ikc_channel_desc *ihk_ikc_find_channel(ihk_os_t os, int id)
 	return NULL;
 }
 
+IHK_EXPORT_SYMBOL(ihk_ikc_send_reserve);
+IHK_EXPORT_SYMBOL(ihk_ikc_send_commit);
 IHK_EXPORT_SYMBOL(ihk_ikc_recv);
 IHK_EXPORT_SYMBOL(ihk_ikc_recv_handler);
+IHK_EXPORT_SYMBOL(ihk_ikc_recv_batch);
 IHK_EXPORT_SYMBOL(ihk_ikc_enable_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_disable_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_free_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_find_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_channel_set_cpu);
 IHK_EXPORT_SYMBOL(ihk_ikc_release_packet);
+IHK_EXPORT_SYMBOL(ihk_ikc_release_lease);
+IHK_EXPORT_SYMBOL(ihk_ikc_channel_set_nocopy);
+IHK_EXPORT_SYMBOL(ihk_ikc_channel_stats_reset);
 
@@ -41,6 +41,9 @@
 #include "ops_wrappers.h"
 #include <config.h>
 
+#define CREATE_TRACE_POINTS
+#include <ihk_trace.h>
+
 //#define DEBUG_IKC
 
 #ifdef DEBUG_IKC
@@ -79,6 +82,15 @@ static spinlock_t ihk_kmsg_bufs_lock;
 
 extern int ihk_ikc_master_init(ihk_os_t os);
 extern void ikc_master_finalize(ihk_os_t os);
+extern int ihk_ikc_set_poll(ihk_os_t os, unsigned long usec);
+extern int ihk_ikc_set_trace(ihk_os_t os, unsigned long entries,
+                             int nr_lwk_cpus);
+extern int ihk_ikc_get_trace(ihk_os_t os, unsigned long arg);
+extern void ihk_ikc_trace_release(ihk_os_t os);
+extern int ihk_os_ikc_sysfs_init(ihk_os_t os);
+extern void ihk_os_ikc_sysfs_exit(ihk_os_t os);
+extern void ihk_pagealloc_debugfs_init(void);
+extern void ihk_pagealloc_debugfs_exit(void);
 
 struct ihk_event {
 	struct list_head list;
@@ -282,6 +294,7 @@ static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 	int found = 0;
 	struct ihk_kmsg_buf_container *cont;
 	unsigned long flags;
+	u64 start = ihk_trace_clock();
 
 	/* Get the latest kmsg_buf */
 	spin_lock_irqsave(&ihk_kmsg_bufs_lock, flags);
@@ -325,6 +338,7 @@ static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 	}
 
 	up(&ihk_os_notifiers_lock);
+	trace_ihk_os_boot(index, flag, ret, ihk_trace_ns(start));
 	return ret;
 }
 
@@ -363,6 +377,7 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 	int ret = -EINVAL;
 	struct ihk_os_notifier *_ion;
 	int index = ihk_host_os_get_index(data);
+	u64 start = ihk_trace_clock();
 
 	/* Call OS notifiers */
 	if (down_interruptible(&ihk_os_notifiers_lock)) {
@@ -393,6 +408,7 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 	}
 
 	printk("IHK: OS shutdown OK\n"); 
+	trace_ihk_os_shutdown(index, flag, ret, ihk_trace_ns(start));
 
 	return ret;
 }
@@ -1012,6 +1028,7 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 	int ret = -EINVAL;
 	struct ihk_host_linux_os_data *data;
 	struct ihk_file *ifile;
+	u64 start;
 	
 	ifile = file->private_data;
 	data = ifile->osdata;
@@ -1055,11 +1072,17 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		break;
 
 	case IHK_OS_ASSIGN_CPU:
+		start = ihk_trace_clock();
 		ret = __ihk_os_assign_cpu(data, arg);
+		trace_ihk_os_assign_cpu(ihk_host_os_get_index(data), ret,
+			ihk_trace_ns(start));
 		break;
 
 	case IHK_OS_RELEASE_CPU:
+		start = ihk_trace_clock();
 		ret = __ihk_os_release_cpu(data, arg);
+		trace_ihk_os_release_cpu(ihk_host_os_get_index(data), ret,
+			ihk_trace_ns(start));
 		break;
 
 	case IHK_OS_SET_IKC_MAP:
@@ -1078,16 +1101,34 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_os_get_num_cpus(data);
 		break;
 
+	case IHK_OS_SET_IKC_POLL:
+		ret = ihk_ikc_set_poll(data, arg);
+		break;
+
+	case IHK_OS_SET_IKC_TRACE:
+		ret = ihk_ikc_set_trace(data, arg, __ihk_os_get_num_cpus(data));
+		break;
+
+	case IHK_OS_GET_IKC_TRACE:
+		ret = ihk_ikc_get_trace(data, arg);
+		break;
+
 	case IHK_OS_QUERY_CPU:
 		ret = __ihk_os_query_cpu(data, arg);
 		break;
 
 	case IHK_OS_ASSIGN_MEM:
+		start = ihk_trace_clock();
 		ret = __ihk_os_assign_mem(data, arg);
+		trace_ihk_os_assign_mem(ihk_host_os_get_index(data), ret,
+			ihk_trace_ns(start));
 		break;
 
 	case IHK_OS_RELEASE_MEM:
+		start = ihk_trace_clock();
 		ret = __ihk_os_release_mem(data, arg);
+		trace_ihk_os_release_mem(ihk_host_os_get_index(data), ret,
+			ihk_trace_ns(start));
 		break;
 
 	case IHK_OS_QUERY_MEM:
@@ -1378,6 +1419,7 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 	struct ihk_host_linux_os_data *os = NULL;
 	struct ihk_register_os_data drv_data;
 	int ret = 0;
+	int i;
 
 	os = kzalloc(sizeof(*os), GFP_KERNEL);
 	if (!os) {
@@ -1392,9 +1434,11 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 	memset(&drv_data, 0, sizeof(drv_data));
 
 	spin_lock_init(&os->listener_lock);
-	spin_lock_init(&os->wait_lock);
 	spin_lock_init(&os->event_list_lock);
+	spin_lock_init(&os->ikc_channel_lock);
 	INIT_LIST_HEAD(&os->ikc_channels);
+	INIT_RADIX_TREE(&os->ikc_channel_tree, GFP_ATOMIC);
+	init_waitqueue_head(&os->ikc_send_wait);
 
 	os->regular_channels = kzalloc(sizeof(*os->regular_channels) *
 			num_possible_cpus(), GFP_KERNEL);
@@ -1404,7 +1448,10 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 		goto ERR;
 	}
 
-	INIT_LIST_HEAD(&os->wait_list);
+	for (i = 0; i < IHK_IKC_MASTER_WAIT_HASH_SIZE; i++) {
+		spin_lock_init(&os->wait_buckets[i].lock);
+		INIT_LIST_HEAD(&os->wait_buckets[i].list);
+	}
 	INIT_LIST_HEAD(&os->aux_call_list);
 	INIT_LIST_HEAD(&os->event_list);
 
@@ -1557,7 +1604,7 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 	 */
 	os_data[minor] = os;
 
-	os->lindev = device_create(mcos_class, NULL, os->dev_num, NULL,
+	os->lindev = device_create(mcos_class, NULL, os->dev_num, os,
 			OS_DEV_NAME "%d", minor);
 	if (IS_ERR(os->lindev)) {
 		printk("ihk: device_create failed.\n");
@@ -1565,6 +1612,11 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 		goto error;
 	}
 
+	/* Statistics only, the OS is usable without them */
+	if (ihk_os_ikc_sysfs_init(os)) {
+		printk("ihk: creating the ikc sysfs directory failed.\n");
+	}
+
 	return minor;
 
 error:
@@ -1610,8 +1662,10 @@ static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 	}
 
 	os_data[os->minor] = NULL;
+	ihk_ikc_trace_release(os);
 
 	cdev_del(&os->cdev);
+	ihk_os_ikc_sysfs_exit(os);
 	device_destroy(mcos_class, os->dev_num);
 
 	if (os->regular_channels)
@@ -1661,40 +1715,64 @@ static int __destroy_all_os(struct ihk_host_linux_device_data *data)
 static int __ihk_device_reserve_cpu(struct ihk_host_linux_device_data *data,
 		unsigned long arg)
 {
+	u64 start = ihk_trace_clock();
+	int ret;
+
 	if (!data->ops || !data->ops->reserve_cpu)
 		return -1;
 
-	return data->ops->reserve_cpu(data, arg);
+	ret = data->ops->reserve_cpu(data, arg);
+	trace_ihk_reserve_cpu(data->minor, ret, ihk_trace_ns(start));
+
+	return ret;
 }
 
 /** \brief Release CPU cores */
 static int __ihk_device_release_cpu(struct ihk_host_linux_device_data *data,
 		unsigned long arg)
 {
+	u64 start = ihk_trace_clock();
+	int ret;
+
 	if (!data->ops || !data->ops->release_cpu)
 		return -1;
 
-	return data->ops->release_cpu(data, arg);
+	ret = data->ops->release_cpu(data, arg);
+	trace_ihk_release_cpu(data->minor, ret, ihk_trace_ns(start));
+
+	return ret;
 }
 
 /** \brief Reserve memory */
 static int __ihk_device_reserve_mem(struct ihk_host_linux_device_data *data,
 		unsigned long arg)
 {
+	u64 start = ihk_trace_clock();
+	int ret;
+
 	if (!data->ops || !data->ops->reserve_mem)
 		return -1;
 
-	return data->ops->reserve_mem(data, arg);
+	ret = data->ops->reserve_mem(data, arg);
+	trace_ihk_reserve_mem(data->minor, ret, ihk_trace_ns(start));
+
+	return ret;
 }
 
 /** \brief Release memory */
 static int __ihk_device_release_mem(struct ihk_host_linux_device_data *data,
 		unsigned long arg)
 {
+	u64 start = ihk_trace_clock();
+	int ret;
+
 	if (!data->ops || !data->ops->release_mem)
 		return -1;
 
-	return data->ops->release_mem(data, arg);
+	ret = data->ops->release_mem(data, arg);
+	trace_ihk_release_mem(data->minor, ret, ihk_trace_ns(start));
+
+	return ret;
 }
 
 /** \brief Release memory */
@@ -2015,6 +2093,8 @@ static int __init ihk_host_driver_init(void)
 	INIT_LIST_HEAD(&ihk_kmsg_bufs);
 	spin_lock_init(&ihk_kmsg_bufs_lock);
 
+	ihk_pagealloc_debugfs_init();
+
 	printk("IHK Initialized: Device number: Device %x, OS %x\n",
 	       mcd_dev_num, mcos_dev_num);
 
@@ -2060,6 +2140,8 @@ static void __exit ihk_exit(void)
 		}
 	}
 
+	ihk_pagealloc_debugfs_exit();
+
 	if (mcos_class)
 		class_destroy(mcos_class);
 	if (mcos_dev_num)
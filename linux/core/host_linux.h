@@ -11,6 +11,7 @@
 #define __HEADER_IHK_HOST_LINUX_H
 
 #include <linux/cdev.h>
+#include <linux/radix-tree.h>
 #include <ikc/master.h>
 #include <ihk/ihk_debug.h>
 
@@ -89,11 +90,20 @@ struct ihk_host_linux_os_data {
 	spinlock_t ikc_channel_lock;
 	/** \brief List of the channels available */
 	struct list_head ikc_channels;
+	/** \brief Channels by ID, updated under ikc_channel_lock, read
+	 *  under RCU */
+	struct radix_tree_root ikc_channel_tree;
+	/** \brief /sys/class/mcos/mcosN/ikc/ */
+	struct kobject *ikc_kobj;
 
 	/** \brief Interrupt handler */
 	struct ihk_host_interrupt_handler ikc_handler;
 	/** \brief Worker thread for the IKC interrupt handler */
 	void (*work_function)(struct work_struct *work);
+	/** \brief Busy-poll threads of the IKC, NULL if disabled */
+	struct ihk_ikc_poll *ikc_poll;
+	/** \brief Senders waiting for room in a full IKC queue */
+	wait_queue_head_t ikc_send_wait;
 
 	/** \brief IKC master channel between the host and this kernel */
 	struct ihk_ikc_channel_desc *mchannel;
@@ -108,10 +118,9 @@ struct ihk_host_linux_os_data {
 	/** \brief Last channel ID */
 	atomic_t channel_id;
 
-	/** \brief Lock for wait_list */
-	spinlock_t wait_lock;
-	/** \brief Wait list used in the IKC functions */
-	struct list_head wait_list;
+	/** \brief Master reply waiters, hashed by (msg, ref) */
+	struct ihk_ikc_master_wait_bucket
+		wait_buckets[IHK_IKC_MASTER_WAIT_HASH_SIZE];
 
 	/** \brief List of the additional ioctl handlers */
 	struct list_head aux_call_list;
@@ -0,0 +1,236 @@
+/**
+ * \file ihk_trace.h
+ * \brief IHK-Host: Tracepoints of IHK and IKC
+ *
+ * The events are created in host_driver.c. Durations are in ns, hot
+ * paths only take the time while the event is enabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ihk
+
+#if !defined(_IHK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IHK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+
+#ifndef _IHK_TRACE_CLOCK
+#define _IHK_TRACE_CLOCK
+#define ihk_trace_clock()        ktime_to_ns(ktime_get())
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+#define ihk_trace_start(name) \
+	(trace_##name##_enabled() ? ihk_trace_clock() : 0)
+#else
+#define ihk_trace_start(name)    ihk_trace_clock()
+#endif
+#define ihk_trace_ns(start)      ((start) ? ihk_trace_clock() - (start) : 0)
+#endif
+
+TRACE_EVENT(ihk_ikc_send,
+	TP_PROTO(int channel_id, int remote_id, int len, int ret, u64 ns),
+	TP_ARGS(channel_id, remote_id, len, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, channel_id)
+		__field(int, remote_id)
+		__field(int, len)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->channel_id = channel_id;
+		__entry->remote_id = remote_id;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("channel=%d remote=%d len=%d ret=%d ns=%llu",
+	          __entry->channel_id, __entry->remote_id, __entry->len,
+	          __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(ihk_ikc_send_batch,
+	TP_PROTO(int channel_id, int remote_id, int n, int ret, u64 ns),
+	TP_ARGS(channel_id, remote_id, n, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, channel_id)
+		__field(int, remote_id)
+		__field(int, n)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->channel_id = channel_id;
+		__entry->remote_id = remote_id;
+		__entry->n = n;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("channel=%d remote=%d n=%d ret=%d ns=%llu",
+	          __entry->channel_id, __entry->remote_id, __entry->n,
+	          __entry->ret, __entry->ns)
+);
+
+/* ns is the time spent in the handler */
+TRACE_EVENT(ihk_ikc_recv_handler,
+	TP_PROTO(int channel_id, int remote_id, int count, int pktsize,
+	         u64 ns),
+	TP_ARGS(channel_id, remote_id, count, pktsize, ns),
+	TP_STRUCT__entry(
+		__field(int, channel_id)
+		__field(int, remote_id)
+		__field(int, count)
+		__field(int, pktsize)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->channel_id = channel_id;
+		__entry->remote_id = remote_id;
+		__entry->count = count;
+		__entry->pktsize = pktsize;
+		__entry->ns = ns;
+	),
+	TP_printk("channel=%d remote=%d count=%d pktsize=%d ns=%llu",
+	          __entry->channel_id, __entry->remote_id, __entry->count,
+	          __entry->pktsize, __entry->ns)
+);
+
+TRACE_EVENT(ihk_ikc_interrupt,
+	TP_PROTO(int cpu, int handled, u64 ns),
+	TP_ARGS(cpu, handled, ns),
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(int, handled)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->handled = handled;
+		__entry->ns = ns;
+	),
+	TP_printk("cpu=%d handled=%d ns=%llu",
+	          __entry->cpu, __entry->handled, __entry->ns)
+);
+
+TRACE_EVENT(ihk_ikc_connect,
+	TP_PROTO(int port, int pkt_size, int queue_size, int channel_id,
+	         int remote_id, int ret, u64 ns),
+	TP_ARGS(port, pkt_size, queue_size, channel_id, remote_id, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, port)
+		__field(int, pkt_size)
+		__field(int, queue_size)
+		__field(int, channel_id)
+		__field(int, remote_id)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->pkt_size = pkt_size;
+		__entry->queue_size = queue_size;
+		__entry->channel_id = channel_id;
+		__entry->remote_id = remote_id;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("port=%d pkt_size=%d queue_size=%d channel=%d remote=%d "
+	          "ret=%d ns=%llu",
+	          __entry->port, __entry->pkt_size, __entry->queue_size,
+	          __entry->channel_id, __entry->remote_id, __entry->ret,
+	          __entry->ns)
+);
+
+TRACE_EVENT(ihk_ikc_disconnect,
+	TP_PROTO(int channel_id, int remote_id, int ret, u64 ns),
+	TP_ARGS(channel_id, remote_id, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, channel_id)
+		__field(int, remote_id)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->channel_id = channel_id;
+		__entry->remote_id = remote_id;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("channel=%d remote=%d ret=%d ns=%llu",
+	          __entry->channel_id, __entry->remote_id, __entry->ret,
+	          __entry->ns)
+);
+
+DECLARE_EVENT_CLASS(ihk_os_state,
+	TP_PROTO(int index, int flag, int ret, u64 ns),
+	TP_ARGS(index, flag, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, flag)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->flag = flag;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("os=%d flag=0x%x ret=%d ns=%llu",
+	          __entry->index, __entry->flag, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(ihk_os_state, ihk_os_boot,
+	TP_PROTO(int index, int flag, int ret, u64 ns),
+	TP_ARGS(index, flag, ret, ns)
+);
+
+DEFINE_EVENT(ihk_os_state, ihk_os_shutdown,
+	TP_PROTO(int index, int flag, int ret, u64 ns),
+	TP_ARGS(index, flag, ret, ns)
+);
+
+/*
+ * Reservation (device) and assignment (OS) of CPUs and memory, index is
+ * that of the device or the OS. What was asked for is traced by the
+ * driver, see ihk_smp_* of the SMP driver.
+ */
+DECLARE_EVENT_CLASS(ihk_resource,
+	TP_PROTO(int index, int ret, u64 ns),
+	TP_ARGS(index, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("index=%d ret=%d ns=%llu",
+	          __entry->index, __entry->ret, __entry->ns)
+);
+
+#define IHK_TRACE_RESOURCE_EVENT(name) \
+	DEFINE_EVENT(ihk_resource, name, \
+		TP_PROTO(int index, int ret, u64 ns), \
+		TP_ARGS(index, ret, ns))
+
+IHK_TRACE_RESOURCE_EVENT(ihk_reserve_cpu);
+IHK_TRACE_RESOURCE_EVENT(ihk_release_cpu);
+IHK_TRACE_RESOURCE_EVENT(ihk_reserve_mem);
+IHK_TRACE_RESOURCE_EVENT(ihk_release_mem);
+IHK_TRACE_RESOURCE_EVENT(ihk_os_assign_cpu);
+IHK_TRACE_RESOURCE_EVENT(ihk_os_release_cpu);
+IHK_TRACE_RESOURCE_EVENT(ihk_os_assign_mem);
+IHK_TRACE_RESOURCE_EVENT(ihk_os_release_mem);
+
+#endif /* _IHK_TRACE_H */
+
+/* Out of tree, look for this file in the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ihk_trace
+#include <trace/define_trace.h>
@@ -1,7 +1,7 @@
 /** 
  * \file mem_alloc.c
  * 
- * \brief IHK-Host: Generic page allocator (not so fast)
+ * \brief IHK-Host: Generic page allocator
  *
  * \author Taku Shimosawa  <shimosawa@is.s.u-tokyo.ac.jp> \par
  * Copyright (C) 2011 - 2012  Taku Shimosawa
@@ -11,19 +11,50 @@
 #include <linux/module.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/bitops.h>
 
 #include <ihk/ihk_host_driver.h>
 
-/** \brief Descriptor of an allocator */
+/** \brief Size classes of the per-CPU caches: 1, 2, 4 and 8 blocks */
+#define IHK_PAGEALLOC_PCP_CLASSES    4
+/** \brief Areas a per-CPU cache holds per class */
+#define IHK_PAGEALLOC_PCP_MAX        32
+/** \brief Areas moved between a cache and the map at once */
+#define IHK_PAGEALLOC_PCP_BATCH      8
+
+/** \brief Per-CPU cache of small areas
+ *
+ * Cached areas are allocated in the map. The lock is only contended when
+ * another CPU drains the cache, because the map ran out.
+ */
+struct ihk_pagealloc_pcp {
+	spinlock_t lock;
+	unsigned int nr[IHK_PAGEALLOC_PCP_CLASSES];
+	unsigned long areas[IHK_PAGEALLOC_PCP_CLASSES][IHK_PAGEALLOC_PCP_MAX];
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/** \brief Descriptor of an allocator
+ *
+ * Blocks are tracked in map, a set bit is an allocated block. The summary
+ * has a bit per word of map that is set while the word is full, so that
+ * a search for free blocks skips 64 full words with one __ffs().
+ * Allocations of 1, 2, 4 and 8 blocks are served by per-CPU caches
+ * first, which are refilled from and drained to the map in batches.
+ */
 struct ihk_page_allocator_desc {
 	/** \brief Start address of the area that the allocator manages */
 	unsigned long start;
 	/** \brief End address of the area that the allocator manages */
 	unsigned long end;
-	/** \brief Last index in block */
-	unsigned int last;
-	/** \brief Number of blocks */
+	/** \brief Number of blocks, including the padding of the last word */
+	unsigned int nbits;
+	/** \brief Number of words of map */
 	unsigned int count;
 	/** \brief Order of the pages that are allocated for this structure */
 	unsigned int flag;
@@ -33,6 +64,16 @@ struct ihk_page_allocator_desc {
 	spinlock_t lock;
 	/** \brief List chain for multiple allocators */
 	struct list_head list;
+	/** \brief Full words of map, follows map */
+	unsigned long *summary;
+	/** \brief Per-CPU caches, NULL if they could not be allocated */
+	struct ihk_pagealloc_pcp __percpu *pcp;
+	/** \brief Batches taken from the map by the caches */
+	unsigned long refills;
+	/** \brief Batches given back to the map by the caches */
+	unsigned long drains;
+	/** \brief Statistics file in debugfs */
+	struct dentry *debugfs;
 	/** \brief Allocation map */
 	unsigned long map[0];
 };
@@ -41,9 +82,14 @@ struct ihk_page_allocator_desc {
 #define MAP_INDEX(n)    ((n) >> 6)
 /** Get the bit number in a map element */
 #define MAP_BIT(n)      ((n) & 0x3f)
-/** Calculate an address from the map index and map bit index */
-#define ADDRESS(desc, index, bit)    \
-	((desc)->start + (((index) * 64 + (bit)) << ((desc)->shift)))
+/** Calculate an address from a block number */
+#define ADDRESS(desc, n) \
+	((desc)->start + ((unsigned long)(n) << (desc)->shift))
+
+/** \brief Directory of the statistics files, one per allocator */
+static struct dentry *ihk_pagealloc_debugfs_dir;
+
+static void __ihk_pagealloc_debugfs_add(struct ihk_page_allocator_desc *desc);
 
 /**
  * \brief Initialize a page allocator.
@@ -63,6 +109,7 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 	/* Unit must be power of 2, and size and start must be unit-aligned */
 	struct ihk_page_allocator_desc *desc;
 	int i, page_shift, descsize, descorder, mapsize, mapaligned;
+	int summarysize;
 	int flag = 0;
 
 	if (!unit) {
@@ -73,7 +120,8 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 	/* round up to 64-bit */
 	mapsize = (size >> page_shift);
 	mapaligned = ((mapsize + 63) >> 6) << 3;
-	descsize = sizeof(*desc) + mapaligned;
+	summarysize = ((mapaligned / 8 + 63) >> 6) << 3;
+	descsize = sizeof(*desc) + mapaligned + summarysize;
 
 	printk("mapsize = %d, aligned = %d, descsize = %d, shift = %d\n",
 	       mapsize, mapaligned, descsize, page_shift);
@@ -99,16 +147,30 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 	}
 
 	desc->start = start;
-	desc->last = 0;
+	desc->end = start + size;
+	desc->nbits = mapaligned * 8;
 	desc->count = mapaligned >> 3;
 	desc->shift = page_shift;
 	desc->flag = flag;
+	desc->summary = desc->map + desc->count;
 	spin_lock_init(&desc->lock);
 
 	/* Reserve align padding area */
-	for (i = mapsize; i < mapaligned * 8; i++) {
-		desc->map[MAP_INDEX(i)] |= (1 << MAP_BIT(i));
+	for (i = mapsize; i < desc->nbits; i++) {
+		desc->map[MAP_INDEX(i)] |= (1UL << MAP_BIT(i));
+	}
+	if (desc->count && desc->map[desc->count - 1] == ~0UL) {
+		__set_bit(desc->count - 1, desc->summary);
+	}
+
+	/* Without caches every request goes to the map */
+	desc->pcp = alloc_percpu(struct ihk_pagealloc_pcp);
+	if (desc->pcp) {
+		for_each_possible_cpu(i) {
+			spin_lock_init(&per_cpu_ptr(desc->pcp, i)->lock);
+		}
 	}
+	__ihk_pagealloc_debugfs_add(desc);
 
 	return desc;
 }
@@ -117,6 +179,11 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 void ihk_pagealloc_destroy(void *__desc)
 {
 	struct ihk_page_allocator_desc *desc = __desc;
+
+	debugfs_remove(desc->debugfs);
+	if (desc->pcp) {
+		free_percpu(desc->pcp);
+	}
 	if (desc->flag) {
 		free_pages((unsigned long)desc, desc->flag);
 	} else {
@@ -125,51 +192,190 @@ void ihk_pagealloc_destroy(void *__desc)
 }
 
 /**
- * \brief Internal function for the allocation of large blocks
+ * \brief First free block at or after n, nbits if there is none.
  *
- * If the size of block to allocate is more than 32, the allocator allocates
- * by the unit of 64 blocks (because the map uses bitfield, and unsigned long
- * is 64 bit).
- * \param desc    Pointer to the allocator descriptor.
- * \param nblocks Number of large blocks (in 64 blocks)
- * \return Address of the allocated block. 0 if failed. 
+ * The rest of the word of n is looked at directly, further words are
+ * found through the summary.
  */
-static unsigned long __ihk_pagealloc_large(struct ihk_page_allocator_desc *desc,
-                                           int nblocks)
+static unsigned int __ihk_pagealloc_next_free(
+	struct ihk_page_allocator_desc *desc, unsigned int n)
 {
-	unsigned long flags;
-	unsigned int i, j, mi;
+	unsigned int mi, si;
+	unsigned long v;
 
-	printk("pagealloc_large_request : %d\n", nblocks);
+	if (n >= desc->nbits) {
+		return desc->nbits;
+	}
 
-	spin_lock_irqsave(&desc->lock, flags);
-	for (i = 0, mi = desc->last; i < desc->count; i++, mi++) {
-		if (mi > desc->count) {
-			mi = 0;
-		}
-		if (mi + nblocks >= desc->count) {
-			continue;
-		}
-		for (j = mi; j < mi + nblocks; j++) {
-			if (desc->map[j]) {
+	mi = MAP_INDEX(n);
+	v = ~desc->map[mi] & (~0UL << MAP_BIT(n));
+	if (v) {
+		return mi * 64 + __ffs(v);
+	}
+
+	/* Words after mi that are not full */
+	for (++mi; mi < desc->count; mi = si * 64 + 64) {
+		si = MAP_INDEX(mi);
+		v = ~desc->summary[si] & (~0UL << MAP_BIT(mi));
+		if (v) {
+			mi = si * 64 + __ffs(v);
+			if (mi >= desc->count) {
 				break;
 			}
+			return mi * 64 + __ffs(~desc->map[mi]);
 		}
-		if (j == mi + nblocks) {
-			for (j = mi; j < mi + nblocks; j++) {
-				desc->map[j] = (unsigned long)-1;
-			}
-			spin_unlock_irqrestore(&desc->lock, flags);
+	}
+
+	return desc->nbits;
+}
 
-			return ADDRESS(desc, mi, 0);
+/** \brief First allocated block in [n, limit), limit if there is none */
+static unsigned int __ihk_pagealloc_next_used(
+	struct ihk_page_allocator_desc *desc, unsigned int n,
+	unsigned int limit)
+{
+	unsigned int mi;
+	unsigned long v;
+
+	while (n < limit) {
+		mi = MAP_INDEX(n);
+		v = desc->map[mi] & (~0UL << MAP_BIT(n));
+		if (v) {
+			n = mi * 64 + __ffs(v);
+			break;
+		}
+		n = mi * 64 + 64;
+	}
+
+	return n < limit ? n : limit;
+}
+
+/** \brief Update the summary after blocks [n, n + nr) changed */
+static void __ihk_pagealloc_summarize(struct ihk_page_allocator_desc *desc,
+                                      unsigned int n, unsigned int nr)
+{
+	unsigned int mi;
+
+	for (mi = MAP_INDEX(n); mi <= MAP_INDEX(n + nr - 1); mi++) {
+		if (desc->map[mi] == ~0UL) {
+			__set_bit(mi, desc->summary);
+		} else {
+			__clear_bit(mi, desc->summary);
+		}
+	}
+}
+
+/**
+ * \brief Take npages blocks from the map, desc->lock held.
+ *
+ * First fit over free runs: the next free block is found with the
+ * summary, the end of its run with word scans. Exactly npages blocks
+ * are taken, whatever their number.
+ */
+static unsigned long __ihk_pagealloc_alloc(struct ihk_page_allocator_desc *desc,
+                                           int npages)
+{
+	unsigned int n, used;
+
+	for (n = 0; ; n = used) {
+		n = __ihk_pagealloc_next_free(desc, n);
+		if (n + npages > desc->nbits) {
+			break;
+		}
+
+		used = __ihk_pagealloc_next_used(desc, n, n + npages);
+		if (used == n + npages) {
+			bitmap_set(desc->map, n, npages);
+			__ihk_pagealloc_summarize(desc, n, npages);
+
+			return ADDRESS(desc, n);
 		}
 	}
-	
-	spin_unlock_irqrestore(&desc->lock, flags);
 
 	return 0;
 }
 
+/** \brief Give npages blocks at address back to the map, desc->lock held */
+static void __ihk_pagealloc_free(struct ihk_page_allocator_desc *desc,
+                                 unsigned long address, int npages)
+{
+	unsigned int mi = (address - desc->start) >> desc->shift;
+
+	bitmap_clear(desc->map, mi, npages);
+	__ihk_pagealloc_summarize(desc, mi, npages);
+}
+
+/** \brief Cache class of npages, -1 if it is not cached */
+static int __ihk_pagealloc_pcp_class(int npages)
+{
+	if (npages <= 0 || npages > (1 << (IHK_PAGEALLOC_PCP_CLASSES - 1)) ||
+	    (npages & (npages - 1))) {
+		return -1;
+	}
+
+	return __ffs(npages);
+}
+
+/** \brief Move up to a batch of areas of class c from the map to pcp */
+static void __ihk_pagealloc_pcp_refill(struct ihk_page_allocator_desc *desc,
+                                       struct ihk_pagealloc_pcp *pcp, int c)
+{
+	unsigned long address;
+
+	spin_lock(&desc->lock);
+	while (pcp->nr[c] < IHK_PAGEALLOC_PCP_BATCH) {
+		address = __ihk_pagealloc_alloc(desc, 1 << c);
+		if (!address) {
+			break;
+		}
+		pcp->areas[c][pcp->nr[c]++] = address;
+	}
+	desc->refills++;
+	spin_unlock(&desc->lock);
+}
+
+/** \brief Move the n oldest areas of class c from pcp to the map */
+static void __ihk_pagealloc_pcp_drain(struct ihk_page_allocator_desc *desc,
+                                      struct ihk_pagealloc_pcp *pcp, int c,
+                                      unsigned int n)
+{
+	unsigned int i;
+
+	spin_lock(&desc->lock);
+	for (i = 0; i < n; i++) {
+		__ihk_pagealloc_free(desc, pcp->areas[c][i], 1 << c);
+	}
+	desc->drains++;
+	spin_unlock(&desc->lock);
+
+	pcp->nr[c] -= n;
+	memmove(pcp->areas[c], pcp->areas[c] + n,
+	        pcp->nr[c] * sizeof(pcp->areas[c][0]));
+}
+
+/** \brief Empty the caches of all CPUs, returns whether any area was freed */
+static int __ihk_pagealloc_drain_all(struct ihk_page_allocator_desc *desc)
+{
+	struct ihk_pagealloc_pcp *pcp;
+	unsigned long flags;
+	int cpu, c, freed = 0;
+
+	for_each_possible_cpu(cpu) {
+		pcp = per_cpu_ptr(desc->pcp, cpu);
+		spin_lock_irqsave(&pcp->lock, flags);
+		for (c = 0; c < IHK_PAGEALLOC_PCP_CLASSES; c++) {
+			if (pcp->nr[c]) {
+				freed = 1;
+				__ihk_pagealloc_pcp_drain(desc, pcp, c,
+				                          pcp->nr[c]);
+			}
+		}
+		spin_unlock_irqrestore(&pcp->lock, flags);
+	}
+
+	return freed;
+}
+
 /**
  * \brief Allocates a memory area.
  *
@@ -180,41 +386,50 @@ static unsigned long __ihk_pagealloc_large(struct ihk_page_allocator_desc *desc,
 unsigned long ihk_pagealloc_alloc(void *__desc, int npages)
 {
 	struct ihk_page_allocator_desc *desc = __desc;
-	unsigned int i, mi;
-	int j;
-	unsigned long v, mask, flags;
-
-	/* If requested page is more than the half of the element,
-	 * we allocate the whole element (ulong) */
-	if (npages >= 32) {
-		return __ihk_pagealloc_large(desc, (npages + 63) >> 6);
-	}
+	struct ihk_pagealloc_pcp *pcp;
+	unsigned long address = 0;
+	unsigned long flags;
+	int c;
 
-	mask = (1 << npages) - 1;
+	if (npages <= 0 || npages > desc->nbits) {
+		return 0;
+	}
 
-	spin_lock_irqsave(&desc->lock, flags);
-	for (i = 0, mi = desc->last; i < desc->count; i++, mi++) {
-		if (mi > desc->count) {
-			mi = 0;
+	c = __ihk_pagealloc_pcp_class(npages);
+	if (c >= 0 && desc->pcp) {
+		local_irq_save(flags);
+		pcp = this_cpu_ptr(desc->pcp);
+		spin_lock(&pcp->lock);
+		if (pcp->nr[c]) {
+			pcp->hits++;
+		} else {
+			pcp->misses++;
+			__ihk_pagealloc_pcp_refill(desc, pcp, c);
 		}
-		
-		v = desc->map[mi];
-		if (v == (unsigned long)-1)
-			continue;
-		
-		for (j = 0; j <= 64 - npages; j++) {
-			if (!(v & (mask << j))) { /* free */
-				desc->map[mi] |= (mask << j);
-
-				spin_unlock_irqrestore(&desc->lock, flags);
-				return ADDRESS(desc, mi, j);
-			}
+		if (pcp->nr[c]) {
+			address = pcp->areas[c][--pcp->nr[c]];
+		}
+		spin_unlock(&pcp->lock);
+		local_irq_restore(flags);
+
+		if (address) {
+			return address;
 		}
 	}
+
+	spin_lock_irqsave(&desc->lock, flags);
+	address = __ihk_pagealloc_alloc(desc, npages);
 	spin_unlock_irqrestore(&desc->lock, flags);
 
+	/* What is left may be sitting in the caches */
+	if (!address && desc->pcp && __ihk_pagealloc_drain_all(desc)) {
+		spin_lock_irqsave(&desc->lock, flags);
+		address = __ihk_pagealloc_alloc(desc, npages);
+		spin_unlock_irqrestore(&desc->lock, flags);
+	}
+
 	/* We use null pointer for failure */
-	return 0;
+	return address;
 }
 
 /**
@@ -244,17 +459,34 @@ unsigned long ihk_pagealloc_alloc_size(void *__desc, unsigned long size)
 void ihk_pagealloc_free(void *__desc, unsigned long address, int npages)
 {
 	struct ihk_page_allocator_desc *desc = __desc;
-	int i;
-	unsigned mi;
+	struct ihk_pagealloc_pcp *pcp;
 	unsigned long flags;
+	int c;
 
-	/* XXX: Parameter check */
-	
-	spin_lock_irqsave(&desc->lock, flags);
-	mi = (address - desc->start) >> desc->shift;
-	for (i = 0; i < npages; i++, mi++) {
-		desc->map[MAP_INDEX(mi)] &= ~(1UL << MAP_BIT(mi));
+	if (npages <= 0 || address < desc->start ||
+	    address + ((unsigned long)npages << desc->shift) > desc->end) {
+		printk("%s: invalid range 0x%lx, %d blocks\n",
+		       __FUNCTION__, address, npages);
+		return;
+	}
+
+	c = __ihk_pagealloc_pcp_class(npages);
+	if (c >= 0 && desc->pcp) {
+		local_irq_save(flags);
+		pcp = this_cpu_ptr(desc->pcp);
+		spin_lock(&pcp->lock);
+		if (pcp->nr[c] == IHK_PAGEALLOC_PCP_MAX) {
+			__ihk_pagealloc_pcp_drain(desc, pcp, c,
+			                          IHK_PAGEALLOC_PCP_BATCH);
+		}
+		pcp->areas[c][pcp->nr[c]++] = address;
+		spin_unlock(&pcp->lock);
+		local_irq_restore(flags);
+		return;
 	}
+
+	spin_lock_irqsave(&desc->lock, flags);
+	__ihk_pagealloc_free(desc, address, npages);
 	spin_unlock_irqrestore(&desc->lock, flags);
 }
 
@@ -267,6 +499,112 @@ void ihk_pagealloc_free_size(void *__desc, unsigned long address,
 	ihk_pagealloc_free(desc, address, size >> desc->shift);
 }
 
+/** \brief Statistics of an allocator, in debugfs */
+static int ihk_pagealloc_stats_show(struct seq_file *m, void *v)
+{
+	struct ihk_page_allocator_desc *desc = m->private;
+	struct ihk_pagealloc_pcp *pcp;
+	unsigned long hits = 0, misses = 0, cached = 0;
+	unsigned long free = 0, runs = 0, largest = 0;
+	unsigned long refills, drains, flags;
+	unsigned int n, used;
+	int cpu, c;
+
+	if (desc->pcp) {
+		for_each_possible_cpu(cpu) {
+			pcp = per_cpu_ptr(desc->pcp, cpu);
+			spin_lock_irqsave(&pcp->lock, flags);
+			hits += pcp->hits;
+			misses += pcp->misses;
+			for (c = 0; c < IHK_PAGEALLOC_PCP_CLASSES; c++) {
+				cached += pcp->nr[c] << c;
+			}
+			spin_unlock_irqrestore(&pcp->lock, flags);
+		}
+	}
+
+	spin_lock_irqsave(&desc->lock, flags);
+	for (n = 0; ; n = used) {
+		n = __ihk_pagealloc_next_free(desc, n);
+		if (n >= desc->nbits) {
+			break;
+		}
+		used = __ihk_pagealloc_next_used(desc, n, desc->nbits);
+		free += used - n;
+		runs++;
+		if (used - n > largest) {
+			largest = used - n;
+		}
+	}
+	refills = desc->refills;
+	drains = desc->drains;
+	spin_unlock_irqrestore(&desc->lock, flags);
+
+	seq_printf(m, "start: 0x%lx\n", desc->start);
+	seq_printf(m, "end: 0x%lx\n", desc->end);
+	seq_printf(m, "block_size: %lu\n", 1UL << desc->shift);
+	seq_printf(m, "blocks: %lu\n", (desc->end - desc->start) >> desc->shift);
+	seq_printf(m, "free_blocks: %lu\n", free);
+	seq_printf(m, "cached_blocks: %lu\n", cached);
+	seq_printf(m, "free_runs: %lu\n", runs);
+	seq_printf(m, "largest_free_run: %lu\n", largest);
+	/* Share of the free blocks that are not in the largest run */
+	seq_printf(m, "fragmentation_pct: %lu\n",
+	           free ? (free - largest) * 100 / free : 0);
+	seq_printf(m, "pcp_hits: %lu\n", hits);
+	seq_printf(m, "pcp_misses: %lu\n", misses);
+	seq_printf(m, "pcp_refills: %lu\n", refills);
+	seq_printf(m, "pcp_drains: %lu\n", drains);
+
+	return 0;
+}
+
+static int ihk_pagealloc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ihk_pagealloc_stats_show, inode->i_private);
+}
+
+static const struct file_operations ihk_pagealloc_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ihk_pagealloc_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/** \brief Create the statistics file of desc, named by its start address */
+static void __ihk_pagealloc_debugfs_add(struct ihk_page_allocator_desc *desc)
+{
+	char name[32];
+
+	if (IS_ERR_OR_NULL(ihk_pagealloc_debugfs_dir)) {
+		return;
+	}
+
+	snprintf(name, sizeof(name), "%lx", desc->start);
+	desc->debugfs = debugfs_create_file(name, 0444,
+	                                    ihk_pagealloc_debugfs_dir, desc,
+	                                    &ihk_pagealloc_stats_fops);
+	if (IS_ERR(desc->debugfs)) {
+		desc->debugfs = NULL;
+	}
+}
+
+/** \brief Create the debugfs directory, called on module load */
+void ihk_pagealloc_debugfs_init(void)
+{
+	ihk_pagealloc_debugfs_dir = debugfs_create_dir("ihk_pagealloc", NULL);
+}
+
+/** \brief Remove the debugfs directory, called on module unload */
+void ihk_pagealloc_debugfs_exit(void)
+{
+	if (!IS_ERR_OR_NULL(ihk_pagealloc_debugfs_dir)) {
+		debugfs_remove_recursive(ihk_pagealloc_debugfs_dir);
+	}
+	ihk_pagealloc_debugfs_dir = NULL;
+}
+
 EXPORT_SYMBOL(ihk_pagealloc_init);
 EXPORT_SYMBOL(ihk_pagealloc_destroy);
 EXPORT_SYMBOL(ihk_pagealloc_alloc);
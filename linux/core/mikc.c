@@ -21,6 +21,10 @@
 #include <linux/uaccess.h>
 #include <linux/cdev.h>
 #include <linux/file.h>
+#include <linux/device.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/vmalloc.h>
 #include <asm/spinlock.h>
 #include <ihk/ihk_host_user.h>
 #include <ihk/ihk_host_driver.h>
@@ -92,7 +96,7 @@ struct ihk_ikc_channel_desc *ihk_host_ikc_init_first(ihk_os_t ihk_os,
 		 * until all packets are purged. This makes the notification IRQ
 		 * on master channel unnecessary.
 		 */
-		//c->flag |= IKC_FLAG_NO_COPY;
+		//ihk_ikc_channel_set_nocopy(c);
 
 		dprintf("c->remote_os = %p\n", c->remote_os);
 		os->packet_handler = handler;
@@ -171,6 +175,47 @@ spinlock_t *ihk_os_get_ikc_channel_lock(ihk_os_t ihk_os)
 	return &os->ikc_channel_lock;
 }
 
+/** \brief Make a channel available to ihk_ikc_find_channel()
+ *  (called from IHK-IKC) */
+int ihk_os_insert_ikc_channel(ihk_os_t ihk_os, struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&os->ikc_channel_lock, flags);
+	ret = radix_tree_insert(&os->ikc_channel_tree, c->channel_id, c);
+	spin_unlock_irqrestore(&os->ikc_channel_lock, flags);
+
+	return ret;
+}
+
+/** \brief Remove a channel from the lookup table (called from IHK-IKC) */
+void ihk_os_remove_ikc_channel(ihk_os_t ihk_os, struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+	unsigned long flags;
+
+	spin_lock_irqsave(&os->ikc_channel_lock, flags);
+	if (radix_tree_lookup(&os->ikc_channel_tree, c->channel_id) == c) {
+		radix_tree_delete(&os->ikc_channel_tree, c->channel_id);
+	}
+	spin_unlock_irqrestore(&os->ikc_channel_lock, flags);
+}
+
+/** \brief Look up a channel by ID without locking (called from IHK-IKC) */
+struct ihk_ikc_channel_desc *ihk_os_lookup_ikc_channel(ihk_os_t ihk_os, int id)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+	struct ihk_ikc_channel_desc *c;
+
+	rcu_read_lock();
+	c = radix_tree_lookup(&os->ikc_channel_tree, id);
+	rcu_read_unlock();
+
+	return c;
+}
+
 /** \brief Get the IKC regular channel (called from IHK-IKC) */
 struct ihk_ikc_channel_desc *ihk_os_get_regular_channel(ihk_os_t ihk_os, int cpu)
 {
@@ -191,6 +236,35 @@ void ihk_os_set_regular_channel(ihk_os_t ihk_os, struct ihk_ikc_channel_desc *c,
 	os->regular_channels[cpu] = c;
 }
 
+/** \brief Get the number of CPUs assigned to the OS (called from IHK-IKC) */
+int ihk_os_get_num_cpus(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	if (!os->ops || !os->ops->get_num_cpus) {
+		return -EINVAL;
+	}
+
+	return os->ops->get_num_cpus(os, os->priv);
+}
+
+/** \brief Get the busy-poll state of the IKC (called from IHK-IKC) */
+struct ihk_ikc_poll **ihk_host_os_get_ikc_poll(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	return &os->ikc_poll;
+}
+
+/** \brief Get the waitqueue of senders waiting for room
+ *  (called from IHK-IKC) */
+wait_queue_head_t *ihk_host_os_get_ikc_send_wait(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	return &os->ikc_send_wait;
+}
+
 /** \brief Get the interrupt handler of the IKC (called from IHK-IKC) */
 struct ihk_host_interrupt_handler *ihk_host_os_get_ikc_handler(ihk_os_t ihk_os)
 {
@@ -257,20 +331,14 @@ static int arch_master_handler(struct ihk_ikc_channel_desc *c,
 	return 0;
 }
 
-/** \brief Get the wait list for the master channel (Called from IHK-IKC) */
-struct list_head *ihk_ikc_get_master_wait_list(ihk_os_t ihk_os)
-{
-	struct ihk_host_linux_os_data *os = ihk_os;
-
-	return &os->wait_list;
-}
-/** \brief Get the lock for the wait list for the master channel (called from
+/** \brief Get the wait buckets for the master channel (Called from
  *         IHK-IKC) */
-ihk_spinlock_t *ihk_ikc_get_master_wait_lock(ihk_os_t ihk_os)
+struct ihk_ikc_master_wait_bucket *ihk_ikc_get_master_wait_buckets(
+	ihk_os_t ihk_os)
 {
 	struct ihk_host_linux_os_data *os = ihk_os;
 
-	return &os->wait_lock;
+	return os->wait_buckets;
 }
 
 /** \brief Get the master channel of the specified kernel
@@ -328,3 +396,236 @@ ihk_os_t ihk_ikc_linux_get_os_from_work(struct work_struct *work)
 
 	return ikc_work->os;
 }
+
+/*
+ * IKC statistics under /sys/class/mcos/mcosN/ikc/: one file per counter
+ * with the sum over all channels of the OS (the maximum for
+ * max_occupancy), "channels" with one line per channel, and "reset",
+ * which clears the counters of all channels on any write.
+ */
+struct ihk_os_ikc_stat_attr {
+	struct kobj_attribute attr;
+	size_t offset;
+};
+
+static struct ihk_host_linux_os_data *ihk_os_ikc_kobj_to_os(
+	struct kobject *kobj)
+{
+	return dev_get_drvdata(container_of(kobj->parent, struct device, kobj));
+}
+
+static u64 ihk_os_ikc_stat(struct ihk_ikc_channel_desc *c, size_t offset)
+{
+	ihk_ikc_stat_t *s = (ihk_ikc_stat_t *)((char *)&c->stats + offset);
+
+	return ihk_ikc_stat_read(*s);
+}
+
+static ssize_t ihk_os_ikc_stat_show(struct kobject *kobj,
+                                    struct kobj_attribute *attr, char *buf)
+{
+	struct ihk_host_linux_os_data *os = ihk_os_ikc_kobj_to_os(kobj);
+	struct ihk_os_ikc_stat_attr *sa =
+		container_of(attr, struct ihk_os_ikc_stat_attr, attr);
+	struct ihk_ikc_channel_desc *c;
+	unsigned long flags;
+	u64 v, sum = 0;
+
+	spin_lock_irqsave(&os->ikc_channel_lock, flags);
+	list_for_each_entry(c, &os->ikc_channels, list_all) {
+		v = ihk_os_ikc_stat(c, sa->offset);
+		if (sa->offset == offsetof(struct ihk_ikc_channel_stats,
+		                           max_occupancy)) {
+			sum = max(sum, v);
+		} else {
+			sum += v;
+		}
+	}
+	spin_unlock_irqrestore(&os->ikc_channel_lock, flags);
+
+	return sprintf(buf, "%llu\n", sum);
+}
+
+#define IHK_OS_IKC_STAT_ATTR(_name) \
+	static struct ihk_os_ikc_stat_attr ihk_os_ikc_stat_##_name = { \
+		.attr = __ATTR(_name, 0444, ihk_os_ikc_stat_show, NULL), \
+		.offset = offsetof(struct ihk_ikc_channel_stats, _name), \
+	}
+
+IHK_OS_IKC_STAT_ATTR(sent);
+IHK_OS_IKC_STAT_ATTR(sent_bytes);
+IHK_OS_IKC_STAT_ATTR(received);
+IHK_OS_IKC_STAT_ATTR(received_bytes);
+IHK_OS_IKC_STAT_ATTR(queue_full);
+IHK_OS_IKC_STAT_ATTR(write_retries);
+IHK_OS_IKC_STAT_ATTR(busy);
+IHK_OS_IKC_STAT_ATTR(notify_ipis);
+IHK_OS_IKC_STAT_ATTR(max_occupancy);
+IHK_OS_IKC_STAT_ATTR(pool_mallocs);
+
+static ssize_t ihk_os_ikc_reset_store(struct kobject *kobj,
+                                      struct kobj_attribute *attr,
+                                      const char *buf, size_t count)
+{
+	struct ihk_host_linux_os_data *os = ihk_os_ikc_kobj_to_os(kobj);
+	struct ihk_ikc_channel_desc *c;
+	unsigned long flags;
+
+	spin_lock_irqsave(&os->ikc_channel_lock, flags);
+	list_for_each_entry(c, &os->ikc_channels, list_all) {
+		ihk_ikc_channel_stats_reset(c);
+	}
+	spin_unlock_irqrestore(&os->ikc_channel_lock, flags);
+
+	return count;
+}
+
+static struct kobj_attribute ihk_os_ikc_reset =
+	__ATTR(reset, 0200, NULL, ihk_os_ikc_reset_store);
+
+static struct ihk_os_ikc_stat_attr *ihk_os_ikc_stat_attrs[] = {
+	&ihk_os_ikc_stat_sent,
+	&ihk_os_ikc_stat_sent_bytes,
+	&ihk_os_ikc_stat_received,
+	&ihk_os_ikc_stat_received_bytes,
+	&ihk_os_ikc_stat_queue_full,
+	&ihk_os_ikc_stat_write_retries,
+	&ihk_os_ikc_stat_busy,
+	&ihk_os_ikc_stat_notify_ipis,
+	&ihk_os_ikc_stat_max_occupancy,
+	&ihk_os_ikc_stat_pool_mallocs,
+};
+
+static struct attribute *ihk_os_ikc_attrs[] = {
+	&ihk_os_ikc_stat_sent.attr.attr,
+	&ihk_os_ikc_stat_sent_bytes.attr.attr,
+	&ihk_os_ikc_stat_received.attr.attr,
+	&ihk_os_ikc_stat_received_bytes.attr.attr,
+	&ihk_os_ikc_stat_queue_full.attr.attr,
+	&ihk_os_ikc_stat_write_retries.attr.attr,
+	&ihk_os_ikc_stat_busy.attr.attr,
+	&ihk_os_ikc_stat_notify_ipis.attr.attr,
+	&ihk_os_ikc_stat_max_occupancy.attr.attr,
+	&ihk_os_ikc_stat_pool_mallocs.attr.attr,
+	&ihk_os_ikc_reset.attr,
+	NULL,
+};
+
+static struct attribute_group ihk_os_ikc_attr_group = {
+	.attrs = ihk_os_ikc_attrs,
+};
+
+#define IHK_OS_IKC_CHANNEL_LINE 320
+
+/* There may be more channels than fit in a page, so this is a bin file */
+static ssize_t ihk_os_ikc_channels_read(struct file *filp,
+                                        struct kobject *kobj,
+                                        struct bin_attribute *attr,
+                                        char *buf, loff_t off, size_t count)
+{
+	struct ihk_host_linux_os_data *os = ihk_os_ikc_kobj_to_os(kobj);
+	struct ihk_ikc_channel_desc *c;
+	unsigned long flags;
+	size_t size, len;
+	char *text;
+	int i, n = 0;
+
+	spin_lock_irqsave(&os->ikc_channel_lock, flags);
+	list_for_each_entry(c, &os->ikc_channels, list_all) {
+		n++;
+	}
+	spin_unlock_irqrestore(&os->ikc_channel_lock, flags);
+
+	/* Leave room for channels created in the meantime */
+	size = (n + 16) * IHK_OS_IKC_CHANNEL_LINE;
+	text = vmalloc(size);
+	if (!text) {
+		return -ENOMEM;
+	}
+
+	len = scnprintf(text, size, "id port remote cpu");
+	for (i = 0; i < ARRAY_SIZE(ihk_os_ikc_stat_attrs); i++) {
+		len += scnprintf(text + len, size - len, " %s",
+		                 ihk_os_ikc_stat_attrs[i]->attr.attr.name);
+	}
+	len += scnprintf(text + len, size - len, "\n");
+
+	spin_lock_irqsave(&os->ikc_channel_lock, flags);
+	list_for_each_entry(c, &os->ikc_channels, list_all) {
+		if (size - len < IHK_OS_IKC_CHANNEL_LINE) {
+			break;
+		}
+		len += scnprintf(text + len, size - len, "%d %d %d %d",
+		                 c->channel_id, c->port, c->remote_channel_id,
+		                 c->recv.queue ? c->recv.queue->read_cpu : -1);
+		for (i = 0; i < ARRAY_SIZE(ihk_os_ikc_stat_attrs); i++) {
+			len += scnprintf(text + len, size - len, " %llu",
+			                 ihk_os_ikc_stat(c,
+			                     ihk_os_ikc_stat_attrs[i]->offset));
+		}
+		len += scnprintf(text + len, size - len, "\n");
+	}
+	spin_unlock_irqrestore(&os->ikc_channel_lock, flags);
+
+	if (off >= len) {
+		count = 0;
+	} else {
+		if (count > len - off) {
+			count = len - off;
+		}
+		memcpy(buf, text + off, count);
+	}
+	vfree(text);
+
+	return count;
+}
+
+static struct bin_attribute ihk_os_ikc_channels = {
+	.attr = { .name = "channels", .mode = 0444 },
+	.read = ihk_os_ikc_channels_read,
+};
+
+/** \brief Create /sys/class/mcos/mcosN/ikc/ (called on OS creation) */
+int ihk_os_ikc_sysfs_init(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+	int ret;
+
+	os->ikc_kobj = kobject_create_and_add("ikc", &os->lindev->kobj);
+	if (!os->ikc_kobj) {
+		return -ENOMEM;
+	}
+
+	ret = sysfs_create_group(os->ikc_kobj, &ihk_os_ikc_attr_group);
+	if (ret) {
+		goto err;
+	}
+
+	ret = sysfs_create_bin_file(os->ikc_kobj, &ihk_os_ikc_channels);
+	if (ret) {
+		sysfs_remove_group(os->ikc_kobj, &ihk_os_ikc_attr_group);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	kobject_put(os->ikc_kobj);
+	os->ikc_kobj = NULL;
+	return ret;
+}
+
+/** \brief Remove /sys/class/mcos/mcosN/ikc/ */
+void ihk_os_ikc_sysfs_exit(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	if (!os->ikc_kobj) {
+		return;
+	}
+
+	sysfs_remove_bin_file(os->ikc_kobj, &ihk_os_ikc_channels);
+	sysfs_remove_group(os->ikc_kobj, &ihk_os_ikc_attr_group);
+	kobject_put(os->ikc_kobj);
+	os->ikc_kobj = NULL;
+}
@@ -2417,3 +2417,9 @@ int ihk_smp_print_pte(struct mm_struct *mm, unsigned long address)
 	printk(KERN_WARNING "%s: function not implemented.\n", __FUNCTION__);
 	return 0;
 }
+
+/* memset() zeroes whole blocks with DC ZVA, without reading them */
+void ihk_smp_clear_nocache(void *addr, size_t size)
+{
+	memset(addr, 0, size);
+}
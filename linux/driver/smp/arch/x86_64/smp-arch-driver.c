@@ -1973,3 +1973,40 @@ int ihk_smp_print_pte(struct mm_struct *mm, unsigned long address)
 		(unsigned long)(pte_val(entry) & PTE_PFN_MASK));
 	return 0;
 }
+
+/*
+ * Zero memory with non-temporal stores so that scrubbing reserved memory
+ * does not evict the caches of Linux
+ */
+void ihk_smp_clear_nocache(void *addr, size_t size)
+{
+	unsigned long head = (unsigned long)addr & 63;
+	unsigned long *p;
+	unsigned long *end;
+
+	if (head) {
+		head = min_t(size_t, 64 - head, size);
+		memset(addr, 0, head);
+		addr += head;
+		size -= head;
+	}
+
+	p = addr;
+	end = addr + (size & ~63UL);
+	for (; p < end; p += 8) {
+		asm volatile("movnti %1, 0(%0)\n\t"
+			     "movnti %1, 8(%0)\n\t"
+			     "movnti %1, 16(%0)\n\t"
+			     "movnti %1, 24(%0)\n\t"
+			     "movnti %1, 32(%0)\n\t"
+			     "movnti %1, 40(%0)\n\t"
+			     "movnti %1, 48(%0)\n\t"
+			     "movnti %1, 56(%0)\n\t"
+			     : : "r" (p), "r" (0UL) : "memory");
+	}
+	asm volatile("sfence" : : : "memory");
+
+	if (size & 63) {
+		memset(end, 0, size & 63);
+	}
+}
@@ -65,5 +65,6 @@ int smp_ihk_arch_get_perf_event_map(struct smp_boot_param *param);
 void ihk_smp_free_page_tables(pgd_t *pt);
 int ihk_smp_map_kernel(pgd_t *pt, unsigned long vaddr, phys_addr_t paddr);
 int ihk_smp_print_pte(struct mm_struct *mm, unsigned long address);
+void ihk_smp_clear_nocache(void *addr, size_t size);
 
 #endif /* HEADER_SMP_SMP_ARCH_DRIVER_H */
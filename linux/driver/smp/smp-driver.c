@@ -28,6 +28,8 @@
 #include <linux/slub_def.h>
 #include <linux/time.h>
 #include <linux/hugetlb.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
 #include <asm/hw_irq.h>
 #include <asm/pgtable.h>
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,32)
@@ -52,6 +54,9 @@
 #include "smp-arch-driver.h"
 #include "smp-defines-driver.h"
 
+#define CREATE_TRACE_POINTS
+#include "smp-trace.h"
+
 /** Get the index in the map array */
 #define MAP_INDEX(n)    ((n) >> 6)
 /** Get the bit number in a map element */
@@ -79,6 +84,10 @@ static unsigned int ihk_cores = 0;
 module_param(ihk_cores, uint, 0644);
 MODULE_PARM_DESC(ihk_cores, "IHK reserved CPU cores");
 
+static int ihk_scrub_mem = 1;
+module_param(ihk_scrub_mem, int, 0644);
+MODULE_PARM_DESC(ihk_scrub_mem, "Zero reserved memory in the background");
+
 //#define BUILTIN_COM_VECTOR	0xf1
 
 #define BUILTIN_DEV_STATUS_READY	0
@@ -91,6 +100,8 @@ unsigned long ident_page_table;
 
 static struct list_head ihk_mem_free_chunks;
 struct list_head ihk_mem_used_chunks;
+/* Taken by reservations of NUMA nodes that run in parallel */
+static DEFINE_MUTEX(ihk_mem_reserve_lock);
 
 static struct vmap_area *lwk_va;
 static int (*ihk_ioremap_page_range)(unsigned long addr, unsigned long end,
@@ -144,6 +155,8 @@ struct chunk {
 	uintptr_t addr;
 	size_t size;
 	int numa_id;
+	/* All but this structure is zero, see ihk_smp_scrub_start() */
+	int zeroed;
 };
 
 /* ----------------------------------------------- */
@@ -547,6 +560,7 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 			bp_mem_chunk->end = os_mem_chunk->addr + os_mem_chunk->size;
 			bp_mem_chunk->numa_id =
 				linux_numa_2_lwk_numa(os, os_mem_chunk->numa_id);
+			bp_mem_chunk->zeroed = os_mem_chunk->zeroed;
 
 			++bp_mem_chunk;
 		}
@@ -795,6 +809,9 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 		return -EINVAL;
 	}
 
+	/* Takes the image and the page tables of the kernel */
+	os_mem_chunk->zeroed = 0;
+
 	printk("IHK-SMP: bootstrap addr: 0x%lx, chunk size: %lu @ NUMA: %d\n",
 			os->bootstrap_mem_start,
 			os->bootstrap_mem_end - os->bootstrap_mem_start,
@@ -950,6 +967,7 @@ static int smp_ihk_os_load_mem(ihk_os_t ihk_os, void *priv, const char *buf,
 {
 	struct smp_os_data *os = priv;
 	unsigned long phys, to_read, flags;
+	struct ihk_os_mem_chunk *os_mem_chunk;
 	void *virt;
 
 	dprint_func_enter;
@@ -973,6 +991,15 @@ static int smp_ihk_os_load_mem(ihk_os_t ihk_os, void *priv, const char *buf,
 	os->status = BUILTIN_OS_STATUS_LOADING;
 	spin_unlock_irqrestore(&os->lock, flags);
 
+	/* The image is loaded to the chunk at mem_start */
+	list_for_each_entry(os_mem_chunk, &ihk_mem_used_chunks, list) {
+		if (os_mem_chunk->os == ihk_os &&
+		    os_mem_chunk->addr <= os->mem_start &&
+		    os->mem_start < os_mem_chunk->addr + os_mem_chunk->size) {
+			os_mem_chunk->zeroed = 0;
+		}
+	}
+
 	offset += os->mem_start;
 	phys = (offset & PAGE_MASK);
 	offset -= phys;
@@ -1057,11 +1084,299 @@ rerun:
 			                  mem_chunk_next->size;
 			list_del(&mem_chunk_next->chain);
 
+			/* Zeroed if both were, but for the structure of next */
+			mem_chunk->zeroed = mem_chunk->zeroed &&
+			                    mem_chunk_next->zeroed;
+			if (mem_chunk->zeroed) {
+				memset(mem_chunk_next, 0, sizeof(*mem_chunk_next));
+			}
+
 			goto rerun;
 		}
 	}
 }
 
+/*
+ * Zeroing of free chunks in the background, by one kthread per NUMA node
+ * that runs on the CPUs of the node. A chunk stays on ihk_mem_free_chunks
+ * while it is zeroed, what adds, takes off or changes chunks stops the
+ * scrubbers first with ihk_smp_scrub_stop() and restarts them with
+ * ihk_smp_scrub_start(). The two hold ihk_smp_scrub_mutex in between,
+ * so that these sections do not overlap. What was zeroed of a chunk is
+ * kept over a stop while the chunk stays free and unchanged.
+ *
+ * The structure of a chunk itself is not zeroed, it is cleared when the
+ * chunk is assigned to an OS.
+ */
+#define IHK_SMP_SCRUB_SLICE (4UL << 20)
+
+struct ihk_smp_scrub_work {
+	struct list_head list;
+	struct chunk *chunk;
+	uintptr_t addr; /* Of the chunk when queued */
+	size_t size;
+	size_t done;    /* Bytes from the start of the chunk */
+};
+
+struct ihk_smp_scrubber {
+	struct task_struct *task;
+	struct list_head works;
+	struct ihk_smp_scrub_work *work; /* Being zeroed */
+};
+
+static struct ihk_smp_scrubber ihk_smp_scrubbers[MAX_NUMNODES];
+static LIST_HEAD(ihk_smp_scrub_progress);
+static DEFINE_SPINLOCK(ihk_smp_scrub_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ihk_smp_scrub_wq);
+static DEFINE_MUTEX(ihk_smp_scrub_mutex);
+static int ihk_smp_scrub_stopping;
+
+static struct ihk_smp_scrub_work *
+__ihk_smp_scrub_take(struct ihk_smp_scrubber *scrubber)
+{
+	struct ihk_smp_scrub_work *work = NULL;
+
+	spin_lock(&ihk_smp_scrub_lock);
+	if (!ihk_smp_scrub_stopping && !list_empty(&scrubber->works)) {
+		work = list_first_entry(&scrubber->works,
+					struct ihk_smp_scrub_work, list);
+		list_del(&work->list);
+		scrubber->work = work;
+	}
+	spin_unlock(&ihk_smp_scrub_lock);
+
+	return work;
+}
+
+static int __ihk_smp_scrub_stopping(void)
+{
+	int stopping;
+
+	spin_lock(&ihk_smp_scrub_lock);
+	stopping = ihk_smp_scrub_stopping;
+	spin_unlock(&ihk_smp_scrub_lock);
+
+	return stopping;
+}
+
+static int __ihk_smp_scrub_busy(void)
+{
+	int node, busy = 0;
+
+	spin_lock(&ihk_smp_scrub_lock);
+	for_each_node(node) {
+		if (ihk_smp_scrubbers[node].work) {
+			busy = 1;
+			break;
+		}
+	}
+	spin_unlock(&ihk_smp_scrub_lock);
+
+	return busy;
+}
+
+static int ihk_smp_scrub_thread(void *arg)
+{
+	struct ihk_smp_scrubber *scrubber = arg;
+	struct ihk_smp_scrub_work *work;
+	struct chunk *chunk;
+	unsigned long start;
+	size_t from, len;
+
+	while (!kthread_should_stop()) {
+		work = NULL;
+		wait_event_interruptible(ihk_smp_scrub_wq,
+				kthread_should_stop() ||
+				(work = __ihk_smp_scrub_take(scrubber)));
+		if (!work) {
+			continue;
+		}
+
+		chunk = work->chunk;
+		start = jiffies;
+		while (work->done < chunk->size &&
+		       !__ihk_smp_scrub_stopping()) {
+			len = min_t(size_t, chunk->size - work->done,
+				    IHK_SMP_SCRUB_SLICE);
+			from = work->done ? work->done : sizeof(struct chunk);
+			ihk_smp_clear_nocache(phys_to_virt(chunk->addr + from),
+					      work->done + len - from);
+			work->done += len;
+			cond_resched();
+		}
+
+		if (work->done == chunk->size) {
+			pr_info("IHK-SMP: chunk 0x%lx - 0x%lx"
+				" (len: %lu) @ NUMA node: %d zeroed in %u ms\n",
+				chunk->addr, chunk->addr + chunk->size,
+				chunk->size, chunk->numa_id,
+				jiffies_to_msecs(jiffies - start));
+		}
+
+		spin_lock(&ihk_smp_scrub_lock);
+		if (work->done == chunk->size) {
+			chunk->zeroed = 1;
+			kfree(work);
+		}
+		else {
+			list_add_tail(&work->list, &ihk_smp_scrub_progress);
+		}
+		scrubber->work = NULL;
+		spin_unlock(&ihk_smp_scrub_lock);
+		wake_up_all(&ihk_smp_scrub_wq);
+	}
+
+	return 0;
+}
+
+static void __ihk_smp_scrub_stop(void)
+{
+	struct ihk_smp_scrub_work *work;
+	struct ihk_smp_scrub_work *work_next;
+	LIST_HEAD(works);
+	int node;
+
+	spin_lock(&ihk_smp_scrub_lock);
+	ihk_smp_scrub_stopping = 1;
+	for_each_node(node) {
+		if (ihk_smp_scrubbers[node].task) {
+			list_splice_init(&ihk_smp_scrubbers[node].works,
+					 &works);
+		}
+	}
+	spin_unlock(&ihk_smp_scrub_lock);
+
+	wait_event(ihk_smp_scrub_wq, !__ihk_smp_scrub_busy());
+
+	/* Started ones are on ihk_smp_scrub_progress */
+	list_for_each_entry_safe(work, work_next, &works, list) {
+		list_del(&work->list);
+		kfree(work);
+	}
+}
+
+/*
+ * Wait for the scrubbers, before chunks are added, taken off or changed.
+ * They stay stopped until ihk_smp_scrub_start().
+ */
+static void ihk_smp_scrub_stop(void)
+{
+	mutex_lock(&ihk_smp_scrub_mutex);
+	__ihk_smp_scrub_stop();
+}
+
+/* Zero the free chunks that are not, ends ihk_smp_scrub_stop() */
+static void ihk_smp_scrub_start(void)
+{
+	struct ihk_smp_scrubber *scrubber;
+	struct ihk_smp_scrub_work *work;
+	struct ihk_smp_scrub_work *work_next;
+	struct task_struct *task;
+	struct chunk *chunk;
+	LIST_HEAD(progress);
+	int node;
+
+	spin_lock(&ihk_smp_scrub_lock);
+	list_splice_init(&ihk_smp_scrub_progress, &progress);
+	ihk_smp_scrub_stopping = 0;
+	spin_unlock(&ihk_smp_scrub_lock);
+
+	list_for_each_entry(chunk, &ihk_mem_free_chunks, chain) {
+		if (!ihk_scrub_mem || chunk->zeroed ||
+		    chunk->size <= sizeof(struct chunk)) {
+			continue;
+		}
+
+		node = chunk->numa_id;
+		scrubber = &ihk_smp_scrubbers[node];
+		if (!scrubber->task) {
+			if (!node_online(node)) {
+				continue;
+			}
+
+			task = kthread_create_on_node(ihk_smp_scrub_thread,
+					scrubber, node, "ihk_scrub/%d", node);
+			if (IS_ERR(task)) {
+				pr_warn("IHK-SMP: warning: creating scrubber "
+					"of NUMA %d\n", node);
+				continue;
+			}
+
+			/* Memory-only nodes have no CPUs to run on */
+			if (!cpumask_empty(cpumask_of_node(node))) {
+				set_cpus_allowed_ptr(task,
+						     cpumask_of_node(node));
+			}
+
+			INIT_LIST_HEAD(&scrubber->works);
+			scrubber->work = NULL;
+			spin_lock(&ihk_smp_scrub_lock);
+			scrubber->task = task;
+			spin_unlock(&ihk_smp_scrub_lock);
+			wake_up_process(task);
+		}
+
+		/* Resume where it was stopped if unchanged */
+		list_for_each_entry(work, &progress, list) {
+			if (work->chunk == chunk && work->addr == chunk->addr &&
+			    work->size == chunk->size) {
+				break;
+			}
+		}
+
+		if (&work->list != &progress) {
+			list_del(&work->list);
+		}
+		else {
+			work = kmalloc(sizeof(*work), GFP_KERNEL);
+			if (!work) {
+				break;
+			}
+
+			work->chunk = chunk;
+			work->addr = chunk->addr;
+			work->size = chunk->size;
+			work->done = 0;
+		}
+
+		spin_lock(&ihk_smp_scrub_lock);
+		list_add_tail(&work->list, &scrubber->works);
+		spin_unlock(&ihk_smp_scrub_lock);
+	}
+
+	/* Chunks taken off or changed since */
+	list_for_each_entry_safe(work, work_next, &progress, list) {
+		list_del(&work->list);
+		kfree(work);
+	}
+
+	wake_up_all(&ihk_smp_scrub_wq);
+	mutex_unlock(&ihk_smp_scrub_mutex);
+}
+
+static void ihk_smp_scrub_exit(void)
+{
+	struct ihk_smp_scrub_work *work;
+	struct ihk_smp_scrub_work *work_next;
+	int node;
+
+	ihk_smp_scrub_stop();
+
+	for_each_node(node) {
+		if (ihk_smp_scrubbers[node].task) {
+			kthread_stop(ihk_smp_scrubbers[node].task);
+			ihk_smp_scrubbers[node].task = NULL;
+		}
+	}
+
+	list_for_each_entry_safe(work, work_next, &ihk_smp_scrub_progress,
+				 list) {
+		list_del(&work->list);
+		kfree(work);
+	}
+	mutex_unlock(&ihk_smp_scrub_mutex);
+}
+
 /* TODO: rewrite this to embed in allocation and keep track
  * of max on the fly */
 static size_t max_size_mem_chunk(struct rb_root *root)
@@ -1135,6 +1450,7 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 	}
 
 	/* Drop memory chunk used by this OS */
+	ihk_smp_scrub_stop();
 	list_for_each_entry_safe(os_mem_chunk, next_chunk,
 			&ihk_mem_used_chunks, list) {
 
@@ -1147,6 +1463,7 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 		mem_chunk->addr = os_mem_chunk->addr;
 		mem_chunk->size = os_mem_chunk->size;
 		mem_chunk->numa_id = os_mem_chunk->numa_id;
+		mem_chunk->zeroed = 0;
 		INIT_LIST_HEAD(&mem_chunk->chain);
 
 		dprintk("IHK-SMP: mem chunk: 0x%lx - 0x%lx (len: %lu) freed\n",
@@ -1157,6 +1474,7 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 
 		kfree(os_mem_chunk);
 	}
+	ihk_smp_scrub_start();
 
 	if (os->numa_mapping) {
 		kfree(os->numa_mapping);
@@ -1240,6 +1558,7 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 		os_mem_chunk->addr = 0;
 		INIT_LIST_HEAD(&os_mem_chunk->list);
 
+		ihk_smp_scrub_stop();
 		list_for_each_entry(mem_chunk_iter, &ihk_mem_free_chunks,
 		                    chain) {
 			if (mem_chunk_iter->size >= resource->mem_size) {
@@ -1248,6 +1567,7 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 				os_mem_chunk->size = resource->mem_size;
 				os_mem_chunk->os = ihk_os;
 				os_mem_chunk->numa_id = mem_chunk_iter->numa_id;
+				os_mem_chunk->zeroed = mem_chunk_iter->zeroed;
 
 				list_del(&mem_chunk_iter->chain);
 				break;
@@ -1256,6 +1576,7 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 
 		if (!os_mem_chunk->addr) {
 			printk("IHK-SMP: error: not enough memory\n");
+			ihk_smp_scrub_start();
 			ret = -ENOMEM;
 			goto error_drop_cores;
 		}
@@ -1273,10 +1594,17 @@ static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
 			mem_chunk_leftover->size = mem_chunk_iter->size -
 			                           resource->mem_size;
 			mem_chunk_leftover->numa_id = mem_chunk_iter->numa_id;
+			mem_chunk_leftover->zeroed = mem_chunk_iter->zeroed;
 
 			add_free_mem_chunk(mem_chunk_leftover);
 		}
 
+		if (os_mem_chunk->zeroed) {
+			memset(phys_to_virt(os_mem_chunk->addr), 0,
+			       sizeof(struct chunk));
+		}
+		ihk_smp_scrub_start();
+
 		os->mem_start = resource->mem_start;
 		os->mem_end = os->mem_start + resource->mem_size;
 
@@ -1653,6 +1981,7 @@ static int smp_ihk_os_assign_cpu(ihk_os_t ihk_os, void *priv, unsigned long arg)
 	pr_info("IHK-SMP: CPUs: %s assigned to OS %p\n", req_string, ihk_os);
 
 out:
+	trace_ihk_smp_os_assign_cpu(req.num_cpus, ret);
 	kfree(req_cpus);
 	return ret;
 }
@@ -1764,6 +2093,7 @@ static int smp_ihk_os_release_cpu(ihk_os_t ihk_os, void *priv, unsigned long arg
 	ret = 0;
 
 out:
+	trace_ihk_smp_os_release_cpu(req.num_cpus, ret);
 	kfree(req_cpus);
 	return ret;
 }
@@ -2068,6 +2398,7 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 	struct chunk *mem_chunk_iter;
 	struct chunk *mem_chunk_max;
 	struct chunk *mem_chunk_match;
+	struct chunk *mem_chunk_zeroed;
 	size_t mem_size_left = mem_size;
 	size_t want = mem_size;
 	struct list_head to_be_assigned_chunks;
@@ -2090,17 +2421,31 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 		os_mem_chunk->numa_id = numa_id;
 		INIT_LIST_HEAD(&os_mem_chunk->list);
 
-		/* Find the biggest chunk or an exact match on this NUMA node */
+		/* Find the biggest chunk or an exact match on this NUMA node,
+		 * zeroed ones first */
 		mem_chunk_max = NULL;
 		mem_chunk_match = NULL;
+		mem_chunk_zeroed = NULL;
 		list_for_each_entry(mem_chunk_iter, &ihk_mem_free_chunks, chain) {
 			if (mem_chunk_iter->numa_id != numa_id) {
 				continue;
 			}
 
-			if (!mem_chunk_match && (mem_chunk_iter->size == mem_size)) {
-				mem_chunk_match = mem_chunk_iter;
-				break;
+			if (mem_chunk_iter->size == mem_size) {
+				if (!mem_chunk_match || !mem_chunk_match->zeroed) {
+					mem_chunk_match = mem_chunk_iter;
+				}
+				if (mem_chunk_match->zeroed) {
+					break;
+				}
+				continue;
+			}
+
+			if (mem_chunk_iter->zeroed &&
+			    mem_chunk_iter->size > mem_size &&
+			    (!mem_chunk_zeroed ||
+			     mem_chunk_zeroed->size < mem_chunk_iter->size)) {
+				mem_chunk_zeroed = mem_chunk_iter;
 			}
 
 			if (!mem_chunk_max || (mem_chunk_max->size < mem_chunk_iter->size)) {
@@ -2108,6 +2453,12 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 			}
 		}
 
+		if (mem_chunk_zeroed &&
+		    (!mem_chunk_match || !mem_chunk_match->zeroed)) {
+			mem_chunk_match = NULL;
+			mem_chunk_max = mem_chunk_zeroed;
+		}
+
 		if (!mem_chunk_max && !mem_chunk_match) {
 			/* Special condition for "all" */
 			if (want == IHK_SMP_MEM_ALL) {
@@ -2127,6 +2478,7 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 		if (mem_chunk_match) {
 			os_mem_chunk->addr = mem_chunk_match->addr;
 			os_mem_chunk->size = mem_chunk_match->size;
+			os_mem_chunk->zeroed = mem_chunk_match->zeroed;
 
 			list_del(&mem_chunk_match->chain);
 		}
@@ -2134,6 +2486,7 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 			os_mem_chunk->addr = mem_chunk_max->addr;
 			os_mem_chunk->size = mem_size < mem_chunk_max->size ?
 				mem_size : mem_chunk_max->size;
+			os_mem_chunk->zeroed = mem_chunk_max->zeroed;
 
 			list_del(&mem_chunk_max->chain);
 
@@ -2160,6 +2513,7 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 						mem_chunk_leftover->size = mem_chunk_max->size - mem_size -
 							comp_end_offset;
 						mem_chunk_leftover->numa_id = mem_chunk_max->numa_id;
+						mem_chunk_leftover->zeroed = mem_chunk_max->zeroed;
 						add_free_mem_chunk(mem_chunk_leftover);
 						dprintk("%s: comp_end_offset: %lu\n",
 								__FUNCTION__, comp_end_offset);
@@ -2171,6 +2525,7 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 					mem_chunk_leftover->addr = mem_chunk_max->addr + mem_size;
 					mem_chunk_leftover->size = mem_chunk_max->size - mem_size;
 					mem_chunk_leftover->numa_id = mem_chunk_max->numa_id;
+					mem_chunk_leftover->zeroed = mem_chunk_max->zeroed;
 					add_free_mem_chunk(mem_chunk_leftover);
 				}
 			}
@@ -2187,6 +2542,11 @@ static int __smp_ihk_os_assign_mem(ihk_os_t ihk_os, struct smp_os_data *os,
 		list_del(&os_mem_chunk_tba_iter->list);
 		os_mem_chunk = os_mem_chunk_tba_iter;
 
+		/* Clear what was the free chunk structure */
+		if (os_mem_chunk->zeroed) {
+			memset(phys_to_virt(os_mem_chunk->addr), 0,
+			       sizeof(struct chunk));
+		}
 
 		/* Insert the chunk in physical address ascending order */
 		os_mem_chunk_next = NULL;
@@ -2240,6 +2600,7 @@ out:
 		mem_chunk_leftover->addr = os_mem_chunk->addr;
 		mem_chunk_leftover->size = os_mem_chunk->size;
 		mem_chunk_leftover->numa_id = os_mem_chunk->numa_id;
+		mem_chunk_leftover->zeroed = os_mem_chunk->zeroed;
 
 		add_free_mem_chunk(mem_chunk_leftover);
 		merge_mem_chunks(&ihk_mem_free_chunks);
@@ -2257,6 +2618,7 @@ static int smp_ihk_os_assign_mem(ihk_os_t ihk_os, void *priv, unsigned long arg)
 	struct ihk_mem_req req;
 	size_t *req_sizes = NULL;
 	int *req_numa_ids = NULL;
+	u64 start;
 
 	spin_lock_irqsave(&os->lock, flags);
 	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
@@ -2302,14 +2664,19 @@ static int smp_ihk_os_assign_mem(ihk_os_t ihk_os, void *priv, unsigned long arg)
 		goto out;
 	}
 
+	ihk_smp_scrub_stop();
 	for (i = 0; i < req.num_chunks; i++) {
+		start = ktime_to_ns(ktime_get());
 		ret = __smp_ihk_os_assign_mem(ihk_os, os, req_sizes[i],
 				req_numa_ids[i]);
+		trace_ihk_smp_os_assign_mem(req_numa_ids[i], req_sizes[i], ret,
+				ktime_to_ns(ktime_get()) - start);
 		if (ret != 0) {
 			printk("IHK-SMP: os_assign_mem: error: assigning memory chunk\n");
-			goto out;
+			break;
 		}
 	}
+	ihk_smp_scrub_start();
 
 out:
 	kfree(req_sizes);
@@ -2357,6 +2724,7 @@ static int smp_ihk_os_release_mem(ihk_os_t ihk_os, void *priv, unsigned long arg
 	ARCHDRV_CHKANDJUMP(ret_internal != 0, "copy_from_user failed", -EFAULT);
 
 	/* Drop specified memory chunks */
+	ihk_smp_scrub_stop();
 	for (i = 0; i < req.num_chunks; i++) {
 		list_for_each_entry_safe(os_mem_chunk, next_chunk,
 								 &ihk_mem_used_chunks, list) {
@@ -2373,6 +2741,7 @@ static int smp_ihk_os_release_mem(ihk_os_t ihk_os, void *priv, unsigned long arg
 			mem_chunk->addr = os_mem_chunk->addr;
 			mem_chunk->size = os_mem_chunk->size;
 			mem_chunk->numa_id = os_mem_chunk->numa_id;
+			mem_chunk->zeroed = 0;
 			INIT_LIST_HEAD(&mem_chunk->chain);
 			
 			printk(KERN_INFO "IHK-SMP: chunk 0x%lx - 0x%lx"
@@ -2386,6 +2755,7 @@ static int smp_ihk_os_release_mem(ihk_os_t ihk_os, void *priv, unsigned long arg
 			ret = 0;
 		}
 	}
+	ihk_smp_scrub_start();
 
  fn_exit:
 	kfree(req_sizes);
@@ -2703,8 +3073,16 @@ static int __smp_ihk_free_mem_from_list(struct list_head *list)
 			size_t order_size;
 			struct page *page = virt_to_page(va);
 
-			if (!PageCompound(page) || !PageHead(page)) {
-				printk(KERN_ERR "%s: WARNING: page is not compound or not head, skipping..\n",
+			/* Taken by the contiguous backend */
+			if (!PageCompound(page)) {
+				free_page(va);
+				size_left -= PAGE_SIZE;
+				va += PAGE_SIZE;
+				continue;
+			}
+
+			if (!PageHead(page)) {
+				printk(KERN_ERR "%s: WARNING: page is not head, skipping..\n",
 					__FUNCTION__);
 				size_left -= PAGE_SIZE;
 				va += PAGE_SIZE;
@@ -2763,8 +3141,16 @@ static int __smp_ihk_free_mem_from_rbtree(struct rb_root *root)
 			size_t order_size;
 			struct page *page = virt_to_page(va);
 
-			if (!PageCompound(page) || !PageHead(page)) {
-				printk(KERN_ERR "%s: WARNING: page is not compound or not head, skipping..\n",
+			/* Taken by the contiguous backend */
+			if (!PageCompound(page)) {
+				free_page(va);
+				size_left -= PAGE_SIZE;
+				va += PAGE_SIZE;
+				continue;
+			}
+
+			if (!PageHead(page)) {
+				printk(KERN_ERR "%s: WARNING: page is not head, skipping..\n",
 					__FUNCTION__);
 				size_left -= PAGE_SIZE;
 				va += PAGE_SIZE;
@@ -2810,6 +3196,7 @@ void __mem_chunk_insert(struct rb_root *root, struct chunk *chunk)
 			struct rb_node *right;
 			/* Extend it to the right */
 			ichunk->size += chunk->size;
+			ichunk->zeroed = 0;
 
 			/* Have the right chunk of ichunk and ichunk become contigous? */
 			right = rb_next(*iter);
@@ -2832,6 +3219,7 @@ void __mem_chunk_insert(struct rb_root *root, struct chunk *chunk)
 			/* Extend it to the left */
 			ichunk->addr -= chunk->size;
 			ichunk->size += chunk->size;
+			ichunk->zeroed = 0;
 
 			/* Have the left chunk of ichunk and ichunk become contigous? */
 			left = rb_prev(*iter);
@@ -2898,6 +3286,47 @@ static void sort_pagelists(struct zone *zone)
 #define RESERVE_MEM_FAILED_ATTEMPTS 1
 //#define USE_TRY_TO_FREE_PAGES
 
+/*
+ * Steps of a reservation that are not specific to a NUMA node, done once
+ * per request before the nodes are reserved.
+ */
+static void __ihk_smp_reserve_mem_prepare(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+	void (*__drain_all_pages)(struct zone *) = (void (*)(struct zone *))
+			kallsyms_lookup_name("drain_all_pages");
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) */
+	void (*__drain_all_pages)(void) = (void (*)(void))
+			kallsyms_lookup_name("drain_all_pages");
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) */
+
+	if (__drain_all_pages) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+		__drain_all_pages(NULL);
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) */
+		__drain_all_pages();
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) */
+	}
+
+	/* Shrink slab/slub caches */
+	{
+		struct mutex *slab_mutexp =
+			(struct mutex *)kallsyms_lookup_name("slab_mutex");
+		struct list_head *slab_cachesp =
+			(struct list_head *)kallsyms_lookup_name("slab_caches");
+		if (slab_mutexp && slab_cachesp) {
+			struct kmem_cache *s;
+
+			dprintk("%s: shrinking slab caches\n", __FUNCTION__);
+			mutex_lock(slab_mutexp);
+			list_for_each_entry(s, slab_cachesp, list) {
+				kmem_cache_shrink(s);
+			}
+			mutex_unlock(slab_mutexp);
+		}
+	}
+}
+
 static int __ihk_smp_reserve_mem(size_t ihk_mem, int numa_id,
 				 int min_chunk_size,
 				 int max_size_ratio_all,
@@ -2978,32 +3407,6 @@ static int __ihk_smp_reserve_mem(size_t ihk_mem, int numa_id,
 		(bool *)kallsyms_lookup_name("movable_node_enabled");
 #endif
 
-	if (__drain_all_pages) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
-		__drain_all_pages(NULL);
-#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) */
-		__drain_all_pages();
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0) */
-	}
-
-	/* Shrink slab/slub caches */
-	{
-		struct mutex *slab_mutexp =
-			(struct mutex *)kallsyms_lookup_name("slab_mutex");
-		struct list_head *slab_cachesp =
-			(struct list_head *)kallsyms_lookup_name("slab_caches");
-		if (slab_mutexp && slab_cachesp) {
-			struct kmem_cache *s;
-
-			dprintk("%s: shrinking slab caches\n", __FUNCTION__);
-			mutex_lock(slab_mutexp);
-			list_for_each_entry(s, slab_cachesp, list) {
-				kmem_cache_shrink(s);
-			}
-			mutex_unlock(slab_mutexp);
-		}
-	}
-
 	/* Sort page list (from Intel XPPSL patch) */
 	{
 		struct zone *zone;
@@ -3131,7 +3534,10 @@ retry:
 			if (order > order_limit) {
 				--order;
 				failed_free_attempts = 0;
-				dprintk("%s: order decreased to %d\n", __FUNCTION__, order);
+				pr_info("IHK-SMP: NUMA %d: %lu MiB taken in %lu s, "
+					"order decreased to %d\n",
+					numa_id, allocated >> 20,
+					get_seconds() - res_start, order);
 
 				/* Do not spend more than timeout secs on
 				 * reservation
@@ -3164,6 +3570,7 @@ pre_out:
 		p->addr = virt_to_phys(p);
 		p->size = PAGE_SIZE << order;
 		p->numa_id = numa_id;
+		p->zeroed = 0;
 		INIT_LIST_HEAD(&p->chain);
 
 		__mem_chunk_insert(&tmp_chunks, p);
@@ -3225,6 +3632,7 @@ pre_out:
 				leftover->addr = virt_to_phys(leftover);
 				leftover->size = p->addr + max - leftover->addr;
 				leftover->numa_id = p->numa_id;
+				leftover->zeroed = 0;
 				__mem_chunk_insert(&tmp_chunks, leftover);
 
 				/* Update original chunk */
@@ -3239,6 +3647,7 @@ pre_out:
 		}
 
 		/* Insert the chunk in physical address ascending order */
+		mutex_lock(&ihk_mem_reserve_lock);
 		list_for_each_entry(q, &ihk_mem_free_chunks, chain) {
 			if (p->addr < q->addr) {
 				break;
@@ -3251,6 +3660,7 @@ pre_out:
 		else {
 			list_add_tail(&p->chain, &q->chain);
 		}
+		mutex_unlock(&ihk_mem_reserve_lock);
 
 		printk(KERN_INFO "IHK-SMP: chunk 0x%lx - 0x%lx"
 				" (len: %lu) @ NUMA node: %d is available\n",
@@ -3258,8 +3668,8 @@ pre_out:
 		allocated += max;
 	}
 
-	pr_info("%s: want: %ld, allocated: %ld\n",
-	       __func__, want, allocated);
+	pr_info("%s: NUMA %d: want: %ld, allocated: %ld, %lu s\n",
+	       __func__, numa_id, want, allocated, get_seconds() - res_start);
 
 
 	ret = 0;
@@ -3271,6 +3681,245 @@ out:
 	return ret;
 }
 
+/* Free memory of a node in bytes */
+static size_t __ihk_smp_node_free_mem(int numa_id)
+{
+	pg_data_t *pgdat = NODE_DATA(numa_id);
+	size_t available = 0;
+	int z;
+
+	for (z = 0; z < MAX_NR_ZONES; z++) {
+		available += zone_page_state(&pgdat->node_zones[z],
+					     NR_FREE_PAGES) << PAGE_SHIFT;
+	}
+
+	return available;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+/*
+ * Contiguous backend: claim ranges of movable or CMA pageblocks of a node
+ * in one go with alloc_contig_range(), which migrates the pages in use.
+ * A CMA area set up at boot (cma=) is such a range too. The pages are not
+ * compound, the release paths free them one by one.
+ */
+#define IHK_SMP_CONTIG_CHUNK_SIZE (1UL << 30)
+
+/* Like pfn_range_valid_contig() of recent kernels */
+static int __ihk_smp_contig_range_ok(struct zone *zone,
+				     unsigned long start_pfn,
+				     unsigned long nr_pages, int *migratetype)
+{
+	unsigned long pfn;
+	int mt = -1;
+
+	for (pfn = start_pfn; pfn < start_pfn + nr_pages; pfn++) {
+		struct page *page;
+
+		if (!pfn_valid(pfn))
+			return 0;
+
+		page = pfn_to_page(pfn);
+		if (page_zone(page) != zone || PageReserved(page) ||
+		    PageHuge(page))
+			return 0;
+
+		/* One migratetype, restored after the isolation */
+		if (pfn == start_pfn || !(pfn & (pageblock_nr_pages - 1))) {
+			int block_mt = get_pageblock_migratetype(page);
+
+			if (block_mt != MIGRATE_MOVABLE &&
+			    !is_migrate_cma(block_mt))
+				return 0;
+
+			if (mt != -1 && block_mt != mt)
+				return 0;
+
+			mt = block_mt;
+		}
+	}
+
+	*migratetype = mt;
+	return 1;
+}
+
+/* Does [start, end) overlap a chunk of root? */
+static int __ihk_smp_contig_taken(struct rb_root *root,
+				  unsigned long start, unsigned long end)
+{
+	struct rb_node *node = root->rb_node;
+
+	while (node) {
+		struct chunk *chunk = container_of(node, struct chunk, node);
+
+		if (end <= chunk->addr)
+			node = node->rb_left;
+		else if (start >= chunk->addr + chunk->size)
+			node = node->rb_right;
+		else
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reserve up to ihk_mem bytes of numa_id, halving the size of the ranges
+ * tried down to MAX_ORDER_NR_PAGES. What is reserved is added to the free
+ * chunks and returned in reserved, the caller takes the rest from the
+ * buddy allocator.
+ */
+static int __ihk_smp_reserve_mem_contig(size_t ihk_mem, int numa_id,
+					int max_size_ratio_all,
+					int timeout, size_t *reserved)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	int (*__alloc_contig_range)(unsigned long, unsigned long, unsigned int,
+				    gfp_t) =
+		(int (*)(unsigned long, unsigned long, unsigned int, gfp_t))
+		kallsyms_lookup_name("alloc_contig_range");
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) */
+	int (*__alloc_contig_range)(unsigned long, unsigned long, unsigned int) =
+		(int (*)(unsigned long, unsigned long, unsigned int))
+		kallsyms_lookup_name("alloc_contig_range");
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) */
+	unsigned long nr_pages = IHK_SMP_CONTIG_CHUNK_SIZE >> PAGE_SHIFT;
+	unsigned long res_start = get_seconds();
+	struct rb_root tmp_chunks = RB_ROOT;
+	struct rb_node *node;
+	size_t want = ihk_mem;
+	size_t allocated = 0;
+	size_t available;
+	pg_data_t *pgdat;
+	struct chunk *p;
+	int z;
+
+	*reserved = 0;
+
+	if (!__alloc_contig_range) {
+		pr_info("IHK-SMP: alloc_contig_range() not available\n");
+		return -EOPNOTSUPP;
+	}
+
+	if (!node_online(numa_id)) {
+		return -ENODEV;
+	}
+
+	pgdat = NODE_DATA(numa_id);
+	available = __ihk_smp_node_free_mem(numa_id);
+
+	/* Same limits as for the buddy allocator */
+	if (want == IHK_SMP_MEM_ALL) {
+		want = available * max_size_ratio_all / 100;
+		if (numa_id == 0 && max_size_ratio_all > 95) {
+			want = available * 95 / 100;
+		}
+	}
+	want = PAGE_ALIGN(want);
+
+	while (allocated < want && nr_pages >= MAX_ORDER_NR_PAGES) {
+		for (z = 0; z < MAX_NR_ZONES && allocated < want; z++) {
+			struct zone *zone = &pgdat->node_zones[z];
+			unsigned long end_pfn;
+			unsigned long pfn;
+
+			if (!populated_zone(zone)) {
+				continue;
+			}
+
+			end_pfn = zone->zone_start_pfn + zone->spanned_pages;
+			for (pfn = ALIGN(zone->zone_start_pfn, nr_pages);
+			     pfn + nr_pages <= end_pfn && allocated < want;
+			     pfn += nr_pages) {
+				unsigned long nr = min_t(unsigned long, nr_pages,
+						(want - allocated) >> PAGE_SHIFT);
+				int mt;
+
+				if (get_seconds() - res_start >= timeout) {
+					pr_info("IHK-SMP: NUMA %d: contiguous "
+						"reservation timed out\n",
+						numa_id);
+					goto move;
+				}
+
+				if (__ihk_smp_contig_taken(&tmp_chunks,
+							   PFN_PHYS(pfn),
+							   PFN_PHYS(pfn + nr)) ||
+				    !__ihk_smp_contig_range_ok(zone, pfn, nr,
+							       &mt)) {
+					continue;
+				}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+				if (__alloc_contig_range(pfn, pfn + nr, mt,
+							 GFP_KERNEL)) {
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) */
+				if (__alloc_contig_range(pfn, pfn + nr, mt)) {
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0) */
+					cond_resched();
+					continue;
+				}
+
+				p = (struct chunk *)phys_to_virt(PFN_PHYS(pfn));
+				p->addr = PFN_PHYS(pfn);
+				p->size = nr << PAGE_SHIFT;
+				p->numa_id = numa_id;
+				p->zeroed = 0;
+				INIT_LIST_HEAD(&p->chain);
+				__mem_chunk_insert(&tmp_chunks, p);
+
+				allocated += nr << PAGE_SHIFT;
+				cond_resched();
+			}
+		}
+
+		if (allocated < want) {
+			nr_pages >>= 1;
+			pr_info("IHK-SMP: NUMA %d: %lu MiB taken in %lu s, "
+				"range size decreased to %lu KiB\n",
+				numa_id, allocated >> 20,
+				get_seconds() - res_start,
+				nr_pages << (PAGE_SHIFT - 10));
+		}
+	}
+
+move:
+	while ((node = rb_first(&tmp_chunks))) {
+		p = container_of(node, struct chunk, node);
+		rb_erase(node, &tmp_chunks);
+
+		/* Merged to the left, move chunk structure to the front */
+		if ((void *)p != phys_to_virt(p->addr)) {
+			struct chunk *__p = (struct chunk *)phys_to_virt(p->addr);
+			*__p = *p;
+			p = __p;
+		}
+
+		mutex_lock(&ihk_mem_reserve_lock);
+		add_free_mem_chunk(p);
+		mutex_unlock(&ihk_mem_reserve_lock);
+
+		printk(KERN_INFO "IHK-SMP: chunk 0x%lx - 0x%lx"
+				" (len: %lu) @ NUMA node: %d is available\n",
+				p->addr, p->addr + p->size, p->size, p->numa_id);
+		*reserved += p->size;
+	}
+
+	pr_info("%s: NUMA %d: want: %ld, allocated: %ld, %lu s\n",
+		__func__, numa_id, want, allocated, get_seconds() - res_start);
+
+	return 0;
+}
+#else /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0) */
+static int __ihk_smp_reserve_mem_contig(size_t ihk_mem, int numa_id,
+					int max_size_ratio_all,
+					int timeout, size_t *reserved)
+{
+	*reserved = 0;
+	return -EOPNOTSUPP;
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0) */
+
 static void __ihk_smp_release_chunk(struct chunk *mem_chunk)
 {
 	unsigned long size_left;
@@ -3681,6 +4330,7 @@ err_before_offline:
 	}
 
 out:
+	trace_ihk_smp_reserve_cpu(req.num_cpus, ret);
 	kfree(req_cpus);
 	return ret;
 }
@@ -3801,6 +4451,7 @@ err:
 	}
 
 out:
+	trace_ihk_smp_release_cpu(req.num_cpus, ret);
 	kfree(req_cpus);
 	return ret;
 }
@@ -3869,14 +4520,104 @@ out:
 	return 0;
 }
 
+/* Reservation of the chunks of one NUMA node of a request */
+struct ihk_smp_reserve_node {
+	struct ihk_mem_req *req;
+	size_t *sizes;
+	int *numa_ids;
+	int numa_id;
+	int ret;
+	struct task_struct *task;
+	struct completion done;
+};
+
+static int __ihk_smp_reserve_node(struct ihk_smp_reserve_node *node)
+{
+	unsigned long res_start = get_seconds();
+	int i, nr = 0, ret = 0;
+	int ratio;
+	size_t size;
+	u64 start;
+
+	for (i = 0; i < node->req->num_chunks; i++) {
+		if (node->numa_ids[i] != node->numa_id) {
+			continue;
+		}
+
+		start = ktime_to_ns(ktime_get());
+		size = node->sizes[i];
+		ratio = node->req->max_size_ratio_all;
+		if (node->req->backend == IHK_RESERVE_MEM_BACKEND_CONTIG) {
+			size_t reserved, free, limit;
+
+			/* The buddy allocator takes what is left */
+			__ihk_smp_reserve_mem_contig(size, node->numa_id,
+					ratio, node->req->timeout, &reserved);
+			if (size != IHK_SMP_MEM_ALL) {
+				size -= min(size, reserved);
+			}
+			else if (reserved) {
+				/*
+				 * Keep both within the ratio of what was free
+				 * before, i.e. lower the ratio of the buddy
+				 * allocator by what has been taken already
+				 */
+				free = __ihk_smp_node_free_mem(node->numa_id);
+				limit = (free + reserved) / 100 * ratio;
+				ratio = 0;
+				if (free && limit > reserved) {
+					ratio = min_t(size_t, 100,
+						(limit - reserved) * 100 / free);
+				}
+				pr_info("IHK-SMP: NUMA %d: %lu MiB contiguous, "
+					"up to %d%% of the rest from the buddy "
+					"allocator\n", node->numa_id,
+					reserved >> 20, ratio);
+				if (!ratio) {
+					size = 0;
+				}
+			}
+		}
+
+		ret = size ? __ihk_smp_reserve_mem(size, node->numa_id,
+					node->req->min_chunk_size, ratio,
+					node->req->timeout) : 0;
+		trace_ihk_smp_reserve_mem(node->numa_id, node->sizes[i], ret,
+				ktime_to_ns(ktime_get()) - start);
+		if (ret != 0) {
+			printk("IHK-SMP: reserve_mem: error: reserving memory "
+			       "on NUMA %d\n", node->numa_id);
+			break;
+		}
+		nr++;
+	}
+
+	pr_info("IHK-SMP: NUMA %d: %d chunk(s) reserved in %lu s\n",
+		node->numa_id, nr, get_seconds() - res_start);
+
+	return ret;
+}
+
+static int __ihk_smp_reserve_node_thread(void *arg)
+{
+	struct ihk_smp_reserve_node *node = arg;
+
+	node->ret = __ihk_smp_reserve_node(node);
+	complete(&node->done);
+
+	return 0;
+}
+
 static int smp_ihk_reserve_mem(ihk_device_t ihk_dev, unsigned long arg)
 {
 	size_t mem_size;
 	int numa_id;
-	int ret = 0, i;
+	int ret = 0, i, j;
 	struct ihk_mem_req req;
 	size_t *req_sizes = NULL;
 	int *req_numa_ids = NULL;
+	struct ihk_smp_reserve_node *nodes = NULL;
+	int nr_nodes = 0;
 
 	if (copy_from_user(&req, (void *)arg, sizeof(req))) {
 		printk("%s: error: copying request\n", __FUNCTION__);
@@ -3930,22 +4671,74 @@ static int smp_ihk_reserve_mem(ihk_device_t ihk_dev, unsigned long arg)
 		goto out;
 	}
 
-	/* Do the reservation */
+	/* One reservation per NUMA node, in the order of the request */
+	nodes = kcalloc(req.num_chunks, sizeof(*nodes), GFP_KERNEL);
+	if (!nodes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < req.num_chunks; i++) {
-		mem_size = req_sizes[i];
-		numa_id = req_numa_ids[i];
+		for (j = 0; j < nr_nodes; j++) {
+			if (nodes[j].numa_id == req_numa_ids[i]) {
+				break;
+			}
+		}
+		if (j < nr_nodes) {
+			continue;
+		}
 
-		ret = __ihk_smp_reserve_mem(mem_size, numa_id,
-					    req.min_chunk_size,
-					    req.max_size_ratio_all,
-					    req.timeout);
-		if (ret != 0) {
-			printk("IHK-SMP: reserve_mem: error: reserving memory\n");
-			break;
+		nodes[nr_nodes].req = &req;
+		nodes[nr_nodes].sizes = req_sizes;
+		nodes[nr_nodes].numa_ids = req_numa_ids;
+		nodes[nr_nodes].numa_id = req_numa_ids[i];
+		init_completion(&nodes[nr_nodes].done);
+		nr_nodes++;
+	}
+
+	/* Freshly reserved chunks are zeroed afterwards */
+	ihk_smp_scrub_stop();
+	__ihk_smp_reserve_mem_prepare();
+
+	/* Do the reservation, nodes in parallel */
+	for (j = 0; nr_nodes > 1 && j < nr_nodes; j++) {
+		numa_id = nodes[j].numa_id;
+		/* Memory-only nodes have no CPUs to run on, reserve inline */
+		if (!node_online(numa_id) ||
+		    cpumask_empty(cpumask_of_node(numa_id))) {
+			continue;
+		}
+
+		nodes[j].task = kthread_create_on_node(
+				__ihk_smp_reserve_node_thread, &nodes[j],
+				numa_id, "ihk_reserve/%d", numa_id);
+		if (IS_ERR(nodes[j].task)) {
+			nodes[j].task = NULL;
+			continue;
+		}
+
+		set_cpus_allowed_ptr(nodes[j].task, cpumask_of_node(numa_id));
+		wake_up_process(nodes[j].task);
+	}
+
+	for (j = 0; j < nr_nodes; j++) {
+		if (!nodes[j].task) {
+			nodes[j].ret = __ihk_smp_reserve_node(&nodes[j]);
 		}
 	}
 
+	for (j = 0; j < nr_nodes; j++) {
+		if (nodes[j].task) {
+			wait_for_completion(&nodes[j].done);
+		}
+		if (nodes[j].ret && !ret) {
+			ret = nodes[j].ret;
+		}
+	}
+	ihk_smp_scrub_start();
+
 out:
+	kfree(nodes);
 	kfree(req_sizes);
 	kfree(req_numa_ids);
 	return ret;
@@ -3957,6 +4750,7 @@ static int smp_ihk_release_mem(ihk_device_t ihk_dev, unsigned long arg)
 	struct ihk_mem_req req;
 	size_t *req_sizes = NULL;
 	int *req_numa_ids = NULL;
+	u64 start;
 
 	ret_internal = copy_from_user(&req, (void *)arg, sizeof(req));
 	ARCHDRV_CHKANDJUMP(ret_internal != 0, "copy_from_user failed", -EFAULT);
@@ -3979,12 +4773,20 @@ static int smp_ihk_release_mem(ihk_device_t ihk_dev, unsigned long arg)
 	ARCHDRV_CHKANDJUMP(ret_internal != 0, "copy_from_user failed", -EFAULT);
 
 	/* Do release */
+	ihk_smp_scrub_stop();
 	for (i = 0; i < req.num_chunks; i++) {
+		start = ktime_to_ns(ktime_get());
 		ret_internal = __ihk_smp_release_mem(req_sizes[i],
 				req_numa_ids[i]);
-		ARCHDRV_CHKANDJUMP(ret_internal != 0,
-				"__ihk_smp_release_mem failed", -EINVAL);
+		trace_ihk_smp_release_mem(req_numa_ids[i], req_sizes[i],
+				ret_internal, ktime_to_ns(ktime_get()) - start);
+		if (ret_internal != 0) {
+			printk(KERN_ERR "%s: __ihk_smp_release_mem failed\n", __func__);
+			ret = -EINVAL;
+			break;
+		}
 	}
+	ihk_smp_scrub_start();
 
  fn_fail:
 	kfree(req_sizes);
@@ -4045,6 +4847,7 @@ static int smp_ihk_release_mem_partially(ihk_device_t ihk_dev,
 	}
 
 	/* Do release */
+	ihk_smp_scrub_stop();
 	for (i = 0; i < req.num_chunks; i++) {
 		if (req_sizes[i] > 0) {
 			ret = __ihk_smp_release_mem_partially(req_sizes[i],
@@ -4053,10 +4856,14 @@ static int smp_ihk_release_mem_partially(ihk_device_t ihk_dev,
 				pr_err("%s: __ihk_smp_release_mem_partially returned %d\n",
 				       __func__, ret);
 				ret = -EINVAL;
-				goto out;
+				break;
 			}
 		}
 	}
+	ihk_smp_scrub_start();
+	if (ret) {
+		goto out;
+	}
 
 	ret = 0;
 out:
@@ -4530,6 +5337,7 @@ static int smp_ihk_exit(ihk_device_t ihk_dev, void *priv)
 	}
 
 	/* Free memory */
+	ihk_smp_scrub_exit();
 	__smp_ihk_free_mem_from_list(&ihk_mem_free_chunks);
 
 	free_info();
@@ -135,6 +135,7 @@ struct ihk_os_mem_chunk {
 	size_t size;
 	ihk_os_t os;
 	int numa_id;
+	int zeroed; /* Zeroed when assigned, see ihk_smp_scrub_start() */
 };
 
 extern struct ihk_smp_cpu ihk_smp_cpus[SMP_MAX_CPUS];
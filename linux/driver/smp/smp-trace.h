@@ -0,0 +1,74 @@
+/**
+ * \file smp-trace.h
+ * \brief IHK-SMP: Tracepoints of the reservation and assignment of
+ *        CPUs and memory, created in smp-driver.c
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ihk_smp
+
+#if !defined(_IHK_SMP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IHK_SMP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* One chunk, size is what was asked for, -1 for all */
+DECLARE_EVENT_CLASS(ihk_smp_mem,
+	TP_PROTO(int numa_id, unsigned long size, int ret, u64 ns),
+	TP_ARGS(numa_id, size, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, numa_id)
+		__field(unsigned long, size)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->numa_id = numa_id;
+		__entry->size = size;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("numa_id=%d size=0x%lx ret=%d ns=%llu",
+	          __entry->numa_id, __entry->size, __entry->ret, __entry->ns)
+);
+
+#define IHK_SMP_TRACE_MEM_EVENT(name) \
+	DEFINE_EVENT(ihk_smp_mem, name, \
+		TP_PROTO(int numa_id, unsigned long size, int ret, u64 ns), \
+		TP_ARGS(numa_id, size, ret, ns))
+
+IHK_SMP_TRACE_MEM_EVENT(ihk_smp_reserve_mem);
+IHK_SMP_TRACE_MEM_EVENT(ihk_smp_release_mem);
+IHK_SMP_TRACE_MEM_EVENT(ihk_smp_os_assign_mem);
+
+DECLARE_EVENT_CLASS(ihk_smp_cpus,
+	TP_PROTO(int num_cpus, int ret),
+	TP_ARGS(num_cpus, ret),
+	TP_STRUCT__entry(
+		__field(int, num_cpus)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->num_cpus = num_cpus;
+		__entry->ret = ret;
+	),
+	TP_printk("num_cpus=%d ret=%d", __entry->num_cpus, __entry->ret)
+);
+
+#define IHK_SMP_TRACE_CPUS_EVENT(name) \
+	DEFINE_EVENT(ihk_smp_cpus, name, \
+		TP_PROTO(int num_cpus, int ret), \
+		TP_ARGS(num_cpus, ret))
+
+IHK_SMP_TRACE_CPUS_EVENT(ihk_smp_reserve_cpu);
+IHK_SMP_TRACE_CPUS_EVENT(ihk_smp_release_cpu);
+IHK_SMP_TRACE_CPUS_EVENT(ihk_smp_os_assign_cpu);
+IHK_SMP_TRACE_CPUS_EVENT(ihk_smp_os_release_cpu);
+
+#endif /* _IHK_SMP_TRACE_H */
+
+/* Out of tree, look for this file in the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE smp-trace
+#include <trace/define_trace.h>
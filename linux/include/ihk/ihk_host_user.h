@@ -67,6 +67,9 @@
 #define IHK_OS_DETECT_HUNGUP          0x112a36
 #define IHK_OS_GET_BUILDID            0x112a37
 #define IHK_OS_GET_NUM_CPUS           0x112a38
+#define IHK_OS_SET_IKC_POLL           0x112a39
+#define IHK_OS_SET_IKC_TRACE          0x112a3a
+#define IHK_OS_GET_IKC_TRACE          0x112a3b
 
 #define IHK_OS_DEBUG_START            0x122a00
 #define IHK_OS_DEBUG_END              0x122aff
@@ -127,6 +130,18 @@ struct ihk_cpu_req {
 	int num_cpus;
 };
 
+#ifndef IHK_RESERVE_MEM_BACKEND_DEFINED
+#define IHK_RESERVE_MEM_BACKEND_DEFINED
+enum ihk_reserve_mem_backend {
+	/* Gather pages of decreasing orders from the buddy allocator */
+	IHK_RESERVE_MEM_BACKEND_BUDDY = 0,
+	/* Claim physically contiguous ranges of movable or CMA
+	 * pageblocks, the rest is taken from the buddy allocator
+	 */
+	IHK_RESERVE_MEM_BACKEND_CONTIG,
+};
+#endif
+
 struct ihk_mem_req {
 	size_t *sizes;
 	int *numa_ids;
@@ -147,6 +162,9 @@ struct ihk_mem_req {
 	 * than this seconds for the current order
 	 */
 	int timeout;
+
+	/* enum ihk_reserve_mem_backend */
+	int backend;
 };
 
 struct ihk_ikc_req {
@@ -155,6 +173,12 @@ struct ihk_ikc_req {
 	int num_cpus;
 };
 
+struct ihk_ikc_trace_req {
+	void *entries;            /* NULL to query the number of entries */
+	int num;                  /* IN: capacity, OUT: entries copied */
+	unsigned long ns_per_tsc; /* Of the LWK, ns per 1000 TSC */
+};
+
 /* Used by IHK-core and ihklib */
 struct ihk_os_ioctl_eventfd_desc {
 	int fd;
@@ -22,6 +22,18 @@ enum ihk_os_eventfd_type {
 };
 #endif
 
+#ifndef IHK_RESERVE_MEM_BACKEND_DEFINED
+#define IHK_RESERVE_MEM_BACKEND_DEFINED
+enum ihk_reserve_mem_backend {
+	/* Gather pages of decreasing orders from the buddy allocator */
+	IHK_RESERVE_MEM_BACKEND_BUDDY = 0,
+	/* Claim physically contiguous ranges of movable or CMA
+	 * pageblocks, the rest is taken from the buddy allocator
+	 */
+	IHK_RESERVE_MEM_BACKEND_CONTIG,
+};
+#endif
+
 struct ihk_mem_chunk {
 	unsigned long size;
 	int numa_node_number;
@@ -32,6 +44,26 @@ struct ihk_ikc_cpu_map {
 	int dst_cpu; /* Linux CPU as IKC destination */
 };
 
+/* Packet trace entry, see ikc/include/ikc/trace.h */
+enum ihk_ikc_trace_event {
+	IHK_IKC_TRACE_ENQUEUE = 1,
+	IHK_IKC_TRACE_NOTIFY,
+	IHK_IKC_TRACE_IRQ,
+	IHK_IKC_TRACE_DEQUEUE,
+	IHK_IKC_TRACE_HANDLED,
+};
+
+struct ihk_ikc_trace_entry {
+	unsigned long tsc;
+	unsigned long off;     /* In the queue */
+	unsigned int channel;  /* Of the reader of the queue */
+	unsigned int msg;      /* First word after the packet header */
+	unsigned short cpu;
+	unsigned char event;
+	unsigned char side;    /* 0: Linux, 1: LWK */
+	unsigned int pad;
+};
+
 enum ihklib_os_status {
 	IHK_STATUS_INACTIVE,
 	IHK_STATUS_BOOTING,
@@ -69,6 +101,7 @@ enum ihk_reserve_mem_conf_keys {
 	IHK_RESERVE_MEM_MIN_CHUNK_SIZE,
 	IHK_RESERVE_MEM_MAX_SIZE_RATIO_ALL,
 	IHK_RESERVE_MEM_TIMEOUT,
+	IHK_RESERVE_MEM_BACKEND,
 };
 
 extern int loglevel;
@@ -93,6 +126,11 @@ int ihk_os_query_cpu(int index, int* cpus, int _num_cpus);
 int ihk_os_release_cpu(int index, int* cpus, int num_cpus);
 int ihk_os_set_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus);
 int ihk_os_get_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus);
+int ihk_os_set_ikc_poll(int index, unsigned long usec);
+int ihk_os_set_ikc_trace(int index, unsigned long entries);
+int ihk_os_get_num_ikc_trace_entries(int index);
+int ihk_os_get_ikc_trace(int index, struct ihk_ikc_trace_entry *entries,
+			 int num_entries, unsigned long *ns_per_tsc);
 int ihk_os_assign_mem(int index, struct ihk_mem_chunk *mem_chunks, int num_mem_chunks);
 int ihk_os_get_num_assigned_mem_chunks(int index);
 int ihk_os_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chunks);
@@ -73,6 +73,9 @@ struct ihklib_reserve_mem_conf {
 	 * than this seconds for the current order
 	 */
 	int timeout;
+
+	/* enum ihk_reserve_mem_backend */
+	int backend;
 };
 
 extern struct ihklib_reserve_mem_conf reserve_mem_conf;
@@ -279,6 +279,7 @@ static int do_reserve(int fd)
 		req_mem.max_size_ratio_all =
 			reserve_mem_conf.max_size_ratio_all;
 		req_mem.timeout = reserve_mem_conf.timeout;
+		req_mem.backend = reserve_mem_conf.backend;
 
 		ret = ioctl(fd, IHK_DEVICE_RESERVE_MEM, &req_mem);
 		if (ret != 0) {
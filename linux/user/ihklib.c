@@ -102,6 +102,7 @@ struct ihklib_reserve_mem_conf reserve_mem_conf = {
 	.min_chunk_size = PAGE_SIZE,
 	.max_size_ratio_all = 100,
 	.timeout = 30,
+	.backend = IHK_RESERVE_MEM_BACKEND_BUDDY,
 };
 
 static int snprintf_realloc(char **str, size_t *size,
@@ -854,6 +855,13 @@ int ihk_reserve_mem_conf(int index, int key, void *value)
 	case IHK_RESERVE_MEM_TIMEOUT:
 		reserve_mem_conf.timeout = *((int *)value);
 		break;
+	case IHK_RESERVE_MEM_BACKEND:
+		if (*((int *)value) != IHK_RESERVE_MEM_BACKEND_BUDDY &&
+		    *((int *)value) != IHK_RESERVE_MEM_BACKEND_CONTIG) {
+			return -EINVAL;
+		}
+		reserve_mem_conf.backend = *((int *)value);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -928,6 +936,7 @@ int ihk_reserve_mem(int index, struct ihk_mem_chunk *mem_chunks,
 	req.min_chunk_size = reserve_mem_conf.min_chunk_size;
 	req.max_size_ratio_all = reserve_mem_conf.max_size_ratio_all;
 	req.timeout = reserve_mem_conf.timeout;
+	req.backend = reserve_mem_conf.backend;
 
 	fd = ihklib_device_open(index);
 	if (fd < 0) {
@@ -1642,6 +1651,134 @@ int ihk_os_set_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus)
 	return ret;
 }
 
+/*
+ * Busy-poll IKC reception for usec microseconds after the last packet
+ * before falling back to interrupts, 0 disables polling.
+ */
+int ihk_os_set_ikc_poll(int index, unsigned long usec)
+{
+	int ret = 0, ret_ioctl;
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret_ioctl = ioctl(fd, IHK_OS_SET_IKC_POLL, usec);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+int ihk_os_set_ikc_trace(int index, unsigned long entries)
+{
+	int ret = 0, ret_ioctl;
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret_ioctl = ioctl(fd, IHK_OS_SET_IKC_TRACE, entries);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+int ihk_os_get_num_ikc_trace_entries(int index)
+{
+	int ret = 0, ret_ioctl;
+	struct ihk_ikc_trace_req req = { 0 };
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret_ioctl = ioctl(fd, IHK_OS_GET_IKC_TRACE, &req);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+	ret = req.num;
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+static int ikc_trace_cmp(const void *a, const void *b)
+{
+	const struct ihk_ikc_trace_entry *x = a, *y = b;
+
+	return x->tsc < y->tsc ? -1 : x->tsc > y->tsc;
+}
+
+/*
+ * Get the last entries traced by Linux and the LWK, merged in TSC order.
+ * Both sides read the same counter. Returns the number of entries.
+ */
+int ihk_os_get_ikc_trace(int index, struct ihk_ikc_trace_entry *entries,
+			 int num_entries, unsigned long *ns_per_tsc)
+{
+	int ret = 0, ret_ioctl;
+	struct ihk_ikc_trace_req req = { 0 };
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+	CHKANDJUMP(!entries || num_entries < 0, -EINVAL,
+		   "invalid buffer\n");
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	req.entries = entries;
+	req.num = num_entries;
+
+	ret_ioctl = ioctl(fd, IHK_OS_GET_IKC_TRACE, &req);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+	qsort(entries, req.num, sizeof(*entries), ikc_trace_cmp);
+	if (ns_per_tsc) {
+		*ns_per_tsc = req.ns_per_tsc;
+	}
+
+	ret = req.num;
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
 int ihk_os_get_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus)
 {
 	int ret = 0, i, ret_ioctl;
@@ -69,7 +69,10 @@ static int usage(char **arg)
 	fprintf(stderr, "            cpu (cpu_list) \n");
 	fprintf(stderr, "            mem (size@NUMA) \n");
 	fprintf(stderr, "    set ikc_map (cpu_list:cpu+cpu_list:cpu+..) \n");
+	fprintf(stderr, "    set ikc_poll (usec, 0 to disable) \n");
+	fprintf(stderr, "    set ikc_trace (entries per cpu, 0 to pause) \n");
 	fprintf(stderr, "    get ikc_map\n");
+	fprintf(stderr, "    get ikc_trace\n");
 	fprintf(stderr, "    query [cpu|mem]\n");
 	fprintf(stderr, "    query_free_mem\n");
 	fprintf(stderr, "    kargs (kernel arg)\n");
@@ -177,6 +180,58 @@ static int do_get_ikc_map(int index)
 	goto fn_exit;
 }
 
+static const char *ikc_trace_events[] = {
+	[IHK_IKC_TRACE_ENQUEUE] = "enqueue",
+	[IHK_IKC_TRACE_NOTIFY] = "notify",
+	[IHK_IKC_TRACE_IRQ] = "irq",
+	[IHK_IKC_TRACE_DEQUEUE] = "dequeue",
+	[IHK_IKC_TRACE_HANDLED] = "handled",
+};
+
+/* One line per entry, time in ns since the first one */
+static int do_get_ikc_trace(int index)
+{
+	int ret = 0;
+	int i, num;
+	struct ihk_ikc_trace_entry *entries = NULL;
+	struct ihk_ikc_trace_entry *e;
+	unsigned long ns_per_tsc = 0;
+	const char *ev;
+
+	num = ihk_os_get_num_ikc_trace_entries(index);
+	IHKOSCTL_CHKANDJUMP(num < 0, "ihk_os_get_num_ikc_trace_entries", -1);
+
+	entries = calloc(num + 1, sizeof(*entries));
+	IHKOSCTL_CHKANDJUMP(!entries, "allocate trace entries", -1);
+
+	num = ihk_os_get_ikc_trace(index, entries, num, &ns_per_tsc);
+	IHKOSCTL_CHKANDJUMP(num < 0, "ihk_os_get_ikc_trace", -1);
+
+	printf("# ns_per_tsc(x1000): %lu\n", ns_per_tsc);
+	printf("# %14s %14s %5s %4s %-8s %8s %10s %10s\n",
+	       "time(ns)", "tsc", "side", "cpu", "event", "channel",
+	       "offset", "msg");
+	for (i = 0; i < num; i++) {
+		e = &entries[i];
+		ev = "?";
+		if (e->event < sizeof(ikc_trace_events) /
+		    sizeof(ikc_trace_events[0]) && ikc_trace_events[e->event]) {
+			ev = ikc_trace_events[e->event];
+		}
+
+		printf("%16lu %14lu %5s %4u %-8s %8d %10lu 0x%08x\n",
+		       (e->tsc - entries[0].tsc) * ns_per_tsc / 1000,
+		       e->tsc, e->side ? "lwk" : "linux", e->cpu, ev,
+		       (int)e->channel, e->off, e->msg);
+	}
+
+ fn_exit:
+	free(entries);
+	return ret;
+ fn_fail:
+	goto fn_exit;
+}
+
 static int do_get_buildid(int index)
 {
 	int ret = 0;
@@ -214,6 +269,8 @@ static int do_get(int index)
 		return do_get_status(index);
 	} else if (!strcmp(__argv[3], "ikc_map")) {
 		return do_get_ikc_map(index);
+	} else if (!strcmp(__argv[3], "ikc_trace")) {
+		return do_get_ikc_trace(index);
 	} else if (!strcmp(__argv[3], "buildid")) {
 		return do_get_buildid(index);
 	} else {
@@ -372,6 +429,40 @@ static int do_set_ikc_map(int fd)
 	goto fn_exit;
 }
 
+static int do_set_ikc_poll(int fd)
+{
+	int ret;
+
+	if (__argc < 5) {
+		usage(__argv);
+		return -1;
+	}
+
+	ret = ioctl(fd, IHK_OS_SET_IKC_POLL, strtoul(__argv[4], NULL, 10));
+	if (ret != 0) {
+		fprintf(stderr, "error: setting IKC poll: %s\n", __argv[4]);
+	}
+
+	return ret;
+}
+
+static int do_set_ikc_trace(int fd)
+{
+	int ret;
+
+	if (__argc < 5) {
+		usage(__argv);
+		return -1;
+	}
+
+	ret = ioctl(fd, IHK_OS_SET_IKC_TRACE, strtoul(__argv[4], NULL, 10));
+	if (ret != 0) {
+		fprintf(stderr, "error: setting IKC trace: %s\n", __argv[4]);
+	}
+
+	return ret;
+}
+
 static int do_set(int fd)
 {
 	if (__argc < 4) {
@@ -381,6 +472,10 @@ static int do_set(int fd)
 
 	if (!strcmp(__argv[3], "ikc_map")) {
 		return do_set_ikc_map(fd);
+	} else if (!strcmp(__argv[3], "ikc_poll")) {
+		return do_set_ikc_poll(fd);
+	} else if (!strcmp(__argv[3], "ikc_trace")) {
+		return do_set_ikc_trace(fd);
 	} else {
         fprintf(stderr, "Unknown target : %s\n", __argv[3]);
 		usage(__argv);
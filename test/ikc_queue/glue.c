@@ -0,0 +1,106 @@
+/**
+ * \file glue.c
+ * \brief IKC queue benchmark: IHK-Manycore services of ikc/manycore.c,
+ *        implemented by the process
+ *
+ * Threads act as CPUs, a thread picks its CPU number with
+ * ikc_bench_set_cpu(). Interrupts either do nothing, the readers poll,
+ * or signal an eventfd.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ikc/ihk.h>
+#include <ikc/master.h>
+#include "glue.h"
+
+int num_processors = 1;
+int ikc_bench_eventfd = -1;
+unsigned long ikc_bench_interrupts;
+
+static __thread int bench_cpu;
+
+void ikc_bench_set_cpu(int cpu)
+{
+	bench_cpu = cpu;
+}
+
+int ihk_mc_get_processor_id(void)
+{
+	return bench_cpu;
+}
+
+void *ihk_mc_alloc_pages(int npages, int flag)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, npages * PAGE_SIZE)) {
+		return NULL;
+	}
+	memset(p, 0, npages * PAGE_SIZE);
+
+	return p;
+}
+
+void ihk_mc_free_pages(void *p, int npages)
+{
+	free(p);
+}
+
+void *ihk_mc_allocate(int size, int flag)
+{
+	return malloc(size);
+}
+
+void ihk_mc_free(void *p)
+{
+	free(p);
+}
+
+int ihk_mc_register_interrupt_handler(int vector,
+                                      struct ihk_mc_interrupt_handler *h)
+{
+	return 0;
+}
+
+int ihk_mc_unregister_interrupt_handler(int vector,
+                                        struct ihk_mc_interrupt_handler *h)
+{
+	return 0;
+}
+
+int ihk_mc_get_vector(int type)
+{
+	return type;
+}
+
+unsigned long ihk_mc_get_ns_per_tsc(void)
+{
+	return 1000;
+}
+
+int ihk_mc_get_nr_linux_cores(void)
+{
+	return 1;
+}
+
+/* There is no master channel, channels are set up by hand */
+struct ihk_ikc_channel_desc *ihk_mc_get_master_channel(void)
+{
+	return NULL;
+}
+
+ihk_ikc_ph_t arch_master_channel_packet_handler;
+
+int ihk_ikc_send_interrupt(struct ihk_ikc_channel_desc *c)
+{
+	uint64_t one = 1;
+
+	__sync_fetch_and_add(&ikc_bench_interrupts, 1);
+	if (ikc_bench_eventfd >= 0 &&
+	    write(ikc_bench_eventfd, &one, sizeof(one)) != sizeof(one)) {
+		return -EIO;
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * \file glue.h
+ * \brief IKC queue benchmark: Knobs of glue.c
+ */
+#ifndef IKC_BENCH_GLUE_H
+#define IKC_BENCH_GLUE_H
+
+/* CPUs the IKC code sizes its per-CPU tables for */
+extern int num_processors;
+/* Signalled by interrupts if not negative */
+extern int ikc_bench_eventfd;
+/* Interrupts sent so far */
+extern unsigned long ikc_bench_interrupts;
+
+void ikc_bench_set_cpu(int cpu);
+
+#endif
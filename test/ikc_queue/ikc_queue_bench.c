@@ -0,0 +1,458 @@
+/**
+ * \file ikc_queue_bench.c
+ * \brief IKC queue benchmark: Throughput and latency of ikc/queue.c
+ *
+ * Producer threads send packets into a channel whose send queue is its own
+ * receive queue, consumer threads drain it. Each packet carries the time
+ * it was handed to the queue, consumers sample the time until they see
+ * it. Every combination of producers, consumers, packet size and path is
+ * run, the unbatched path is ihk_ikc_send()/ihk_ikc_recv(), the batched
+ * one ihk_ikc_send_batch()/ihk_ikc_recv_batch().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <ikc/ihk.h>
+#include <ikc/queue.h>
+#include "glue.h"
+
+#define MAX_THREADS     64
+#define MAX_SIZES       16
+#define MAX_SAMPLES     (1 << 16)    /* Latency samples per consumer */
+
+enum bench_path {
+	PATH_UNBATCHED = 1,
+	PATH_BATCHED = 2,
+};
+
+struct bench_pkt {
+	struct ihk_ikc_packet_header header;
+	uint64_t ns;    /* Sent at */
+};
+
+struct bench_conf {
+	int producers;
+	int consumers;
+	int sizes[MAX_SIZES];
+	int nr_sizes;
+	long count;     /* Packets per producer */
+	unsigned long qsize;
+	int batch;
+	int paths;
+	int use_eventfd;
+	int spsc;
+	int v1;
+	int pin;
+};
+
+struct bench_run {
+	struct bench_conf *conf;
+	struct ihk_ikc_channel_desc *c;
+	pthread_barrier_t barrier;
+	int pktsize;
+	int path;
+	long total;
+	long received;
+	int failed;
+};
+
+struct bench_thread {
+	struct bench_run *run;
+	pthread_t thread;
+	int cpu;
+	long count;
+	long stride;    /* Sample every stride-th packet */
+	uint64_t *samples;
+	int nr_samples;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Pin the thread to the CPU of the same number, if asked to */
+static void bench_set_cpu(struct bench_thread *t)
+{
+	cpu_set_t set;
+
+	ikc_bench_set_cpu(t->cpu);
+	if (!t->run->conf->pin) {
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		fprintf(stderr, "warning: pinning to CPU %d\n", t->cpu);
+	}
+}
+
+static void *producer(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_run *run = t->run;
+	int batch = run->path == PATH_BATCHED ? run->conf->batch : 1;
+	void *packets[batch];
+	char *buf;
+	long sent = 0;
+	int i, n, r;
+
+	bench_set_cpu(t);
+	buf = calloc(batch, run->pktsize);
+	if (!buf) {
+		run->failed = 1;
+	}
+	for (i = 0; buf && i < batch; i++) {
+		packets[i] = buf + i * run->pktsize;
+	}
+	pthread_barrier_wait(&run->barrier);
+
+	while (buf && !run->failed && sent < t->count) {
+		n = t->count - sent < batch ? t->count - sent : batch;
+		for (i = 0; i < n; i++) {
+			((struct bench_pkt *)packets[i])->ns = now_ns();
+		}
+
+		if (run->path == PATH_BATCHED) {
+			r = ihk_ikc_send_batch(run->c, packets, n, 0);
+		} else {
+			r = ihk_ikc_send(run->c, packets[0], 0);
+			r = r ? r : 1;
+		}
+
+		if (r < 0) {
+			fprintf(stderr, "error: send: %d\n", r);
+			run->failed = 1;
+			break;
+		}
+		sent += r;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void consume(struct bench_thread *t, struct bench_pkt *p)
+{
+	uint64_t lat = now_ns() - p->ns;
+
+	if (t->count++ % t->stride == 0 && t->nr_samples < MAX_SAMPLES) {
+		t->samples[t->nr_samples++] = lat;
+	}
+}
+
+static int batch_handler(struct ihk_ikc_channel_desc *c, void *p, void *arg)
+{
+	consume(arg, p);
+	ihk_ikc_release_packet(p);
+
+	return 0;
+}
+
+static void *consumer(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_run *run = t->run;
+	int opt = run->conf->use_eventfd ? 0 : IKC_POLL;
+	struct pollfd pfd = { .fd = ikc_bench_eventfd, .events = POLLIN };
+	long before;
+	uint64_t v;
+	char *buf;
+
+	bench_set_cpu(t);
+	buf = malloc(run->pktsize);
+	if (!buf) {
+		run->failed = 1;
+	}
+	pthread_barrier_wait(&run->barrier);
+
+	while (buf && !run->failed &&
+	       __atomic_load_n(&run->received, __ATOMIC_RELAXED) <
+	       run->total) {
+		before = t->count;
+		if (run->path == PATH_BATCHED) {
+			ihk_ikc_recv_batch(run->c, batch_handler, t, opt);
+		} else if (!ihk_ikc_recv(run->c, buf, opt)) {
+			consume(t, (struct bench_pkt *)buf);
+		}
+
+		if (t->count != before) {
+			__atomic_fetch_add(&run->received, t->count - before,
+			                   __ATOMIC_RELAXED);
+		} else if (run->conf->use_eventfd) {
+			/* Another consumer may have taken the event first */
+			if (poll(&pfd, 1, 1) > 0 &&
+			    read(pfd.fd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+				run->failed = 1;
+			}
+		} else {
+			cpu_pause();
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_one(struct bench_conf *conf, int nprod, int ncons,
+                     int pktsize, int path)
+{
+	struct bench_run run = {
+		.conf = conf,
+		.pktsize = pktsize,
+		.path = path,
+		.total = conf->count * nprod,
+	};
+	struct bench_thread threads[MAX_THREADS];
+	unsigned long rq = 0, sq = 0;
+	unsigned long interrupts = ikc_bench_interrupts;
+	uint64_t *lat = NULL, start, ns;
+	long nr_lat = 0;
+	int flags = 0;
+	int i, j;
+
+	if (!conf->v1) {
+		flags |= IKC_FLAG_QUEUE_V2;
+	}
+	if (conf->spsc && nprod == 1 && ncons == 1) {
+		flags |= IKC_FLAG_SPSC;
+	}
+
+	run.c = ihk_ikc_create_channel(NULL, 1, pktsize, conf->qsize,
+	                               &rq, &sq, flags);
+	if (!run.c) {
+		fprintf(stderr, "error: creating channel\n");
+		return -ENOMEM;
+	}
+	/* Loop back, the channel writes to its own receive queue */
+	run.c->send.queue = run.c->recv.queue;
+	ihk_ikc_enable_channel(run.c);
+
+	pthread_barrier_init(&run.barrier, NULL, nprod + ncons + 1);
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < nprod + ncons; i++) {
+		threads[i].run = &run;
+		threads[i].cpu = i;
+		if (i < nprod) {
+			threads[i].count = conf->count;
+			pthread_create(&threads[i].thread, NULL, producer,
+			               &threads[i]);
+			continue;
+		}
+
+		threads[i].stride = run.total / ncons / MAX_SAMPLES + 1;
+		threads[i].samples = malloc(sizeof(uint64_t) * MAX_SAMPLES);
+		if (!threads[i].samples) {
+			run.failed = 1;
+		}
+		pthread_create(&threads[i].thread, NULL, consumer, &threads[i]);
+	}
+
+	pthread_barrier_wait(&run.barrier);
+	start = now_ns();
+	for (i = 0; i < nprod + ncons; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	ns = now_ns() - start;
+
+	if (!run.failed) {
+		lat = malloc(sizeof(uint64_t) * MAX_SAMPLES * ncons);
+	}
+	for (i = nprod; lat && i < nprod + ncons; i++) {
+		for (j = 0; j < threads[i].nr_samples; j++) {
+			lat[nr_lat++] = threads[i].samples[j];
+		}
+	}
+	if (nr_lat) {
+		qsort(lat, nr_lat, sizeof(*lat), cmp_u64);
+		printf("%4d %4d %6d %-9s %9.3f %9.1f %9lu %9lu %9lu\n",
+		       nprod, ncons, pktsize,
+		       path == PATH_BATCHED ? "batched" : "unbatched",
+		       run.total * 1e3 / ns, run.total * pktsize * 1e3 / ns,
+		       lat[nr_lat / 2], lat[nr_lat * 99 / 100],
+		       ikc_bench_interrupts - interrupts);
+	}
+
+	for (i = nprod; i < nprod + ncons; i++) {
+		free(threads[i].samples);
+	}
+	free(lat);
+	pthread_barrier_destroy(&run.barrier);
+	ihk_ikc_disable_channel(run.c);
+	run.c->send.queue = NULL;
+	ihk_ikc_free_channel(run.c);
+
+	return run.failed ? -EIO : 0;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [-p producers] [-c consumers] [-s size[,size...]]\n"
+	        "       [-n packets per producer] [-q queue bytes]"
+	        " [-b batch] [-m unbatched|batched|both]\n"
+	        "       [-e] [-S] [-1] [-a]\n"
+	        "  -p, -c  run 1..N producers and consumers (1)\n"
+	        "  -s      packet sizes in bytes, header included (64)\n"
+	        "  -e      interrupt consumers with an eventfd instead of "
+	        "polling\n"
+	        "  -S      single-producer single-consumer queue for 1x1 runs\n"
+	        "  -1      version 1 queue layout\n"
+	        "  -a      pin thread i to CPU i, producers come first\n",
+	        prog);
+}
+
+static int parse_sizes(struct bench_conf *conf, char *arg)
+{
+	char *tok, *save = NULL;
+
+	conf->nr_sizes = 0;
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (conf->nr_sizes == MAX_SIZES) {
+			return -EINVAL;
+		}
+		conf->sizes[conf->nr_sizes] = atoi(tok);
+		if (conf->sizes[conf->nr_sizes] < sizeof(struct bench_pkt)) {
+			fprintf(stderr, "error: packets hold at least %lu bytes\n",
+			        sizeof(struct bench_pkt));
+			return -EINVAL;
+		}
+		conf->nr_sizes++;
+	}
+
+	return conf->nr_sizes ? 0 : -EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_conf conf = {
+		.producers = 1,
+		.consumers = 1,
+		.sizes = { 64 },
+		.nr_sizes = 1,
+		.count = 1000000,
+		.qsize = 64 * 1024,
+		.batch = 16,
+		.paths = PATH_UNBATCHED | PATH_BATCHED,
+	};
+	int np, nc, s, path;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "p:c:s:n:q:b:m:eS1ah")) != -1) {
+		switch (opt) {
+		case 'p':
+			conf.producers = atoi(optarg);
+			break;
+		case 'c':
+			conf.consumers = atoi(optarg);
+			break;
+		case 's':
+			if (parse_sizes(&conf, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			conf.count = atol(optarg);
+			break;
+		case 'q':
+			conf.qsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			conf.batch = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "unbatched")) {
+				conf.paths = PATH_UNBATCHED;
+			} else if (!strcmp(optarg, "batched")) {
+				conf.paths = PATH_BATCHED;
+			} else if (!strcmp(optarg, "both")) {
+				conf.paths = PATH_UNBATCHED | PATH_BATCHED;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'e':
+			conf.use_eventfd = 1;
+			break;
+		case 'S':
+			conf.spsc = 1;
+			break;
+		case '1':
+			conf.v1 = 1;
+			break;
+		case 'a':
+			conf.pin = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (conf.producers < 1 || conf.consumers < 1 ||
+	    conf.producers + conf.consumers > MAX_THREADS ||
+	    conf.count < 1 || conf.batch < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (conf.use_eventfd) {
+		ikc_bench_eventfd = eventfd(0, EFD_NONBLOCK);
+		if (ikc_bench_eventfd < 0) {
+			perror("eventfd");
+			return 1;
+		}
+	}
+
+	num_processors = conf.producers + conf.consumers;
+	ihk_ikc_system_init(NULL);
+
+	printf("%4s %4s %6s %-9s %9s %9s %9s %9s %9s\n",
+	       "prod", "cons", "size", "path", "Mpkt/s", "MB/s",
+	       "p50(ns)", "p99(ns)", "irqs");
+	for (np = 1; np <= conf.producers; np++) {
+		for (nc = 1; nc <= conf.consumers; nc++) {
+			for (s = 0; s < conf.nr_sizes; s++) {
+				for (path = PATH_UNBATCHED;
+				     path <= PATH_BATCHED; path <<= 1) {
+					if (!(conf.paths & path)) {
+						continue;
+					}
+					ret = bench_one(&conf, np, nc,
+					                conf.sizes[s], path);
+					if (ret) {
+						goto out;
+					}
+				}
+			}
+		}
+	}
+
+out:
+	ihk_ikc_system_exit(NULL);
+	if (ikc_bench_eventfd >= 0) {
+		close(ikc_bench_eventfd);
+	}
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * \file ihk/atomic.h
+ * \brief IKC queue benchmark: Atomic counters
+ */
+#ifndef IKC_BENCH_IHK_ATOMIC_H
+#define IKC_BENCH_IHK_ATOMIC_H
+
+typedef struct {
+	int counter;
+} ihk_atomic_t;
+
+static inline int ihk_atomic_inc_return(ihk_atomic_t *v)
+{
+	return __sync_add_and_fetch(&v->counter, 1);
+}
+
+#endif
@@ -0,0 +1,14 @@
+/**
+ * \file ihk/debug.h
+ * \brief IKC queue benchmark: Kernel messages go to stderr
+ */
+#ifndef IKC_BENCH_IHK_DEBUG_H
+#define IKC_BENCH_IHK_DEBUG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define kprintf(...)    fprintf(stderr, __VA_ARGS__)
+#define panic(msg)      do { fprintf(stderr, "panic: %s\n", msg); abort(); } while (0)
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * \file ihk/lock.h
+ * \brief IKC queue benchmark: Spinlocks
+ */
+#ifndef IKC_BENCH_IHK_LOCK_H
+#define IKC_BENCH_IHK_LOCK_H
+
+typedef struct {
+	volatile int lock;
+} ihk_spinlock_t;
+
+static inline void ihk_mc_spinlock_init(ihk_spinlock_t *l)
+{
+	l->lock = 0;
+}
+
+static inline unsigned long ihk_mc_spinlock_lock(ihk_spinlock_t *l)
+{
+	while (__sync_lock_test_and_set(&l->lock, 1)) {
+		while (l->lock) {
+			cpu_pause();
+		}
+	}
+
+	return 0;
+}
+
+static inline void ihk_mc_spinlock_unlock(ihk_spinlock_t *l,
+                                          unsigned long flags)
+{
+	__sync_lock_release(&l->lock);
+}
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * \file ihk/mm.h
+ * \brief IKC queue benchmark: Memory and interrupt services, see glue.c
+ */
+#ifndef IKC_BENCH_IHK_MM_H
+#define IKC_BENCH_IHK_MM_H
+
+#define IHK_GV_IKC      1
+
+struct ihk_mc_interrupt_handler {
+	struct list_head list;
+	void (*func)(void *);
+	void *priv;
+};
+
+/* Physical addresses are virtual ones */
+static inline unsigned long ihk_mc_map_memory(void *os, unsigned long phys,
+                                              unsigned long size)
+{
+	return phys;
+}
+
+static inline void ihk_mc_unmap_memory(void *os, unsigned long phys,
+                                       unsigned long size)
+{
+}
+
+static inline void *ihk_mc_map_virtual(unsigned long phys, int npages,
+                                       int attr)
+{
+	return (void *)phys;
+}
+
+static inline void ihk_mc_unmap_virtual(void *va, int npages)
+{
+}
+
+void *ihk_mc_alloc_pages(int npages, int flag);
+void ihk_mc_free_pages(void *p, int npages);
+void *ihk_mc_allocate(int size, int flag);
+void ihk_mc_free(void *p);
+
+int ihk_mc_register_interrupt_handler(int vector,
+                                      struct ihk_mc_interrupt_handler *h);
+int ihk_mc_unregister_interrupt_handler(int vector,
+                                        struct ihk_mc_interrupt_handler *h);
+int ihk_mc_get_vector(int type);
+
+#endif
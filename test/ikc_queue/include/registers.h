@@ -0,0 +1,30 @@
+/**
+ * \file registers.h
+ * \brief IKC queue benchmark: Time stamp counter
+ */
+#ifndef IKC_BENCH_REGISTERS_H
+#define IKC_BENCH_REGISTERS_H
+
+#include <time.h>
+
+static inline unsigned long rdtsc(void)
+{
+#if defined(__x86_64__)
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long)hi << 32) | lo;
+#elif defined(__aarch64__)
+	unsigned long v;
+
+	asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+#endif
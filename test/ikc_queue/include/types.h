@@ -0,0 +1,45 @@
+/**
+ * \file types.h
+ * \brief IKC queue benchmark: Types and primitives the IHK-Manycore
+ *        headers provide to ikc/ihk.h, on top of libc
+ */
+#ifndef IKC_BENCH_TYPES_H
+#define IKC_BENCH_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define PAGE_SHIFT               12
+#define PAGE_SIZE                (1UL << PAGE_SHIFT)
+
+/* The queues are in the address space of the process */
+#define virt_to_phys(v)          ((unsigned long)(v))
+#define IHK_IKC_QUEUE_PT_ATTR    0
+
+#define barrier()                asm volatile("" ::: "memory")
+#define cmpxchg(p, o, n)         __sync_val_compare_and_swap(p, o, n)
+#define ihk_mc_mb()              __sync_synchronize()
+
+#if defined(__x86_64__)
+#define cpu_pause()              asm volatile("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_pause()              asm volatile("yield" ::: "memory")
+#else
+#define cpu_pause()              barrier()
+#endif
+
+/* Threads are never interrupted by the IKC code */
+static inline unsigned long cpu_disable_interrupt_save(void)
+{
+	return 0;
+}
+
+static inline void cpu_restore_interrupt(unsigned long flags)
+{
+}
+
+extern int num_processors;
+int ihk_mc_get_processor_id(void);
+
+#endif